@@ -0,0 +1,370 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Ildar Sadykov <irsdkv@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "winusb_capture.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CAPTURE_RING_SIZE   (256 * 1024) /* bytes per thread, power of 2 */
+#define CAPTURE_MAX_SNAPLEN 65535
+#define CAPTURE_FLUSH_MS    10
+
+#define LINKTYPE_USB_LINUX  189
+
+#define USB_XFER_CONTROL    2
+#define USB_XFER_BULK       3
+
+/*
+ * Ring entry, the payload follows. An entry with no session is padding up
+ * to the end of the ring.
+ */
+struct capture_rec {
+    uint32_t size; /* whole entry, 8 byte aligned */
+    uint32_t session;
+    uint64_t start;
+    uint64_t end;
+    int fd;
+    int status;
+    ULONG requested;
+    ULONG actual;
+    ULONG caplen;
+    UCHAR endpoint;
+    UCHAR has_setup;
+    WINUSB_SETUP_PACKET setup;
+};
+
+/* Single producer (its thread), single consumer (the flusher) */
+struct capture_ring {
+    struct capture_ring *next;
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+    _Atomic int dead; /* the thread exited, free once drained */
+    uint32_t id;
+    uint64_t seq;
+    unsigned char data[CAPTURE_RING_SIZE];
+};
+
+/* pcap_usb_header of the usbmon link type */
+struct usbmon_packet {
+    uint64_t id;
+    UCHAR type;
+    UCHAR xfer_type;
+    UCHAR epnum;
+    UCHAR devnum;
+    uint16_t busnum;
+    char flag_setup;
+    char flag_data;
+    int64_t ts_sec;
+    int32_t ts_usec;
+    int32_t status;
+    uint32_t length;
+    uint32_t len_cap;
+    UCHAR setup[8];
+};
+
+volatile int wixusb_capture_on;
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct capture_ring *capture_rings; /* under capture_lock */
+static uint32_t capture_ring_ids;
+static pthread_key_t capture_key;
+static pthread_once_t capture_key_once = PTHREAD_ONCE_INIT;
+static __thread struct capture_ring *capture_self;
+
+static _Atomic uint32_t capture_session;
+static _Atomic ULONG capture_snaplen;
+static FILE *capture_file;
+static pthread_t capture_thread;
+static _Atomic int capture_stop;
+static uint64_t capture_dropped_base;
+
+static void capture_thread_exit(void *arg) {
+    struct capture_ring *ring = arg;
+
+    atomic_store_explicit(&ring->dead, 1, memory_order_release);
+}
+
+static void capture_key_init(void) {
+    pthread_key_create(&capture_key, capture_thread_exit);
+}
+
+static struct capture_ring *capture_ring_get(void) {
+    struct capture_ring *ring;
+
+    if (capture_self)
+        return capture_self;
+
+    pthread_once(&capture_key_once, capture_key_init);
+    ring = calloc(1, sizeof (*ring));
+    if (ring == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&capture_lock);
+    ring->id = capture_ring_ids++;
+    ring->next = capture_rings;
+    capture_rings = ring;
+    pthread_mutex_unlock(&capture_lock);
+
+    pthread_setspecific(capture_key, ring);
+    capture_self = ring;
+    return ring;
+}
+
+uint64_t wixusb_capture_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void wixusb_capture(int fd, UCHAR Endpoint,
+        const WINUSB_SETUP_PACKET * Setup, const void * Data,
+        ULONG Requested, ULONG Actual, int Status, uint64_t Start,
+        uint64_t End) {
+    struct capture_ring *ring = capture_ring_get();
+    struct capture_rec *rec;
+    uint64_t head, tail, pos, room;
+    ULONG caplen, size;
+
+    if (ring == NULL)
+        return;
+
+    /* OUT data is what was offered, IN data what came back */
+    caplen = (Endpoint & 0x80) ? Actual : Requested;
+    if (caplen > atomic_load_explicit(&capture_snaplen, memory_order_relaxed))
+        caplen = atomic_load_explicit(&capture_snaplen, memory_order_relaxed);
+    if (Data == NULL)
+        caplen = 0;
+    size = (sizeof (*rec) + caplen + 7) & ~7U;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    pos = head & (CAPTURE_RING_SIZE - 1);
+    room = CAPTURE_RING_SIZE - pos;
+
+    /* an entry does not wrap, pad the end of the ring instead */
+    if (head + (size > room ? room + size : size) - tail > CAPTURE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    if (size > room) {
+        rec = (struct capture_rec *) &ring->data[pos];
+        rec->size = room;
+        rec->session = 0;
+        head += room;
+        pos = 0;
+    }
+
+    rec = (struct capture_rec *) &ring->data[pos];
+    rec->size = size;
+    rec->session = atomic_load_explicit(&capture_session, memory_order_relaxed);
+    rec->start = Start;
+    rec->end = End;
+    rec->fd = fd;
+    rec->status = Status;
+    rec->requested = Requested;
+    rec->actual = Actual;
+    rec->caplen = caplen;
+    rec->endpoint = Endpoint;
+    rec->has_setup = Setup != NULL;
+    if (Setup)
+        rec->setup = *Setup;
+    if (caplen)
+        memcpy(rec + 1, Data, caplen);
+
+    atomic_store_explicit(&ring->head, head + size, memory_order_release);
+}
+
+static void capture_write(FILE *f, struct usbmon_packet *pkt, uint64_t ts, const void *data,
+        uint32_t caplen) {
+    uint32_t hdr[4];
+
+    pkt->ts_sec = ts / 1000000000ULL;
+    pkt->ts_usec = (ts % 1000000000ULL) / 1000;
+    pkt->len_cap = caplen;
+
+    hdr[0] = pkt->ts_sec;
+    hdr[1] = pkt->ts_usec;
+    hdr[2] = sizeof (*pkt) + caplen;
+    hdr[3] = sizeof (*pkt) + pkt->length;
+    fwrite(hdr, sizeof (hdr), 1, f);
+    fwrite(pkt, sizeof (*pkt), 1, f);
+    if (caplen)
+        fwrite(data, caplen, 1, f);
+}
+
+/* A transfer becomes a submission and a completion, as usbmon shows it */
+static void capture_emit(FILE *f, struct capture_ring *ring,
+        const struct capture_rec *rec) {
+    struct usbmon_packet pkt;
+    BOOL in = (rec->endpoint & 0x80) != 0;
+
+    memset(&pkt, 0, sizeof (pkt));
+    pkt.id = ((uint64_t) ring->id << 40) | ring->seq++;
+    pkt.xfer_type = rec->has_setup ? USB_XFER_CONTROL : USB_XFER_BULK;
+    pkt.epnum = rec->endpoint;
+    pkt.devnum = rec->fd & 0x7f;
+    pkt.busnum = 0;
+
+    pkt.type = 'S';
+    pkt.flag_setup = rec->has_setup ? 0 : '-';
+    if (rec->has_setup)
+        memcpy(pkt.setup, &rec->setup, sizeof (pkt.setup));
+    pkt.flag_data = in ? '<' : 0;
+    pkt.status = -EINPROGRESS;
+    pkt.length = rec->requested;
+    capture_write(f, &pkt, rec->start, rec + 1, in ? 0 : rec->caplen);
+
+    pkt.type = 'C';
+    pkt.flag_setup = '-';
+    memset(pkt.setup, 0, sizeof (pkt.setup));
+    pkt.flag_data = in ? 0 : '>';
+    pkt.status = rec->status;
+    pkt.length = rec->actual;
+    capture_write(f, &pkt, rec->end, rec + 1, in ? rec->caplen : 0);
+}
+
+static void capture_drain(FILE *f) {
+    struct capture_ring **link, *ring;
+    uint32_t session = atomic_load(&capture_session);
+    uint64_t head, tail;
+    int dead;
+
+    pthread_mutex_lock(&capture_lock);
+    link = &capture_rings;
+    while ((ring = *link) != NULL) {
+        /* read dead first, everything before it is published */
+        dead = atomic_load_explicit(&ring->dead, memory_order_acquire);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        while (tail != head) {
+            const struct capture_rec *rec = (const struct capture_rec *)
+                    &ring->data[tail & (CAPTURE_RING_SIZE - 1)];
+
+            /* entries of an earlier capture are skipped */
+            if (rec->session == session)
+                capture_emit(f, ring, rec);
+            tail += rec->size;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        if (dead) {
+            capture_dropped_base += atomic_load(&ring->dropped);
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+static void *capture_flusher(void *arg) {
+    struct timespec period = {0, CAPTURE_FLUSH_MS * 1000000L};
+    FILE *f = arg;
+
+    while (!atomic_load(&capture_stop)) {
+        nanosleep(&period, NULL);
+        capture_drain(f);
+    }
+    capture_drain(f);
+    return NULL;
+}
+
+BOOL WixUsb_StartCapture(const char * Path, ULONG Snaplen) {
+    struct {
+        uint32_t magic;
+        uint16_t version_major;
+        uint16_t version_minor;
+        int32_t thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t network;
+    } pcap_hdr = {0xa1b2c3d4, 2, 4, 0, 0, 0, LINKTYPE_USB_LINUX};
+    struct capture_ring *ring;
+
+    if (capture_file != NULL) {
+        errno = EBUSY;
+        return FALSE;
+    }
+    if (Snaplen > CAPTURE_MAX_SNAPLEN)
+        Snaplen = CAPTURE_MAX_SNAPLEN;
+
+    capture_file = fopen(Path, "wb");
+    if (capture_file == NULL)
+        return FALSE;
+    pcap_hdr.snaplen = sizeof (struct usbmon_packet) + Snaplen;
+    fwrite(&pcap_hdr, sizeof (pcap_hdr), 1, capture_file);
+
+    pthread_mutex_lock(&capture_lock);
+    capture_dropped_base = 0;
+    for (ring = capture_rings; ring; ring = ring->next)
+        capture_dropped_base -= atomic_load(&ring->dropped);
+    pthread_mutex_unlock(&capture_lock);
+
+    /* session 0 marks padding, skip it */
+    if (atomic_fetch_add(&capture_session, 1) + 1 == 0)
+        atomic_fetch_add(&capture_session, 1);
+    atomic_store(&capture_snaplen, Snaplen);
+    atomic_store(&capture_stop, 0);
+    if (pthread_create(&capture_thread, NULL, capture_flusher,
+            capture_file) != 0) {
+        fclose(capture_file);
+        capture_file = NULL;
+        return FALSE;
+    }
+
+    wixusb_capture_on = 1;
+    return TRUE;
+}
+
+void WixUsb_StopCapture(void) {
+    if (capture_file == NULL)
+        return;
+
+    wixusb_capture_on = 0;
+    atomic_store(&capture_stop, 1);
+    pthread_join(capture_thread, NULL);
+    fclose(capture_file);
+    capture_file = NULL;
+}
+
+uint64_t WixUsb_CaptureDropped(void) {
+    struct capture_ring *ring;
+    uint64_t dropped;
+
+    pthread_mutex_lock(&capture_lock);
+    dropped = capture_dropped_base;
+    for (ring = capture_rings; ring; ring = ring->next)
+        dropped += atomic_load(&ring->dropped);
+    pthread_mutex_unlock(&capture_lock);
+    return dropped;
+}
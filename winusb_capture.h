@@ -0,0 +1,69 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Ildar Sadykov <irsdkv@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Transfer capture of the wrapper calls, written as a pcap file with the
+ * usbmon link type so Wireshark can open it. Each thread records into its
+ * own ring without locks, a background thread writes the rings out. When
+ * a ring is full the transfer is counted as dropped instead of waiting.
+ *
+ * The device number in the capture is the handle's fd.
+ */
+
+#ifndef WINUSB_CAPTURE_H
+#define WINUSB_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "wixusb_driver_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Snaplen is the payload bytes kept per transfer, 0 keeps headers only */
+BOOL WixUsb_StartCapture(const char * Path, ULONG Snaplen);
+
+/* Writes out what is left and closes the file */
+void WixUsb_StopCapture(void);
+
+/* Transfers lost to full rings since the capture started */
+uint64_t WixUsb_CaptureDropped(void);
+
+/* Used by the wrapper */
+extern volatile int wixusb_capture_on;
+
+uint64_t wixusb_capture_now(void);
+
+/* Setup is NULL except for control transfers */
+void wixusb_capture(int fd, UCHAR Endpoint,
+        const WINUSB_SETUP_PACKET * Setup, const void * Data,
+        ULONG Requested, ULONG Actual, int Status, uint64_t Start,
+        uint64_t End);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WINUSB_CAPTURE_H */
@@ -0,0 +1,504 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Ildar Sadykov <irsdkv@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "winusb_iocp.h"
+#include "winusb_wrapper.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define IOCP_MAX_THREADS    64
+#define IOCP_EVENTS         16
+
+struct iocp_op {
+    struct iocp_op *next;
+    int kind;
+    PUCHAR buffer;
+    ULONG length;
+    WINUSB_SETUP_PACKET setup;
+    WIXUSB_COMPLETION_ENTRY entry;
+};
+
+struct iocp_queue {
+    struct iocp_op *head;
+    struct iocp_op *tail;
+};
+
+struct iocp_binding {
+    wixusb_iocp *port;
+    int fd;
+    uintptr_t key;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    struct iocp_queue ops;
+    BOOL busy; /* an I/O thread owns the handle */
+    BOOL armed; /* an event is pending, its thread will claim the handle */
+};
+
+struct wixusb_iocp {
+    int epfd;
+    int stopfd;
+    pthread_t threads[IOCP_MAX_THREADS];
+    ULONG nthreads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct iocp_queue done;
+};
+
+/* Bindings indexed by fd */
+static pthread_mutex_t bindings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct iocp_binding **bindings;
+static int nbindings;
+
+static void queue_push(struct iocp_queue *q, struct iocp_op *op) {
+    op->next = NULL;
+    if (q->tail)
+        q->tail->next = op;
+    else
+        q->head = op;
+    q->tail = op;
+}
+
+static struct iocp_op *queue_pop(struct iocp_queue *q) {
+    struct iocp_op *op = q->head;
+
+    if (op) {
+        q->head = op->next;
+        if (!q->head)
+            q->tail = NULL;
+    }
+    return op;
+}
+
+static void iocp_complete(wixusb_iocp *port, struct iocp_op *op) {
+    pthread_mutex_lock(&port->lock);
+    queue_push(&port->done, op);
+    pthread_cond_signal(&port->ready);
+    pthread_mutex_unlock(&port->lock);
+}
+
+/*
+ * Returns the binding with b->lock held. It is taken under bindings_lock, so
+ * unbind, which needs b->lock before it frees, cannot free it under us.
+ */
+static struct iocp_binding *binding_lock(int fd) {
+    struct iocp_binding *b = NULL;
+
+    pthread_mutex_lock(&bindings_lock);
+    if (fd >= 0 && fd < nbindings)
+        b = bindings[fd];
+    if (b)
+        pthread_mutex_lock(&b->lock);
+    pthread_mutex_unlock(&bindings_lock);
+    return b;
+}
+
+/*
+ * Called with b->lock held and the handle neither busy nor armed. Reads
+ * waiting for data only need POLLIN, writes wait for POLLOUT once the last
+ * one is off the bus, control transfers can start right away.
+ */
+static void binding_arm(struct iocp_binding *b) {
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLONESHOT,
+        .data.fd = b->fd,
+    };
+    struct iocp_op *op;
+
+    if (!b->ops.head)
+        return;
+    for (op = b->ops.head; op; op = op->next) {
+        if (op->kind != WIXUSB_IOCP_READ)
+            ev.events |= EPOLLOUT;
+    }
+    if (epoll_ctl(b->port->epfd, EPOLL_CTL_MOD, b->fd, &ev) == 0)
+        b->armed = TRUE;
+}
+
+/* Returns FALSE if the transfer would block */
+static BOOL iocp_run(struct iocp_binding *b, struct iocp_op *op) {
+    uint32_t len32 = 0;
+    ULONG len = 0;
+    BOOL ok;
+
+    switch (op->kind) {
+        case WIXUSB_IOCP_READ:
+            ok = WixUsb_ReadBulk(b->fd, op->buffer, op->length, &len32);
+            len = len32;
+            break;
+        case WIXUSB_IOCP_WRITE:
+            ok = WixUsb_WriteBulk(b->fd, op->buffer, op->length, &len);
+            break;
+        default:
+            ok = WinUsb_ControlTransfer(b->fd, op->setup, op->buffer,
+                    op->length, &len, NULL);
+            break;
+    }
+
+    if (ok != TRUE && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return FALSE;
+
+    op->entry.BytesTransferred = (ok == TRUE) ? len : 0;
+    op->entry.Status = (ok == TRUE) ? 0 : errno;
+    return TRUE;
+}
+
+/*
+ * Events carry the fd, not the binding: a handle unbound while its event is
+ * pending is simply not found. The binding is claimed under bindings_lock so
+ * unbind can wait for it, and only by one thread at a time.
+ */
+static struct iocp_binding *iocp_claim(wixusb_iocp *port, int fd) {
+    struct iocp_binding *b = binding_lock(fd);
+
+    if (b == NULL)
+        return NULL;
+    if (b->port != port || b->busy) {
+        pthread_mutex_unlock(&b->lock);
+        return NULL;
+    }
+    b->busy = TRUE;
+    b->armed = FALSE;
+    pthread_mutex_unlock(&b->lock);
+    return b;
+}
+
+static void iocp_service(struct iocp_binding *b) {
+    struct iocp_queue retry = {NULL, NULL};
+    struct iocp_op *op;
+
+    pthread_mutex_lock(&b->lock);
+    while ((op = queue_pop(&b->ops)) != NULL) {
+        /* a read waiting for data keeps the ones behind it waiting too */
+        if (retry.head && op->kind == WIXUSB_IOCP_READ) {
+            queue_push(&retry, op);
+            continue;
+        }
+        pthread_mutex_unlock(&b->lock);
+
+        if (iocp_run(b, op))
+            iocp_complete(b->port, op);
+        else
+            queue_push(&retry, op);
+
+        pthread_mutex_lock(&b->lock);
+    }
+
+    b->ops = retry;
+    b->busy = FALSE;
+    binding_arm(b);
+    pthread_cond_broadcast(&b->idle);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void *iocp_thread(void *arg) {
+    wixusb_iocp *port = arg;
+    struct epoll_event events[IOCP_EVENTS];
+    struct iocp_binding *b;
+    int i, n;
+
+    for (;;) {
+        n = epoll_wait(port->epfd, events, IOCP_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (i = 0; i < n; i++) {
+            /* the stop event is level triggered and wakes every thread */
+            if (events[i].data.fd == port->stopfd)
+                return NULL;
+            b = iocp_claim(port, events[i].data.fd);
+            if (b)
+                iocp_service(b);
+        }
+    }
+    return NULL;
+}
+
+wixusb_iocp * WixUsb_CreateCompletionPort(ULONG IoThreads) {
+    struct epoll_event ev = {.events = EPOLLIN};
+    pthread_condattr_t attr;
+    wixusb_iocp *port;
+
+    if (IoThreads == 0 || IoThreads > IOCP_MAX_THREADS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    port = calloc(1, sizeof (*port));
+    if (port == NULL)
+        return NULL;
+
+    port->stopfd = -1;
+    port->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (port->epfd < 0)
+        goto error;
+    port->stopfd = eventfd(0, EFD_CLOEXEC);
+    if (port->stopfd < 0)
+        goto error;
+    ev.data.fd = port->stopfd;
+    if (epoll_ctl(port->epfd, EPOLL_CTL_ADD, port->stopfd, &ev) < 0)
+        goto error;
+
+    pthread_mutex_init(&port->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&port->ready, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (port->nthreads = 0; port->nthreads < IoThreads; port->nthreads++) {
+        if (pthread_create(&port->threads[port->nthreads], NULL, iocp_thread,
+                port) != 0) {
+            WixUsb_CloseCompletionPort(port);
+            return NULL;
+        }
+    }
+    return port;
+
+error:
+    if (port->stopfd >= 0)
+        close(port->stopfd);
+    if (port->epfd >= 0)
+        close(port->epfd);
+    free(port);
+    return NULL;
+}
+
+void WixUsb_CloseCompletionPort(wixusb_iocp * Port) {
+    struct iocp_op *op;
+    uint64_t one = 1;
+    ULONG i;
+    int fd;
+
+    if (Port == NULL)
+        return;
+
+    if (write(Port->stopfd, &one, sizeof (one)) < 0)
+        return;
+    for (i = 0; i < Port->nthreads; i++)
+        pthread_join(Port->threads[i], NULL);
+
+    /* the handles still bound lose their queued transfers */
+    for (fd = 0; fd < nbindings; fd++) {
+        struct iocp_binding *b = binding_lock(fd);
+        BOOL ours;
+
+        if (b == NULL)
+            continue;
+        ours = b->port == Port;
+        pthread_mutex_unlock(&b->lock);
+        if (ours)
+            WixUsb_UnbindCompletionPort(fd);
+    }
+
+    while ((op = queue_pop(&Port->done)) != NULL)
+        free(op);
+    close(Port->stopfd);
+    close(Port->epfd);
+    pthread_cond_destroy(&Port->ready);
+    pthread_mutex_destroy(&Port->lock);
+    free(Port);
+}
+
+BOOL WixUsb_BindCompletionPort(wixusb_iocp * Port, int InterfaceHandle,
+        uintptr_t CompletionKey) {
+    struct epoll_event ev;
+    struct iocp_binding *b;
+    int flags;
+
+    if (InterfaceHandle < 0) {
+        errno = EBADF;
+        return FALSE;
+    }
+
+    b = calloc(1, sizeof (*b));
+    if (b == NULL)
+        return FALSE;
+    b->port = Port;
+    b->fd = InterfaceHandle;
+    b->key = CompletionKey;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->idle, NULL);
+
+    pthread_mutex_lock(&bindings_lock);
+    if (InterfaceHandle >= nbindings) {
+        int n = InterfaceHandle + 64;
+        struct iocp_binding **tmp = realloc(bindings, n * sizeof (*tmp));
+
+        if (tmp == NULL)
+            goto error;
+        memset(tmp + nbindings, 0, (n - nbindings) * sizeof (*tmp));
+        bindings = tmp;
+        nbindings = n;
+    }
+    if (bindings[InterfaceHandle] != NULL) {
+        errno = EBUSY;
+        goto error;
+    }
+
+    flags = fcntl(InterfaceHandle, F_GETFL);
+    if (flags < 0 || fcntl(InterfaceHandle, F_SETFL, flags | O_NONBLOCK) < 0)
+        goto error;
+
+    /* registered disarmed, the first transfer arms it */
+    ev.events = EPOLLONESHOT;
+    ev.data.fd = InterfaceHandle;
+    if (epoll_ctl(Port->epfd, EPOLL_CTL_ADD, InterfaceHandle, &ev) < 0)
+        goto error;
+
+    bindings[InterfaceHandle] = b;
+    pthread_mutex_unlock(&bindings_lock);
+    return TRUE;
+
+error:
+    pthread_mutex_unlock(&bindings_lock);
+    pthread_cond_destroy(&b->idle);
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+    return FALSE;
+}
+
+BOOL WixUsb_UnbindCompletionPort(int InterfaceHandle) {
+    struct iocp_binding *b;
+    struct iocp_op *op;
+
+    pthread_mutex_lock(&bindings_lock);
+    b = (InterfaceHandle >= 0 && InterfaceHandle < nbindings) ?
+            bindings[InterfaceHandle] : NULL;
+    if (b)
+        bindings[InterfaceHandle] = NULL;
+    pthread_mutex_unlock(&bindings_lock);
+
+    if (b == NULL) {
+        errno = ENOENT;
+        return FALSE;
+    }
+
+    pthread_mutex_lock(&b->lock);
+    while (b->busy)
+        pthread_cond_wait(&b->idle, &b->lock);
+    epoll_ctl(b->port->epfd, EPOLL_CTL_DEL, b->fd, NULL);
+    while ((op = queue_pop(&b->ops)) != NULL) {
+        op->entry.Status = ECANCELED;
+        iocp_complete(b->port, op);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    pthread_cond_destroy(&b->idle);
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+    return TRUE;
+}
+
+BOOL WixUsb_GetQueuedCompletionStatusEx(wixusb_iocp * Port,
+        WIXUSB_COMPLETION_ENTRY * Entries, ULONG Count, PULONG Removed,
+        int Timeout) {
+    struct iocp_op *op;
+    struct timespec deadline;
+    ULONG n = 0;
+
+    if (Timeout >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += Timeout / 1000;
+        deadline.tv_nsec += (Timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&Port->lock);
+    while (Port->done.head == NULL) {
+        if (Timeout < 0) {
+            pthread_cond_wait(&Port->ready, &Port->lock);
+        } else if (pthread_cond_timedwait(&Port->ready, &Port->lock,
+                &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&Port->lock);
+            *Removed = 0;
+            errno = ETIMEDOUT;
+            return FALSE;
+        }
+    }
+
+    while (n < Count && (op = queue_pop(&Port->done)) != NULL) {
+        Entries[n++] = op->entry;
+        free(op);
+    }
+    /* more left, let another worker take them */
+    if (Port->done.head)
+        pthread_cond_signal(&Port->ready);
+    pthread_mutex_unlock(&Port->lock);
+
+    *Removed = n;
+    return TRUE;
+}
+
+BOOL WixUsb_PostQueuedCompletionStatus(wixusb_iocp * Port,
+        ULONG BytesTransferred, uintptr_t CompletionKey,
+        LPOVERLAPPED Overlapped) {
+    struct iocp_op *op = calloc(1, sizeof (*op));
+
+    if (op == NULL)
+        return FALSE;
+    op->entry.CompletionKey = CompletionKey;
+    op->entry.Overlapped = Overlapped;
+    op->entry.BytesTransferred = BytesTransferred;
+    iocp_complete(Port, op);
+    return TRUE;
+}
+
+BOOL wixusb_iocp_submit(int fd, int kind, const WINUSB_SETUP_PACKET * Setup,
+        PUCHAR Buffer, ULONG BufferLength, LPOVERLAPPED Overlapped) {
+    struct iocp_binding *b;
+    struct iocp_op *op;
+
+    op = calloc(1, sizeof (*op));
+    if (op == NULL)
+        return FALSE;
+    op->kind = kind;
+    op->buffer = Buffer;
+    op->length = BufferLength;
+    if (Setup)
+        op->setup = *Setup;
+    op->entry.Overlapped = Overlapped;
+
+    b = binding_lock(fd);
+    if (b == NULL) {
+        free(op);
+        errno = EBADF;
+        return FALSE;
+    }
+    op->entry.CompletionKey = b->key;
+    queue_push(&b->ops, op);
+    /* a busy or armed handle is re-armed by the thread that claims it */
+    if (!b->busy && !b->armed)
+        binding_arm(b);
+    pthread_mutex_unlock(&b->lock);
+    return TRUE;
+}
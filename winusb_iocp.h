@@ -0,0 +1,98 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Ildar Sadykov <irsdkv@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * I/O completion port in the Windows style. A handle bound to a port runs
+ * its overlapped WinUsb_ReadPipe/WritePipe/ControlTransfer calls on the
+ * port's I/O threads, which wait for the device fds with epoll. Finished
+ * transfers are queued on the port and dequeued in batches by any number
+ * of worker threads with WixUsb_GetQueuedCompletionStatusEx.
+ *
+ * Transfers of one handle run one at a time and in submission order.
+ */
+
+#ifndef WINUSB_IOCP_H
+#define WINUSB_IOCP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "wixusb_driver_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct wixusb_iocp wixusb_iocp;
+
+/* OVERLAPPED_ENTRY */
+typedef struct {
+    uintptr_t CompletionKey;
+    LPOVERLAPPED Overlapped;
+    ULONG BytesTransferred;
+    int Status; /* 0 or an errno value */
+} WIXUSB_COMPLETION_ENTRY;
+
+/*
+ * IoThreads is the number of threads issuing transfers, a blocked transfer
+ * holds one of them until it completes.
+ */
+wixusb_iocp * WixUsb_CreateCompletionPort(ULONG IoThreads);
+
+/* Fails the transfers not started yet with ECANCELED */
+void WixUsb_CloseCompletionPort(wixusb_iocp * Port);
+
+/* The handle is switched to non-blocking mode */
+BOOL WixUsb_BindCompletionPort(wixusb_iocp * Port, int InterfaceHandle,
+        uintptr_t CompletionKey);
+
+/*
+ * Call before closing a bound handle. Waits for the running transfer,
+ * the queued ones complete with ECANCELED.
+ */
+BOOL WixUsb_UnbindCompletionPort(int InterfaceHandle);
+
+/* Timeout in ms, -1 waits forever. Fails with ETIMEDOUT. */
+BOOL WixUsb_GetQueuedCompletionStatusEx(wixusb_iocp * Port,
+        WIXUSB_COMPLETION_ENTRY * Entries, ULONG Count, PULONG Removed,
+        int Timeout);
+
+BOOL WixUsb_PostQueuedCompletionStatus(wixusb_iocp * Port,
+        ULONG BytesTransferred, uintptr_t CompletionKey,
+        LPOVERLAPPED Overlapped);
+
+/* Used by the wrapper for overlapped calls, fails if the fd is not bound */
+enum {
+    WIXUSB_IOCP_READ,
+    WIXUSB_IOCP_WRITE,
+    WIXUSB_IOCP_CTRL,
+};
+
+BOOL wixusb_iocp_submit(int fd, int kind, const WINUSB_SETUP_PACKET * Setup,
+        PUCHAR Buffer, ULONG BufferLength, LPOVERLAPPED Overlapped);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WINUSB_IOCP_H */
@@ -0,0 +1,380 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Ildar Sadykov <irsdkv@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "winusb_stats.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STATS_SERIES        64 /* handle and pipe pairs per thread */
+
+/*
+ * Written by its thread only, so a count is a relaxed load and store rather
+ * than a locked add. The snapshot reads them while they move.
+ */
+struct stats_series {
+    int fd;
+    UCHAR endpoint;
+    _Atomic uint64_t errors;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t latency[WIXUSB_STATS_BUCKETS];
+};
+
+struct stats_table {
+    struct stats_table *next;
+    _Atomic uint32_t gen; /* counts from an older recording when stale */
+    _Atomic(struct stats_series *) series[STATS_SERIES];
+};
+
+volatile int wixusb_stats_on;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_table *stats_tables; /* under stats_lock */
+static struct stats_table stats_retired; /* exited threads, under stats_lock */
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_table *stats_self;
+
+static _Atomic uint32_t stats_gen;
+static uint64_t stats_started; /* under stats_lock */
+static uint64_t stats_stopped;
+
+static inline void counter_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter,
+            atomic_load_explicit(counter, memory_order_relaxed) + n,
+            memory_order_relaxed);
+}
+
+static inline uint64_t counter_get(_Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static unsigned int stats_bucket(uint64_t ns) {
+    unsigned int msb, sub;
+
+    if (ns < WIXUSB_STATS_SUB_BUCKETS)
+        return ns;
+    if (ns >> WIXUSB_STATS_MAX_SHIFT)
+        return WIXUSB_STATS_BUCKETS - 1;
+
+    msb = 63 - __builtin_clzll(ns);
+    sub = (ns >> (msb - WIXUSB_STATS_SUB_BITS)) &
+            (WIXUSB_STATS_SUB_BUCKETS - 1);
+    return (msb - WIXUSB_STATS_SUB_BITS + 1) * WIXUSB_STATS_SUB_BUCKETS + sub;
+}
+
+/* Largest value counted in the bucket */
+static uint64_t stats_bucket_max(unsigned int bucket) {
+    unsigned int shift;
+    uint64_t sub;
+
+    if (bucket < WIXUSB_STATS_SUB_BUCKETS)
+        return bucket;
+
+    shift = bucket / WIXUSB_STATS_SUB_BUCKETS - 1;
+    sub = bucket % WIXUSB_STATS_SUB_BUCKETS;
+    return ((WIXUSB_STATS_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+static void series_clear(struct stats_series *s) {
+    unsigned int i;
+
+    atomic_store_explicit(&s->errors, 0, memory_order_relaxed);
+    atomic_store_explicit(&s->bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&s->max_ns, 0, memory_order_relaxed);
+    for (i = 0; i < WIXUSB_STATS_BUCKETS; i++)
+        atomic_store_explicit(&s->latency[i], 0, memory_order_relaxed);
+}
+
+static void table_clear(struct stats_table *t, uint32_t gen) {
+    struct stats_series *s;
+    unsigned int i;
+
+    for (i = 0; i < STATS_SERIES; i++) {
+        s = atomic_load_explicit(&t->series[i], memory_order_relaxed);
+        if (s != NULL)
+            series_clear(s);
+    }
+    atomic_store_explicit(&t->gen, gen, memory_order_release);
+}
+
+static struct stats_series *table_series(struct stats_table *t, int fd,
+        UCHAR Endpoint, BOOL Create) {
+    struct stats_series *s;
+    unsigned int i, slot = ((unsigned int) fd * 31 + Endpoint) % STATS_SERIES;
+
+    for (i = 0; i < STATS_SERIES; i++) {
+        s = atomic_load_explicit(&t->series[slot], memory_order_acquire);
+        if (s == NULL)
+            break;
+        if (s->fd == fd && s->endpoint == Endpoint)
+            return s;
+        slot = (slot + 1) % STATS_SERIES;
+    }
+    if (!Create || s != NULL)
+        return NULL;
+
+    s = calloc(1, sizeof (*s));
+    if (s == NULL)
+        return NULL;
+    s->fd = fd;
+    s->endpoint = Endpoint;
+    atomic_store_explicit(&t->series[slot], s, memory_order_release);
+    return s;
+}
+
+static void table_fold(struct stats_table *to, struct stats_table *from) {
+    struct stats_series *src, *dst;
+    uint64_t max;
+    unsigned int i, j;
+
+    for (i = 0; i < STATS_SERIES; i++) {
+        src = atomic_load_explicit(&from->series[i], memory_order_acquire);
+        if (src == NULL)
+            continue;
+        dst = table_series(to, src->fd, src->endpoint, TRUE);
+        if (dst == NULL)
+            continue;
+
+        counter_add(&dst->errors, counter_get(&src->errors));
+        counter_add(&dst->bytes, counter_get(&src->bytes));
+        max = counter_get(&src->max_ns);
+        if (max > counter_get(&dst->max_ns))
+            atomic_store_explicit(&dst->max_ns, max, memory_order_relaxed);
+        for (j = 0; j < WIXUSB_STATS_BUCKETS; j++)
+            counter_add(&dst->latency[j], counter_get(&src->latency[j]));
+    }
+}
+
+static void table_free(struct stats_table *t) {
+    unsigned int i;
+
+    for (i = 0; i < STATS_SERIES; i++)
+        free(atomic_load_explicit(&t->series[i], memory_order_relaxed));
+    free(t);
+}
+
+/* Keeps the counts of the exiting thread in the retired table */
+static void stats_thread_exit(void *arg) {
+    struct stats_table *t = arg, **pos;
+
+    pthread_mutex_lock(&stats_lock);
+    for (pos = &stats_tables; *pos != t; pos = &(*pos)->next)
+        ;
+    *pos = t->next;
+    if (atomic_load(&t->gen) == atomic_load(&stats_gen))
+        table_fold(&stats_retired, t);
+    pthread_mutex_unlock(&stats_lock);
+
+    table_free(t);
+}
+
+static void stats_key_init(void) {
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+static struct stats_table *stats_table_get(void) {
+    struct stats_table *t = stats_self;
+    uint32_t gen = atomic_load_explicit(&stats_gen, memory_order_acquire);
+
+    if (t != NULL) {
+        if (atomic_load_explicit(&t->gen, memory_order_relaxed) != gen)
+            table_clear(t, gen);
+        return t;
+    }
+
+    pthread_once(&stats_key_once, stats_key_init);
+    t = calloc(1, sizeof (*t));
+    if (t == NULL)
+        return NULL;
+    atomic_init(&t->gen, gen);
+
+    pthread_mutex_lock(&stats_lock);
+    t->next = stats_tables;
+    stats_tables = t;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, t);
+    stats_self = t;
+    return t;
+}
+
+uint64_t wixusb_stats_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void wixusb_stats_record(int fd, UCHAR Endpoint, ULONG Actual, int Status,
+        uint64_t Start) {
+    uint64_t ns = wixusb_stats_now() - Start;
+    struct stats_table *t;
+    struct stats_series *s;
+
+    /* recording started during the call */
+    if (Start == 0)
+        return;
+
+    t = stats_table_get();
+    if (t == NULL)
+        return;
+    s = table_series(t, fd, Endpoint, TRUE);
+    if (s == NULL)
+        return;
+
+    counter_add(&s->latency[stats_bucket(ns)], 1);
+    if (Status < 0)
+        counter_add(&s->errors, 1);
+    else if (Actual != 0)
+        counter_add(&s->bytes, Actual);
+    if (ns > counter_get(&s->max_ns))
+        atomic_store_explicit(&s->max_ns, ns, memory_order_relaxed);
+}
+
+void WixUsb_StartLatencyStats(void) {
+    struct stats_series *s;
+    unsigned int i;
+
+    pthread_mutex_lock(&stats_lock);
+    /* the threads clear their own tables on their next call */
+    atomic_fetch_add(&stats_gen, 1);
+    for (i = 0; i < STATS_SERIES; i++) {
+        s = atomic_load_explicit(&stats_retired.series[i],
+                memory_order_relaxed);
+        if (s != NULL)
+            series_clear(s);
+    }
+    stats_started = wixusb_stats_now();
+    stats_stopped = 0;
+    wixusb_stats_on = 1;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void WixUsb_StopLatencyStats(void) {
+    pthread_mutex_lock(&stats_lock);
+    if (wixusb_stats_on) {
+        wixusb_stats_on = 0;
+        stats_stopped = wixusb_stats_now();
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void snapshot_add(wixusb_latency_series_t * Series, ULONG MaxSeries,
+        ULONG * Count, struct stats_table *t) {
+    wixusb_latency_series_t *out;
+    struct stats_series *s;
+    uint64_t max, n;
+    unsigned int i, j;
+    ULONG k;
+
+    for (i = 0; i < STATS_SERIES; i++) {
+        s = atomic_load_explicit(&t->series[i], memory_order_acquire);
+        if (s == NULL)
+            continue;
+
+        for (k = 0; k < *Count; k++)
+            if (Series[k].fd == s->fd && Series[k].endpoint == s->endpoint)
+                break;
+        if (k == *Count) {
+            if (*Count == MaxSeries)
+                continue;
+            memset(&Series[k], 0, sizeof (Series[k]));
+            Series[k].fd = s->fd;
+            Series[k].endpoint = s->endpoint;
+            (*Count)++;
+        }
+
+        out = &Series[k];
+        out->errors += counter_get(&s->errors);
+        out->bytes += counter_get(&s->bytes);
+        max = counter_get(&s->max_ns);
+        if (max > out->max_ns)
+            out->max_ns = max;
+        for (j = 0; j < WIXUSB_STATS_BUCKETS; j++) {
+            n = counter_get(&s->latency[j]);
+            out->latency[j] += n;
+            out->calls += n;
+        }
+    }
+}
+
+ULONG WixUsb_LatencySnapshot(wixusb_latency_series_t * Series,
+        ULONG MaxSeries, uint64_t * Elapsed) {
+    struct stats_table *t;
+    uint32_t gen;
+    ULONG count = 0;
+
+    pthread_mutex_lock(&stats_lock);
+    gen = atomic_load(&stats_gen);
+    snapshot_add(Series, MaxSeries, &count, &stats_retired);
+    for (t = stats_tables; t != NULL; t = t->next)
+        if (atomic_load_explicit(&t->gen, memory_order_acquire) == gen)
+            snapshot_add(Series, MaxSeries, &count, t);
+
+    if (Elapsed != NULL) {
+        if (stats_started == 0)
+            *Elapsed = 0;
+        else
+            *Elapsed = (stats_stopped ? stats_stopped : wixusb_stats_now()) -
+                    stats_started;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    return count;
+}
+
+uint64_t WixUsb_SeriesPercentile(const wixusb_latency_series_t * Series,
+        double Percentile) {
+    uint64_t seen = 0, rank, bound;
+    unsigned int i;
+
+    if (Series->calls == 0)
+        return 0;
+
+    /* the rank-th smallest latency, counted from 1 */
+    rank = (uint64_t) (Percentile / 100.0 * Series->calls + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < WIXUSB_STATS_BUCKETS - 1; i++) {
+        seen += Series->latency[i];
+        if (seen >= rank)
+            break;
+    }
+
+    /* the top bucket is no wider than the slowest call */
+    bound = stats_bucket_max(i);
+    return bound < Series->max_ns ? bound : Series->max_ns;
+}
+
+double WixUsb_SeriesByteRate(const wixusb_latency_series_t * Series,
+        uint64_t Elapsed) {
+    if (Elapsed == 0)
+        return 0.0;
+
+    return (double) Series->bytes * 1e9 / Elapsed;
+}
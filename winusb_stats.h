@@ -0,0 +1,101 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Ildar Sadykov <irsdkv@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Latency histograms of the wrapper calls, per handle and pipe. Each thread
+ * counts into its own histograms, a snapshot merges them. Buckets are
+ * HDR-style, a power of two range split in WIXUSB_STATS_SUB_BUCKETS linear
+ * steps, so a value is known within 1/16th of itself.
+ *
+ * The handle is the fd, control transfers count on pipe 0x00 or 0x80 by
+ * the direction of the request.
+ */
+
+#ifndef WINUSB_STATS_H
+#define WINUSB_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "wixusb_driver_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WIXUSB_STATS_SUB_BITS       4
+#define WIXUSB_STATS_SUB_BUCKETS    (1 << WIXUSB_STATS_SUB_BITS)
+#define WIXUSB_STATS_MAX_SHIFT      36 /* about 68 s, longer calls clamp */
+#define WIXUSB_STATS_BUCKETS \
+    ((WIXUSB_STATS_MAX_SHIFT - WIXUSB_STATS_SUB_BITS + 1) * \
+     WIXUSB_STATS_SUB_BUCKETS)
+
+typedef struct {
+    int fd;
+    UCHAR endpoint;
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes; /* transferred by the successful calls */
+    uint64_t max_ns;
+    uint64_t latency[WIXUSB_STATS_BUCKETS]; /* call durations in ns */
+} wixusb_latency_series_t;
+
+/* Clears the counts and starts recording */
+void WixUsb_StartLatencyStats(void);
+
+/* The counts are kept for a last snapshot */
+void WixUsb_StopLatencyStats(void);
+
+/*
+ * Merges the threads' histograms into Series. Returns the number of series
+ * recorded, which may be more than MaxSeries. Elapsed is the time in ns
+ * the recording has run, for rates. Calls in progress are counted or not.
+ */
+ULONG WixUsb_LatencySnapshot(wixusb_latency_series_t * Series,
+        ULONG MaxSeries, uint64_t * Elapsed);
+
+/*
+ * Upper bound in ns of the latency under which Percentile (0 to 100) of the
+ * series' calls completed, 0 without calls.
+ */
+uint64_t WixUsb_SeriesPercentile(const wixusb_latency_series_t * Series,
+        double Percentile);
+
+/* Bytes per second over Elapsed from the snapshot */
+double WixUsb_SeriesByteRate(const wixusb_latency_series_t * Series,
+        uint64_t Elapsed);
+
+/* Used by the wrapper */
+extern volatile int wixusb_stats_on;
+
+uint64_t wixusb_stats_now(void);
+
+/* Start is from wixusb_stats_now(), Status is negative on failure */
+void wixusb_stats_record(int fd, UCHAR Endpoint, ULONG Actual, int Status,
+        uint64_t Start);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WINUSB_STATS_H */
@@ -0,0 +1,54 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Ildar Sadykov <irsdkv@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "winusb_uring.h"
+#include <string.h>
+
+static void uring_prep(struct io_uring_sqe * Sqe, int fd, unsigned int op, void * arg) {
+    wixusb_uring_cmd_t cmd = { .arg = (uintptr_t) arg };
+
+    io_uring_prep_rw(IORING_OP_URING_CMD, Sqe, fd, NULL, 0, 0);
+    Sqe->cmd_op = op;
+    memcpy(Sqe->cmd, &cmd, sizeof (cmd));
+}
+
+void WixUsb_PrepControlTransfer(struct io_uring_sqe * Sqe, int InterfaceHandle,
+        wixusb_ctrl_xfer_t * Xfer) {
+    uring_prep(Sqe, InterfaceHandle, IOCTL_CTRL_XFER, Xfer);
+}
+
+void WixUsb_PrepSendControl(struct io_uring_sqe * Sqe, int InterfaceHandle,
+        wixusb_ctrl_packet_t * Packet) {
+    uring_prep(Sqe, InterfaceHandle, IOCTL_SEND_CTRL, Packet);
+}
+
+void WixUsb_PrepReceiveControl(struct io_uring_sqe * Sqe, int InterfaceHandle,
+        wixusb_ctrl_packet_t * Packet) {
+    uring_prep(Sqe, InterfaceHandle, IOCTL_RECV_CTRL, Packet);
+}
+
+void WixUsb_PrepWriteInterrupt(struct io_uring_sqe * Sqe, int InterfaceHandle,
+        wixusb_intrpt_packet * Packet) {
+    uring_prep(Sqe, InterfaceHandle, IOCTL_WRITE_INT, Packet);
+}
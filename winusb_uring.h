@@ -0,0 +1,67 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Ildar Sadykov <irsdkv@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * io_uring submission of the control and interrupt commands, for kernels
+ * with uring_cmd (5.19 and later). Each helper fills an SQE with
+ * IORING_OP_URING_CMD, the CQE's res is what the ioctl would return or
+ * -errno. The command fits a 64 byte SQE.
+ *
+ * The argument structure is read at submission, but an IN data stage is
+ * written to it (or to its data pointer) at completion, so it must stay
+ * valid until the CQE. Cancel with WinUsb_AbortPipe(), pipe 0 for control
+ * transfers. Needs liburing.
+ */
+
+#ifndef WINUSB_URING_H
+#define WINUSB_URING_H
+
+#include <liburing.h>
+#include "wixusb_driver_types.h"
+#include "wixusb_ioctl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Data stage of up to 64 KB at Xfer->data, the CQE gives the bytes moved */
+void WixUsb_PrepControlTransfer(struct io_uring_sqe * Sqe, int InterfaceHandle,
+        wixusb_ctrl_xfer_t * Xfer);
+
+/* Data stage of up to CTRL_BUFF_LENGTH bytes in Packet->data */
+void WixUsb_PrepSendControl(struct io_uring_sqe * Sqe, int InterfaceHandle,
+        wixusb_ctrl_packet_t * Packet);
+
+void WixUsb_PrepReceiveControl(struct io_uring_sqe * Sqe, int InterfaceHandle,
+        wixusb_ctrl_packet_t * Packet);
+
+/* The CQE's res is 0 once the packet is on the bus */
+void WixUsb_PrepWriteInterrupt(struct io_uring_sqe * Sqe, int InterfaceHandle,
+        wixusb_intrpt_packet * Packet);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WINUSB_URING_H */
@@ -23,6 +23,10 @@
  */
 
 #include "winusb_wrapper.h"
+#include "wixusb_ioctl.h"
+#include "winusb_iocp.h"
+#include "winusb_capture.h"
+#include "winusb_stats.h"
 #include "errno.h"
 #include <unistd.h>
 #include <sys/types.h>
@@ -31,10 +35,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <stdatomic.h>
 
 #define WINUSB_FAIL         (FALSE)
 #define WINUSB_SUCCESS      (TRUE)
 
+/* the driver's fixed bulk pipes, as shown in captures */
+#define CAPTURE_EP_BULK_IN  0x82
+#define CAPTURE_EP_BULK_OUT 0x03
+
 extern int errno;
 
 static int data_send_request(int fd, void * buff, int len) {
@@ -96,6 +109,21 @@ int WinUsb_GetDescriptor(int fd, uint8_t DescriptorType, uint8_t Index,
         .desc_type = (USB_DESCRIPTOR_TYPES)DescriptorType,
         .desc_idx = Index,
     };
+    wixusb_config_desc_t config = {
+        .data = (uintptr_t) Buffer,
+        .length = BufferLength,
+        .index = Index,
+    };
+
+    /* the whole blob, straight from the kernel's copy */
+    if (DescriptorType == USB_CONFIGURATION_DESCRIPTOR_TYPE) {
+        result = ioctl(fd, IOCTL_GET_CONFIG_DESC, &config);
+        if (result < 0)
+            return WINUSB_FAIL;
+        if (LengthTransferred != NULL)
+            *LengthTransferred = result;
+        return WINUSB_SUCCESS;
+    }
 
     result = ioctl(fd, IOCTL_GET_DESC, &desc_packet);
 
@@ -111,6 +139,139 @@ int WinUsb_GetDescriptor(int fd, uint8_t DescriptorType, uint8_t Index,
     return WINUSB_SUCCESS;
 }
 
+/* Next descriptor of Type (-1 for any), NULL at the end or on a bad bLength */
+static const USB_COMMON_DESCRIPTOR * desc_find(const UCHAR * Pos,
+        const UCHAR * End, LONG Type) {
+    const USB_COMMON_DESCRIPTOR *d;
+
+    while (End - Pos >= (long) sizeof (*d)) {
+        d = (const USB_COMMON_DESCRIPTOR *) Pos;
+        if (d->bLength < sizeof (*d) || d->bLength > End - Pos)
+            return NULL;
+        if (Type < 0 || d->bDescriptorType == Type)
+            return d;
+        Pos += d->bLength;
+    }
+    return NULL;
+}
+
+PUSB_COMMON_DESCRIPTOR WinUsb_ParseDescriptors(void * DescriptorBuffer,
+        ULONG TotalLength, void * StartPosition, LONG DescriptorType) {
+    const UCHAR *end = (const UCHAR *) DescriptorBuffer + TotalLength;
+
+    if (StartPosition == NULL)
+        StartPosition = DescriptorBuffer;
+    return (PUSB_COMMON_DESCRIPTOR) desc_find(StartPosition, end,
+            DescriptorType);
+}
+
+PUSB_INTERFACE_DESCRIPTOR WinUsb_ParseConfigurationDescriptor(
+        PUSB_CONFIGURATION_DESCRIPTOR ConfigurationDescriptor,
+        void * StartPosition, LONG InterfaceNumber, LONG AlternateSetting,
+        LONG InterfaceClass, LONG InterfaceSubClass, LONG InterfaceProtocol) {
+    const UCHAR *pos = StartPosition ? StartPosition :
+            (const UCHAR *) ConfigurationDescriptor;
+    const UCHAR *end = (const UCHAR *) ConfigurationDescriptor +
+            ConfigurationDescriptor->wTotalLength;
+    const USB_INTERFACE_DESCRIPTOR *intf;
+
+    while ((intf = (const USB_INTERFACE_DESCRIPTOR *) desc_find(pos, end,
+            USB_INTERFACE_DESCRIPTOR_TYPE)) != NULL) {
+        if (intf->bLength >= sizeof (*intf) &&
+                (InterfaceNumber < 0 || intf->bInterfaceNumber == InterfaceNumber) &&
+                (AlternateSetting < 0 || intf->bAlternateSetting == AlternateSetting) &&
+                (InterfaceClass < 0 || intf->bInterfaceClass == InterfaceClass) &&
+                (InterfaceSubClass < 0 || intf->bInterfaceSubClass == InterfaceSubClass) &&
+                (InterfaceProtocol < 0 || intf->bInterfaceProtocol == InterfaceProtocol))
+            return (PUSB_INTERFACE_DESCRIPTOR) intf;
+        pos = (const UCHAR *) intf + intf->bLength;
+    }
+    return NULL;
+}
+
+void WixUsb_DescIterInit(WIXUSB_DESC_ITER * Iter,
+        const USB_CONFIGURATION_DESCRIPTOR * Config, ULONG Length) {
+    Iter->pos = (const UCHAR *) Config;
+    Iter->end = Iter->pos;
+    if (Length < sizeof (*Config) || Config->bLength < sizeof (*Config))
+        return;
+    /* a buffer shorter than the blob is walked as far as it goes */
+    Iter->end += Config->wTotalLength < Length ? Config->wTotalLength : Length;
+    Iter->pos += Config->bLength;
+}
+
+const USB_COMMON_DESCRIPTOR * WixUsb_DescNext(WIXUSB_DESC_ITER * Iter,
+        LONG DescriptorType) {
+    const USB_COMMON_DESCRIPTOR *d = desc_find(Iter->pos, Iter->end,
+            DescriptorType);
+
+    Iter->pos = d ? (const UCHAR *) d + d->bLength : Iter->end;
+    return d;
+}
+
+/*
+ * Next descriptor of the current interface that matches, NULL at the next
+ * interface descriptor, which is left for WixUsb_NextInterface().
+ */
+static const USB_COMMON_DESCRIPTOR * desc_next_in_interface(
+        WIXUSB_DESC_ITER * Iter, bool (*Match)(UCHAR Type)) {
+    const USB_COMMON_DESCRIPTOR *d;
+
+    while ((d = desc_find(Iter->pos, Iter->end, -1)) != NULL) {
+        if (d->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE ||
+                d->bDescriptorType == INTERFACE_ASSOCIATION)
+            return NULL;
+        Iter->pos = (const UCHAR *) d + d->bLength;
+        if (Match(d->bDescriptorType))
+            return d;
+    }
+    Iter->pos = Iter->end;
+    return NULL;
+}
+
+static bool is_endpoint(UCHAR Type) {
+    return Type == USB_ENDPOINT_DESCRIPTOR_TYPE;
+}
+
+static bool is_class(UCHAR Type) {
+    return USB_DESCRIPTOR_IS_CLASS(Type);
+}
+
+const USB_INTERFACE_DESCRIPTOR * WixUsb_NextInterface(WIXUSB_DESC_ITER * Iter) {
+    const USB_COMMON_DESCRIPTOR *d;
+
+    while ((d = WixUsb_DescNext(Iter, USB_INTERFACE_DESCRIPTOR_TYPE)) != NULL) {
+        if (d->bLength >= sizeof (USB_INTERFACE_DESCRIPTOR))
+            return (const USB_INTERFACE_DESCRIPTOR *) d;
+    }
+    return NULL;
+}
+
+const USB_INTERFACE_ASSOCIATION_DESCRIPTOR * WixUsb_NextAssociation(
+        WIXUSB_DESC_ITER * Iter) {
+    const USB_COMMON_DESCRIPTOR *d;
+
+    while ((d = WixUsb_DescNext(Iter, INTERFACE_ASSOCIATION)) != NULL) {
+        if (d->bLength >= sizeof (USB_INTERFACE_ASSOCIATION_DESCRIPTOR))
+            return (const USB_INTERFACE_ASSOCIATION_DESCRIPTOR *) d;
+    }
+    return NULL;
+}
+
+const USB_ENDPOINT_DESCRIPTOR * WixUsb_NextEndpoint(WIXUSB_DESC_ITER * Iter) {
+    const USB_COMMON_DESCRIPTOR *d;
+
+    while ((d = desc_next_in_interface(Iter, is_endpoint)) != NULL) {
+        if (d->bLength >= sizeof (USB_ENDPOINT_DESCRIPTOR))
+            return (const USB_ENDPOINT_DESCRIPTOR *) d;
+    }
+    return NULL;
+}
+
+const USB_COMMON_DESCRIPTOR * WixUsb_NextClassSpecific(WIXUSB_DESC_ITER * Iter) {
+    return desc_next_in_interface(Iter, is_class);
+}
+
 int WinUsb_SetPipePolicy(int fd, uint8_t PipeID, uint32_t PolicyType,
         uint32_t ValueLength, void * Value) {
     int result = 0;
@@ -119,9 +280,17 @@ int WinUsb_SetPipePolicy(int fd, uint8_t PipeID, uint32_t PolicyType,
 
     switch (PolicyType) {
         case SHORT_PACKET_TERMINATE:
+        case AUTO_CLEAR_STALL:
         case PIPE_TRANSFER_TIMEOUT:
+        case PIPE_RATE_LIMIT:
+        case PIPE_BURST_SIZE:
             pipe_policy.policy_type = (PIPE_POLICIES)PolicyType;
-            pipe_policy.policy_value = *((uint32_t*) Value);
+            pipe_policy.pipe_id = PipeID;
+            /* WinUSB passes the boolean policies as a single UCHAR */
+            if (ValueLength == sizeof (uint8_t))
+                pipe_policy.policy_value = *((uint8_t*) Value);
+            else
+                pipe_policy.policy_value = *((uint32_t*) Value);
             break;
         default:
             return WINUSB_FAIL;
@@ -135,16 +304,216 @@ int WinUsb_SetPipePolicy(int fd, uint8_t PipeID, uint32_t PolicyType,
     return WINUSB_SUCCESS;
 }
 
+/* The boolean policies come back as a single UCHAR, like on Windows */
+BOOL WinUsb_GetPipePolicy(int InterfaceHandle, UCHAR PipeID, ULONG PolicyType,
+        PULONG ValueLength, void * Value) {
+    wixusb_set_pipe_policy_t pipe_policy = {
+        .policy_type = (PIPE_POLICIES)PolicyType,
+        .pipe_id = PipeID,
+    };
+    bool boolean = PolicyType == SHORT_PACKET_TERMINATE ||
+            PolicyType == AUTO_CLEAR_STALL;
+
+    if (ValueLength == NULL || Value == NULL)
+        return WINUSB_FAIL;
+
+    if (ioctl(InterfaceHandle, IOCTL_GET_PIPE_POL, &pipe_policy) < 0)
+        return WINUSB_FAIL;
+
+    if (boolean && *ValueLength >= sizeof (uint8_t)) {
+        *((uint8_t*) Value) = (uint8_t) pipe_policy.policy_value;
+        *ValueLength = sizeof (uint8_t);
+    } else if (!boolean && *ValueLength >= sizeof (uint32_t)) {
+        *((uint32_t*) Value) = pipe_policy.policy_value;
+        *ValueLength = sizeof (uint32_t);
+    } else {
+        return WINUSB_FAIL;
+    }
+
+    return WINUSB_SUCCESS;
+}
+
+BOOL WinUsb_SetPowerPolicy(int InterfaceHandle, ULONG PolicyType,
+        ULONG ValueLength, void * Value) {
+    wixusb_power_policy_t power_policy;
+
+    switch (PolicyType) {
+        case AUTO_SUSPEND:
+        case SUSPEND_DELAY:
+            power_policy.policy_type = (POWER_POLICIES)PolicyType;
+            /* AUTO_SUSPEND is a single UCHAR like the boolean pipe policies */
+            if (ValueLength == sizeof (uint8_t))
+                power_policy.policy_value = *((uint8_t*) Value);
+            else
+                power_policy.policy_value = *((uint32_t*) Value);
+            break;
+        default:
+            return WINUSB_FAIL;
+    }
+
+    if (ioctl(InterfaceHandle, IOCTL_SET_POWER_POL, &power_policy) < 0)
+        return WINUSB_FAIL;
+
+    return WINUSB_SUCCESS;
+}
+
+BOOL WinUsb_GetPowerPolicy(int InterfaceHandle, ULONG PolicyType,
+        PULONG ValueLength, void * Value) {
+    wixusb_power_policy_t power_policy = {
+        .policy_type = (POWER_POLICIES)PolicyType,
+    };
+
+    if (ValueLength == NULL || Value == NULL)
+        return WINUSB_FAIL;
+
+    if (ioctl(InterfaceHandle, IOCTL_GET_POWER_POL, &power_policy) < 0)
+        return WINUSB_FAIL;
+
+    if (PolicyType == AUTO_SUSPEND && *ValueLength >= sizeof (uint8_t)) {
+        *((uint8_t*) Value) = (uint8_t) power_policy.policy_value;
+        *ValueLength = sizeof (uint8_t);
+    } else if (*ValueLength >= sizeof (uint32_t)) {
+        *((uint32_t*) Value) = power_policy.policy_value;
+        *ValueLength = sizeof (uint32_t);
+    } else {
+        return WINUSB_FAIL;
+    }
+
+    return WINUSB_SUCCESS;
+}
+
+BOOL WixUsb_GetStatus(int InterfaceHandle, wixusb_status_t * Status) {
+    if (ioctl(InterfaceHandle, IOCTL_GET_STATUS, Status) < 0)
+        return WINUSB_FAIL;
+
+    return WINUSB_SUCCESS;
+}
+
+BOOL WixUsb_GetStatistics(int InterfaceHandle, wixusb_stats_t * Stats) {
+    if (ioctl(InterfaceHandle, IOCTL_GET_STATS, Stats) < 0)
+        return WINUSB_FAIL;
+
+    return WINUSB_SUCCESS;
+}
+
+BOOL WixUsb_SetPriority(int InterfaceHandle, WIXUSB_PRIORITY Priority) {
+    if (ioctl(InterfaceHandle, IOCTL_SET_PRIORITY, (unsigned long) Priority) < 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+BOOL WixUsb_SetPriorityLimit(int InterfaceHandle, WIXUSB_PRIORITY Priority,
+        ULONG Limit) {
+    wixusb_prio_limit_t limit = {
+        .prio = Priority,
+        .limit = Limit,
+    };
+
+    if (ioctl(InterfaceHandle, IOCTL_SET_PRIO_LIMIT, &limit) < 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+BOOL WixUsb_GetPriorityStats(int InterfaceHandle, wixusb_prio_stats_t * Stats) {
+    if (ioctl(InterfaceHandle, IOCTL_GET_PRIO_STATS, Stats) < 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+uint64_t WixUsb_LatencyPercentile(const wixusb_prio_class_t * Class,
+        double Percentile) {
+    uint64_t total = 0, seen = 0, rank;
+    int i;
+
+    for (i = 0; i < WIXUSB_LAT_BUCKETS; i++)
+        total += Class->latency[i];
+    if (total == 0)
+        return 0;
+
+    /* the rank-th smallest latency, counted from 1 */
+    rank = (uint64_t) (Percentile / 100.0 * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < WIXUSB_LAT_BUCKETS - 1; i++) {
+        seen += Class->latency[i];
+        if (seen >= rank)
+            break;
+    }
+    return (2ULL << i) - 1;
+}
+
+BOOL WixUsb_SetBroadcastMode(int InterfaceHandle, BOOL Enable,
+        WIXUSB_BCAST_POLICIES SlowPolicy) {
+    wixusb_bcast_mode_t mode = {
+        .enable = Enable ? 1 : 0,
+        .slow_policy = SlowPolicy,
+    };
+
+    if (ioctl(InterfaceHandle, IOCTL_SET_BCAST, &mode) < 0)
+        return WINUSB_FAIL;
+
+    return WINUSB_SUCCESS;
+}
+
+BOOL WixUsb_SetFramedRead(int InterfaceHandle, BOOL Enable) {
+    if (ioctl(InterfaceHandle, IOCTL_SET_FRAMED, (unsigned long) !!Enable) < 0)
+        return WINUSB_FAIL;
+
+    return WINUSB_SUCCESS;
+}
+
+BOOL WixUsb_ParseFrame(const void * Buffer, ULONG Length, PULONG Offset,
+        wixusb_frame_hdr_t * Header, const UCHAR ** Payload) {
+    const UCHAR *data = Buffer;
+
+    if (*Offset + sizeof (*Header) > Length)
+        return FALSE;
+
+    /* records are packed, the header may be unaligned */
+    memcpy(Header, data + *Offset, sizeof (*Header));
+    if (*Offset + sizeof (*Header) + Header->length > Length)
+        return FALSE;
+
+    if (Payload != NULL)
+        *Payload = data + *Offset + sizeof (*Header);
+    *Offset += sizeof (*Header) + Header->length;
+    return TRUE;
+}
+
+BOOL WixUsb_Prewarm(int InterfaceHandle) {
+    if (ioctl(InterfaceHandle, IOCTL_PREWARM) < 0)
+        return WINUSB_FAIL;
+
+    return WINUSB_SUCCESS;
+}
 
 int WixUsb_ReadBulk(int InterfaceHandle, void * Buffer,
         uint32_t BufferLength, uint32_t * LengthTransferred) {
     int result = 0;
+    uint64_t start = 0, stats_start = 0;
 
     if (BufferLength > BULK_BUFF_LENGTH)
         return -1;
 
+    if (wixusb_capture_on)
+        start = wixusb_capture_now();
+    if (wixusb_stats_on)
+        stats_start = wixusb_stats_now();
+
     result = data_receive(InterfaceHandle, (char*)Buffer, BufferLength);
 
+    if (wixusb_stats_on)
+        wixusb_stats_record(InterfaceHandle, CAPTURE_EP_BULK_IN, result < 0 ? 0 : result,
+                result, stats_start);
+
+    if (wixusb_capture_on)
+        wixusb_capture(InterfaceHandle, CAPTURE_EP_BULK_IN, NULL, Buffer,
+                BufferLength, result < 0 ? 0 : result, result < 0 ? result : 0,
+                start, wixusb_capture_now());
+
     if (result < 0)
         return FALSE;
 
@@ -154,15 +523,30 @@ int WixUsb_ReadBulk(int InterfaceHandle, void * Buffer,
     return TRUE;
 }
 
-int WixUsb_BulkTransfer(int InterfaceHandle, PUCHAR Buffer,
+int WixUsb_WriteBulk(int InterfaceHandle, PUCHAR Buffer,
         ULONG BufferLength, PULONG LengthTransferred) {
     int result = 0;
+    uint64_t start = 0, stats_start = 0;
 
     if (BufferLength > BULK_BUFF_LENGTH)
         return -1;
 
+    if (wixusb_capture_on)
+        start = wixusb_capture_now();
+    if (wixusb_stats_on)
+        stats_start = wixusb_stats_now();
+
     result = data_send(InterfaceHandle, Buffer, BufferLength);
 
+    if (wixusb_stats_on)
+        wixusb_stats_record(InterfaceHandle, CAPTURE_EP_BULK_OUT, result < 0 ? 0 : result,
+                result, stats_start);
+
+    if (wixusb_capture_on)
+        wixusb_capture(InterfaceHandle, CAPTURE_EP_BULK_OUT, NULL, Buffer,
+                BufferLength, result < 0 ? 0 : result, result < 0 ? result : 0,
+                start, wixusb_capture_now());
+
     if (result < 0)
         return FALSE;
 
@@ -172,34 +556,598 @@ int WixUsb_BulkTransfer(int InterfaceHandle, PUCHAR Buffer,
     return TRUE;
 }
 
+/* Queues on the completion port of the handle, as Windows fails the call */
+static BOOL overlapped_submit(int fd, int kind, WINUSB_SETUP_PACKET * Setup,
+        PUCHAR Buffer, ULONG BufferLength, LPOVERLAPPED Overlapped) {
+    if (!wixusb_iocp_submit(fd, kind, Setup, Buffer, BufferLength, Overlapped))
+        return FALSE;
+
+    errno = EINPROGRESS;
+    return FALSE;
+}
+
+static BOOL is_data_pipe(int fd, UCHAR PipeID);
+
+BOOL WinUsb_ReadPipe(int InterfaceHandle, UCHAR PipeID, PUCHAR Buffer,
+        ULONG BufferLength, PULONG LengthTransferred,
+        LPOVERLAPPED Overlapped) {
+    uint32_t len = 0;
+
+    if (!(PipeID & 0x80) || BufferLength > BULK_BUFF_LENGTH ||
+            !is_data_pipe(InterfaceHandle, PipeID)) {
+        errno = EINVAL;
+        return FALSE;
+    }
+
+    if (Overlapped != NULL)
+        return overlapped_submit(InterfaceHandle, WIXUSB_IOCP_READ, NULL,
+                Buffer, BufferLength, Overlapped);
+
+    if (WixUsb_ReadBulk(InterfaceHandle, Buffer, BufferLength, &len) != TRUE)
+        return FALSE;
+
+    if (LengthTransferred != NULL)
+        *LengthTransferred = len;
+    return TRUE;
+}
+
+BOOL WinUsb_WritePipe(int InterfaceHandle, UCHAR PipeID, PUCHAR Buffer,
+        ULONG BufferLength, PULONG LengthTransferred,
+        LPOVERLAPPED Overlapped) {
+    if ((PipeID & 0x80) || BufferLength > BULK_BUFF_LENGTH ||
+            !is_data_pipe(InterfaceHandle, PipeID)) {
+        errno = EINVAL;
+        return FALSE;
+    }
+
+    if (Overlapped != NULL)
+        return overlapped_submit(InterfaceHandle, WIXUSB_IOCP_WRITE, NULL,
+                Buffer, BufferLength, Overlapped);
+
+    return WixUsb_WriteBulk(InterfaceHandle, Buffer, BufferLength,
+            LengthTransferred);
+}
 
 BOOL WinUsb_ControlTransfer(int InterfaceHandle,
         WINUSB_SETUP_PACKET SetupPacket, PUCHAR Buffer, ULONG BufferLength,
         PULONG LengthTransferred, LPOVERLAPPED Overlapped) {
     int result = 0;
+    uint64_t start = 0, stats_start = 0;
 
-    wixusb_ctrl_packet_t ctrl_packet = {
+    wixusb_ctrl_xfer_t ctrl_xfer = {
         .winusb_packet = SetupPacket,
+        .data = (uintptr_t) Buffer,
     };
 
-    if (BufferLength > CTRL_BUFF_LENGTH)
+    if (BufferLength < SetupPacket.Length)
         return FALSE;
 
+    if (Overlapped != NULL)
+        return overlapped_submit(InterfaceHandle, WIXUSB_IOCP_CTRL,
+                &SetupPacket, Buffer, BufferLength, Overlapped);
 
-    if (SETUP_PACKET_IS_INPUT(SetupPacket.RequestType)) {
-        result = ioctl(InterfaceHandle, IOCTL_RECV_CTRL, &ctrl_packet);
-        if (result < 0)
-            return result;
-        memcpy(Buffer, ctrl_packet.data, result);
-    } else {
-        memcpy(ctrl_packet.data, Buffer, BufferLength);
-        result = ioctl(InterfaceHandle, IOCTL_SEND_CTRL, &ctrl_packet);
-        if (result < 0)
-            return result;
-    }
+    if (wixusb_capture_on)
+        start = wixusb_capture_now();
+    if (wixusb_stats_on)
+        stats_start = wixusb_stats_now();
+
+    result = ioctl(InterfaceHandle, IOCTL_CTRL_XFER, &ctrl_xfer);
+
+    if (wixusb_stats_on)
+        wixusb_stats_record(InterfaceHandle, SetupPacket.RequestType & 0x80,
+                result < 0 ? 0 : result, result, stats_start);
+
+    if (wixusb_capture_on)
+        wixusb_capture(InterfaceHandle, SetupPacket.RequestType & 0x80,
+                &SetupPacket, Buffer, SetupPacket.Length,
+                result < 0 ? 0 : result, result < 0 ? -errno : 0, start,
+                wixusb_capture_now());
+
+    if (result < 0)
+        return FALSE;
 
     if (LengthTransferred != NULL)
         *LengthTransferred = result;
 
     return TRUE;
 }
+
+/*
+ * Pipe tables by fd, handles above the table are queried every time. An
+ * entry lives until WinUsb_Free(), an fd closed otherwise and reused
+ * would find the table of the device it was open on.
+ */
+#define INFO_CACHE_FDS      1024
+
+static _Atomic(wixusb_iface_info_t *) info_cache[INFO_CACHE_FDS];
+
+/*
+ * bAlternateSetting + 1 by fd, 0 until known. Set by this handle's
+ * WinUsb_SetCurrentAlternateSetting(), a switch through another handle
+ * is not seen.
+ */
+static _Atomic int alt_cache[INFO_CACHE_FDS];
+
+static int current_alt(int fd, uint8_t *cur) {
+    int alt;
+
+    if (fd >= 0 && fd < INFO_CACHE_FDS) {
+        alt = atomic_load_explicit(&alt_cache[fd], memory_order_relaxed);
+        if (alt) {
+            *cur = alt - 1;
+            return 0;
+        }
+    }
+    if (ioctl(fd, IOCTL_GET_ALT, cur) < 0)
+        return -1;
+    if (fd >= 0 && fd < INFO_CACHE_FDS)
+        atomic_store_explicit(&alt_cache[fd], *cur + 1, memory_order_relaxed);
+    return 0;
+}
+
+static const wixusb_iface_info_t *iface_info(int fd, wixusb_iface_info_t *tmp) {
+    wixusb_iface_info_t *info, *expected = NULL;
+
+    if (fd >= 0 && fd < INFO_CACHE_FDS) {
+        info = atomic_load_explicit(&info_cache[fd], memory_order_acquire);
+        if (info != NULL)
+            return info;
+    }
+
+    if (ioctl(fd, IOCTL_GET_IFACE_INFO, tmp) < 0)
+        return NULL;
+    if (fd < 0 || fd >= INFO_CACHE_FDS)
+        return tmp;
+
+    info = malloc(sizeof (*info));
+    if (info == NULL)
+        return tmp;
+    *info = *tmp;
+    /* another thread may have been first */
+    if (!atomic_compare_exchange_strong(&info_cache[fd], &expected, info)) {
+        free(info);
+        return expected;
+    }
+    return info;
+}
+
+static const wixusb_pipe_info_t *pipe_info(int fd, UCHAR Alt, UCHAR PipeIndex,
+        wixusb_iface_info_t *tmp) {
+    const wixusb_iface_info_t *info = iface_info(fd, tmp);
+
+    if (info == NULL)
+        return NULL;
+    if (Alt >= info->num_alts || PipeIndex >= info->alts[Alt].num_pipes) {
+        errno = ENOENT;
+        return NULL;
+    }
+    return &info->alts[Alt].pipes[PipeIndex];
+}
+
+/*
+ * Whether PipeID is the bulk pipe the driver reads or writes, picked from
+ * the current setting as the driver does: the fixed address if the setting
+ * has it, else the first bulk pipe of that direction.
+ */
+static BOOL is_data_pipe(int fd, UCHAR PipeID) {
+    wixusb_iface_info_t tmp;
+    const wixusb_iface_info_t *info = iface_info(fd, &tmp);
+    const wixusb_alt_info_t *alt = NULL;
+    UCHAR fixed = (PipeID & 0x80) ? CAPTURE_EP_BULK_IN : CAPTURE_EP_BULK_OUT;
+    UCHAR found = 0;
+    uint8_t cur = 0;
+    ULONG i;
+
+    if (info == NULL || info->num_alts == 0)
+        return FALSE;
+    if (info->num_alts > 1 && current_alt(fd, &cur) < 0)
+        return FALSE;
+    for (i = 0; i < info->num_alts; i++) {
+        if (info->alts[i].desc.bAlternateSetting == cur) {
+            alt = &info->alts[i];
+            break;
+        }
+    }
+    if (alt == NULL)
+        return FALSE;
+
+    for (i = 0; i < alt->num_pipes; i++) {
+        const wixusb_pipe_info_t *pipe = &alt->pipes[i];
+
+        if (pipe->type != UsbdPipeTypeBulk ||
+                (pipe->address & 0x80) != (PipeID & 0x80))
+            continue;
+        if (!found || pipe->address == fixed)
+            found = pipe->address;
+    }
+    return found != 0 && found == PipeID;
+}
+
+BOOL WinUsb_Free(int InterfaceHandle) {
+    if (InterfaceHandle >= 0 && InterfaceHandle < INFO_CACHE_FDS) {
+        free(atomic_exchange(&info_cache[InterfaceHandle], NULL));
+        atomic_store(&alt_cache[InterfaceHandle], 0);
+    }
+    WixUsb_UnbindCompletionPort(InterfaceHandle);
+
+    if (close(InterfaceHandle) < 0)
+        return FALSE;
+    return TRUE;
+}
+
+BOOL WinUsb_QueryInterfaceSettings(int InterfaceHandle,
+        UCHAR AlternateInterfaceNumber,
+        PUSB_INTERFACE_DESCRIPTOR UsbAltInterfaceDescriptor) {
+    wixusb_iface_info_t tmp;
+    const wixusb_iface_info_t *info = iface_info(InterfaceHandle, &tmp);
+
+    if (info == NULL)
+        return FALSE;
+    if (AlternateInterfaceNumber >= info->num_alts) {
+        errno = ENOENT;
+        return FALSE;
+    }
+
+    *UsbAltInterfaceDescriptor = info->alts[AlternateInterfaceNumber].desc;
+    return TRUE;
+}
+
+BOOL WinUsb_QueryPipe(int InterfaceHandle, UCHAR AlternateInterfaceNumber,
+        UCHAR PipeIndex, PWINUSB_PIPE_INFORMATION PipeInformation) {
+    wixusb_iface_info_t tmp;
+    const wixusb_pipe_info_t *pipe = pipe_info(InterfaceHandle,
+            AlternateInterfaceNumber, PipeIndex, &tmp);
+
+    if (pipe == NULL)
+        return FALSE;
+
+    PipeInformation->PipeType = (USBD_PIPE_TYPE) pipe->type;
+    PipeInformation->PipeId = pipe->address;
+    PipeInformation->MaximumPacketSize = pipe->max_packet;
+    PipeInformation->Interval = pipe->interval;
+    return TRUE;
+}
+
+BOOL WinUsb_QueryPipeEx(int InterfaceHandle, UCHAR AlternateSettingNumber,
+        UCHAR PipeIndex, PWINUSB_PIPE_INFORMATION_EX PipeInformationEx) {
+    wixusb_iface_info_t tmp;
+    const wixusb_pipe_info_t *pipe = pipe_info(InterfaceHandle,
+            AlternateSettingNumber, PipeIndex, &tmp);
+
+    if (pipe == NULL)
+        return FALSE;
+
+    PipeInformationEx->PipeType = (USBD_PIPE_TYPE) pipe->type;
+    PipeInformationEx->PipeId = pipe->address;
+    PipeInformationEx->MaximumPacketSize = pipe->max_packet;
+    PipeInformationEx->Interval = pipe->interval;
+    PipeInformationEx->MaximumBytesPerInterval = pipe->bytes_per_interval;
+    return TRUE;
+}
+
+BOOL WinUsb_QueryDeviceInformation(int InterfaceHandle, ULONG InformationType,
+        PULONG BufferLength, void * Buffer) {
+    wixusb_iface_info_t tmp;
+    const wixusb_iface_info_t *info;
+
+    if (InformationType != DEVICE_SPEED || *BufferLength < 1) {
+        errno = EINVAL;
+        return FALSE;
+    }
+
+    info = iface_info(InterfaceHandle, &tmp);
+    if (info == NULL)
+        return FALSE;
+
+    *(UCHAR *) Buffer = info->speed;
+    *BufferLength = 1;
+    return TRUE;
+}
+
+BOOL WinUsb_GetAssociatedInterface(int InterfaceHandle,
+        UCHAR AssociatedInterfaceIndex, int * AssociatedInterfaceHandle) {
+    wixusb_assoc_iface_t assoc = {0};
+    char path[64];
+    int fd;
+
+    assoc.index = AssociatedInterfaceIndex;
+    if (ioctl(InterfaceHandle, IOCTL_GET_ASSOC_IFACE, &assoc) < 0)
+        return FALSE;
+
+    snprintf(path, sizeof (path), "/dev/" WIXUSB_DEV_NAME "%u", assoc.node);
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+        return FALSE;
+
+    *AssociatedInterfaceHandle = fd;
+    return TRUE;
+}
+
+BOOL WinUsb_SetCurrentAlternateSetting(int InterfaceHandle,
+        UCHAR SettingNumber) {
+    if (ioctl(InterfaceHandle, IOCTL_SET_ALT, (unsigned long) SettingNumber) < 0)
+        return FALSE;
+
+    if (InterfaceHandle >= 0 && InterfaceHandle < INFO_CACHE_FDS)
+        atomic_store(&alt_cache[InterfaceHandle], SettingNumber + 1);
+    return TRUE;
+}
+
+BOOL WinUsb_GetCurrentAlternateSetting(int InterfaceHandle,
+        PUCHAR SettingNumber) {
+    uint8_t alt;
+
+    if (ioctl(InterfaceHandle, IOCTL_GET_ALT, &alt) < 0)
+        return FALSE;
+
+    *SettingNumber = alt;
+    return TRUE;
+}
+
+BOOL WixUsb_AllocStreams(int InterfaceHandle, ULONG NumStreams,
+        PULONG Allocated) {
+    int result = ioctl(InterfaceHandle, IOCTL_ALLOC_STREAMS,
+            (unsigned long) NumStreams);
+
+    if (result < 0)
+        return FALSE;
+
+    if (Allocated != NULL)
+        *Allocated = result;
+    return TRUE;
+}
+
+BOOL WixUsb_StreamTransfer(int InterfaceHandle, UCHAR PipeID,
+        USHORT StreamID, PUCHAR Buffer, ULONG BufferLength,
+        PULONG LengthTransferred) {
+    wixusb_stream_xfer_t xfer = {0};
+    uint64_t start = 0;
+    int result;
+
+    xfer.data = (uintptr_t) Buffer;
+    xfer.length = BufferLength;
+    xfer.stream_id = StreamID;
+    xfer.endpoint = PipeID;
+
+    if (wixusb_capture_on)
+        start = wixusb_capture_now();
+
+    result = ioctl(InterfaceHandle, IOCTL_STREAM_XFER, &xfer);
+
+    if (wixusb_capture_on)
+        wixusb_capture(InterfaceHandle, PipeID, NULL, Buffer, BufferLength,
+                xfer.actual, result < 0 ? -errno : 0, start,
+                wixusb_capture_now());
+
+    if (LengthTransferred != NULL)
+        *LengthTransferred = xfer.actual;
+
+    if (result < 0)
+        return FALSE;
+    return TRUE;
+}
+
+BOOL WinUsb_AbortPipe(int InterfaceHandle, UCHAR PipeID) {
+    if (ioctl(InterfaceHandle, IOCTL_ABORT_PIPE, (unsigned long) PipeID) < 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+BOOL WinUsb_ResetPipe(int InterfaceHandle, UCHAR PipeID) {
+    if (ioctl(InterfaceHandle, IOCTL_RESET_PIPE, (unsigned long) PipeID) < 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+BOOL WinUsb_FlushPipe(int InterfaceHandle, UCHAR PipeID) {
+    if (ioctl(InterfaceHandle, IOCTL_FLUSH_PIPE, (unsigned long) PipeID) < 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+/*
+ * Hot-plug events come from the kernel uevent netlink group, so no udev
+ * daemon is needed. Removal events carry no attributes, the identity is
+ * remembered from the arrival.
+ */
+#define HOTPLUG_MAX_DEVICES 16
+#define HOTPLUG_QUEUE_LEN   (2 * HOTPLUG_MAX_DEVICES)
+
+struct wixusb_hotplug {
+    int fd;
+    wixusb_hotplug_t known[HOTPLUG_MAX_DEVICES];
+    BOOL used[HOTPLUG_MAX_DEVICES];
+    wixusb_hotplug_t queue[HOTPLUG_QUEUE_LEN];
+    int queue_head;
+    int queue_len;
+};
+
+static void hotplug_read_attr(const char *dir, const char *name, char *buff,
+        size_t len) {
+    char path[512];
+    FILE *f;
+
+    buff[0] = 0;
+    snprintf(path, sizeof (path), "%s/%s", dir, name);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return;
+    if (fgets(buff, len, f) != NULL)
+        buff[strcspn(buff, "\n")] = 0;
+    fclose(f);
+}
+
+/* usbdir is the USB device directory in sysfs, above the interface */
+static void hotplug_fill(wixusb_hotplug_t *ev, const char *devname,
+        const char *usbdir) {
+    char buff[16];
+
+    snprintf(ev->path, sizeof (ev->path), "/dev/%s", devname);
+    hotplug_read_attr(usbdir, "idVendor", buff, sizeof (buff));
+    ev->idVendor = strtoul(buff, NULL, 16);
+    hotplug_read_attr(usbdir, "idProduct", buff, sizeof (buff));
+    ev->idProduct = strtoul(buff, NULL, 16);
+    hotplug_read_attr(usbdir, "serial", ev->serial, sizeof (ev->serial));
+}
+
+static void hotplug_push(struct wixusb_hotplug *hp, const wixusb_hotplug_t *ev) {
+    if (hp->queue_len == HOTPLUG_QUEUE_LEN)
+        return;
+    hp->queue[(hp->queue_head + hp->queue_len) % HOTPLUG_QUEUE_LEN] = *ev;
+    hp->queue_len++;
+}
+
+/* Slot of the known device on /dev/devname, -1 if there is none */
+static int hotplug_find(struct wixusb_hotplug *hp, const char *devname) {
+    char path[64];
+    int i;
+
+    snprintf(path, sizeof (path), "/dev/%s", devname);
+    for (i = 0; i < HOTPLUG_MAX_DEVICES; i++) {
+        if (hp->used[i] && strcmp(hp->known[i].path, path) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void hotplug_arrived(struct wixusb_hotplug *hp, const char *devname,
+        const char *usbdir) {
+    int i;
+
+    /* an arrival during the initial scan is seen by both */
+    if (hotplug_find(hp, devname) >= 0)
+        return;
+    for (i = 0; i < HOTPLUG_MAX_DEVICES; i++) {
+        if (!hp->used[i]) {
+            hotplug_fill(&hp->known[i], devname, usbdir);
+            hp->known[i].event = WIXUSB_HOTPLUG_ARRIVED;
+            hp->used[i] = TRUE;
+            hotplug_push(hp, &hp->known[i]);
+            return;
+        }
+    }
+}
+
+static void hotplug_left(struct wixusb_hotplug *hp, const char *devname) {
+    int i = hotplug_find(hp, devname);
+
+    if (i < 0)
+        return;
+    hp->known[i].event = WIXUSB_HOTPLUG_LEFT;
+    hp->used[i] = FALSE;
+    hotplug_push(hp, &hp->known[i]);
+}
+
+static void hotplug_scan(struct wixusb_hotplug *hp) {
+    char usbdir[512];
+    struct dirent *de;
+    DIR *dir;
+
+    dir = opendir("/sys/class/usbmisc");
+    if (dir == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, WIXUSB_DEV_NAME, strlen(WIXUSB_DEV_NAME)) != 0)
+            continue;
+        /* class link -> interface -> USB device */
+        snprintf(usbdir, sizeof (usbdir), "/sys/class/usbmisc/%s/device/..",
+                de->d_name);
+        hotplug_arrived(hp, de->d_name, usbdir);
+    }
+    closedir(dir);
+}
+
+/* One uevent: "action@devpath" followed by KEY=value strings */
+static void hotplug_parse(struct wixusb_hotplug *hp, const char *msg, int len) {
+    const char *action = NULL, *devpath = NULL, *subsystem = NULL;
+    const char *devname = NULL;
+    char usbdir[512];
+    int i;
+
+    for (i = strlen(msg) + 1; i < len; i += strlen(msg + i) + 1) {
+        if (strncmp(msg + i, "ACTION=", 7) == 0)
+            action = msg + i + 7;
+        else if (strncmp(msg + i, "DEVPATH=", 8) == 0)
+            devpath = msg + i + 8;
+        else if (strncmp(msg + i, "SUBSYSTEM=", 10) == 0)
+            subsystem = msg + i + 10;
+        else if (strncmp(msg + i, "DEVNAME=", 8) == 0)
+            devname = msg + i + 8;
+    }
+
+    if (!action || !devpath || !subsystem || !devname)
+        return;
+    if (strcmp(subsystem, "usbmisc") != 0 ||
+            strncmp(devname, WIXUSB_DEV_NAME, strlen(WIXUSB_DEV_NAME)) != 0)
+        return;
+
+    if (strcmp(action, "add") == 0) {
+        /* DEVPATH is .../<usb device>/<interface>/usbmisc/<devname> */
+        snprintf(usbdir, sizeof (usbdir), "/sys%s/../../..", devpath);
+        hotplug_arrived(hp, devname, usbdir);
+    } else if (strcmp(action, "remove") == 0) {
+        hotplug_left(hp, devname);
+    }
+}
+
+wixusb_hotplug * WixUsb_HotplugOpen(void) {
+    struct sockaddr_nl addr;
+    struct wixusb_hotplug *hp;
+
+    hp = calloc(1, sizeof (*hp));
+    if (hp == NULL)
+        return NULL;
+
+    hp->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            NETLINK_KOBJECT_UEVENT);
+    if (hp->fd < 0)
+        goto error;
+
+    memset(&addr, 0, sizeof (addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; /* kernel events */
+    if (bind(hp->fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+        goto error;
+
+    /* bound first, so nothing plugged during the scan is missed */
+    hotplug_scan(hp);
+    return hp;
+
+error:
+    if (hp->fd >= 0)
+        close(hp->fd);
+    free(hp);
+    return NULL;
+}
+
+int WixUsb_HotplugFd(wixusb_hotplug * Hotplug) {
+    return Hotplug->fd;
+}
+
+int WixUsb_HotplugNext(wixusb_hotplug * Hotplug, wixusb_hotplug_t * Event) {
+    char buff[4096];
+    int len;
+
+    while (Hotplug->queue_len == 0) {
+        len = recv(Hotplug->fd, buff, sizeof (buff) - 1, 0);
+        if (len < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        buff[len] = 0;
+        hotplug_parse(Hotplug, buff, len);
+    }
+
+    *Event = Hotplug->queue[Hotplug->queue_head];
+    Hotplug->queue_head = (Hotplug->queue_head + 1) % HOTPLUG_QUEUE_LEN;
+    Hotplug->queue_len--;
+    return 1;
+}
+
+void WixUsb_HotplugClose(wixusb_hotplug * Hotplug) {
+    if (Hotplug == NULL)
+        return;
+    close(Hotplug->fd);
+    free(Hotplug);
+}
@@ -39,14 +39,144 @@ int WinUsb_Connect(void);
 
 bool CheckConnected(unsigned long deviceFd);
 
+/*
+ * A configuration descriptor comes whole, with its interfaces and
+ * endpoints, from the copy the kernel made at enumeration: no control
+ * transfer and no DESC_BUFF_LENGTH limit. LengthTransferred is what fitted
+ * in Buffer, read the 9 byte header first to learn wTotalLength.
+ */
 int WinUsb_GetDescriptor(int fd, uint8_t DescriptorType, uint8_t Index,
         uint16_t LanguageID, uint8_t * Buffer,
         uint32_t BufferLength,
         uint32_t * LengthTransferred);
 
+/*
+ * Parsers of a configuration blob, as in WinUSB. They work in place and
+ * return pointers into the buffer; -1 matches any value. StartPosition may
+ * be NULL to start at the beginning.
+ */
+PUSB_INTERFACE_DESCRIPTOR WinUsb_ParseConfigurationDescriptor(
+        PUSB_CONFIGURATION_DESCRIPTOR ConfigurationDescriptor,
+        void * StartPosition, LONG InterfaceNumber, LONG AlternateSetting,
+        LONG InterfaceClass, LONG InterfaceSubClass, LONG InterfaceProtocol);
+
+PUSB_COMMON_DESCRIPTOR WinUsb_ParseDescriptors(void * DescriptorBuffer,
+        ULONG TotalLength, void * StartPosition, LONG DescriptorType);
+
+/*
+ * Iterator over a configuration blob, nothing is allocated. Endpoints and
+ * class-specific descriptors are those of the interface last returned by
+ * WixUsb_NextInterface(), the calls return NULL at the next interface.
+ * Each call skips what it does not match; the iterator is a plain struct,
+ * walk a copy to look at an interface's descriptors more than one way.
+ *
+ *   WixUsb_DescIterInit(&it, config, len);
+ *   while ((intf = WixUsb_NextInterface(&it)) != NULL) {
+ *       WIXUSB_DESC_ITER eps = it;
+ *
+ *       while ((ep = WixUsb_NextEndpoint(&eps)) != NULL)
+ *           ...
+ *   }
+ */
+typedef struct {
+    const UCHAR * pos;
+    const UCHAR * end;
+} WIXUSB_DESC_ITER;
+
+void WixUsb_DescIterInit(WIXUSB_DESC_ITER * Iter,
+        const USB_CONFIGURATION_DESCRIPTOR * Config, ULONG Length);
+
+/* Any descriptor type, -1 for the next descriptor whatever it is */
+const USB_COMMON_DESCRIPTOR * WixUsb_DescNext(WIXUSB_DESC_ITER * Iter,
+        LONG DescriptorType);
+
+const USB_INTERFACE_DESCRIPTOR * WixUsb_NextInterface(WIXUSB_DESC_ITER * Iter);
+
+const USB_INTERFACE_ASSOCIATION_DESCRIPTOR * WixUsb_NextAssociation(
+        WIXUSB_DESC_ITER * Iter);
+
+const USB_ENDPOINT_DESCRIPTOR * WixUsb_NextEndpoint(WIXUSB_DESC_ITER * Iter);
+
+/* USB_DESCRIPTOR_IS_CLASS() types, like the CS_INTERFACE ones of CDC */
+const USB_COMMON_DESCRIPTOR * WixUsb_NextClassSpecific(WIXUSB_DESC_ITER * Iter);
+
+/*
+ * PIPE_RATE_LIMIT and PIPE_BURST_SIZE shape the handle's transfers on a
+ * bulk or interrupt pipe with a token bucket. A transfer over the rate
+ * sleeps in the kernel; the delays are counted in wixusb_stats_t.
+ */
 int WinUsb_SetPipePolicy(int fd, uint8_t PipeID, uint32_t PolicyType,
         uint32_t ValueLength, void * Value);
 
+/*
+ * SHORT_PACKET_TERMINATE is on by default, unlike in WinUSB: a write that
+ * ends on a packet boundary is followed by a zero length packet.
+ */
+BOOL WinUsb_GetPipePolicy(int InterfaceHandle, UCHAR PipeID, ULONG PolicyType,
+        PULONG ValueLength, void * Value);
+
+/*
+ * AUTO_SUSPEND applies to this handle only: turning it off wakes the device
+ * and keeps it awake until it is turned back on or the handle is closed.
+ */
+BOOL WinUsb_SetPowerPolicy(int InterfaceHandle, ULONG PolicyType,
+        ULONG ValueLength, void * Value);
+
+BOOL WinUsb_GetPowerPolicy(int InterfaceHandle, ULONG PolicyType,
+        PULONG ValueLength, void * Value);
+
+/* Never waits for transfers in progress, cheap enough to poll */
+BOOL WixUsb_GetStatus(int InterfaceHandle, wixusb_status_t * Status);
+
+/* Transfer counters of this handle only */
+BOOL WixUsb_GetStatistics(int InterfaceHandle, wixusb_stats_t * Stats);
+
+/*
+ * Transfers are admitted by priority class, each class up to its limit of
+ * transfers at once. By default control and interrupt transfers are
+ * WIXUSB_PRIO_CRITICAL and bulk ones WIXUSB_PRIO_BULK, a handle can put all
+ * of its transfers into one class instead (WIXUSB_PRIO_AUTO restores it).
+ */
+BOOL WixUsb_SetPriority(int InterfaceHandle, WIXUSB_PRIORITY Priority);
+
+/* For all handles of the interface */
+BOOL WixUsb_SetPriorityLimit(int InterfaceHandle, WIXUSB_PRIORITY Priority,
+        ULONG Limit);
+
+BOOL WixUsb_GetPriorityStats(int InterfaceHandle, wixusb_prio_stats_t * Stats);
+
+/*
+ * Upper bound in microseconds of the latency under which Percentile (0 to
+ * 100) of the class's transfers completed, 0 without transfers.
+ */
+uint64_t WixUsb_LatencyPercentile(const wixusb_prio_class_t * Class,
+        double Percentile);
+
+/*
+ * In broadcast mode reads on this handle come from a bulk IN stream shared
+ * with the other broadcast handles, each handle sees every byte. The first
+ * handle to enable it cancels its own pending read, and fails with EBUSY
+ * while another handle has a transfer on the bulk IN pipe.
+ */
+BOOL WixUsb_SetBroadcastMode(int InterfaceHandle, BOOL Enable,
+        WIXUSB_BCAST_POLICIES SlowPolicy);
+
+/*
+ * In framed mode each read returns records of a wixusb_frame_hdr_t followed
+ * by its payload, with the time the data came off the bus.
+ */
+BOOL WixUsb_SetFramedRead(int InterfaceHandle, BOOL Enable);
+
+/*
+ * Walks the records of a framed read. Offset starts at 0 and is advanced
+ * past the record, FALSE is returned at the end of the data.
+ */
+BOOL WixUsb_ParseFrame(const void * Buffer, ULONG Length, PULONG Offset,
+        wixusb_frame_hdr_t * Header, const UCHAR ** Payload);
+
+/* Resumes a suspended device ahead of a burst, it then idles for SUSPEND_DELAY */
+BOOL WixUsb_Prewarm(int InterfaceHandle);
+
 /* WinUsb_ReadPipe*/
 int WixUsb_ReadBulk(int InterfaceHandle, void * Buffer,
         uint32_t BufferLength, uint32_t * LengthTransferred);
@@ -56,10 +186,138 @@ int WixUsb_ReadBulk(int InterfaceHandle, void * Buffer,
 int WixUsb_WriteBulk(int InterfaceHandle, PUCHAR Buffer,
         ULONG BufferLength, PULONG LengthTransferred);
 
+/*
+ * With Overlapped set the transfer is queued on the completion port the
+ * handle is bound to (winusb_iocp.h). The call then fails with errno
+ * EINPROGRESS, like ERROR_IO_PENDING, and Buffer must stay valid until the
+ * completion is dequeued.
+ *
+ * PipeID must be the bulk pipe the driver uses in the current setting,
+ * as last selected through this handle; the check makes no system call.
+ */
+BOOL WinUsb_ReadPipe(int InterfaceHandle, UCHAR PipeID, PUCHAR Buffer,
+        ULONG BufferLength, PULONG LengthTransferred,
+        LPOVERLAPPED Overlapped);
+
+BOOL WinUsb_WritePipe(int InterfaceHandle, UCHAR PipeID, PUCHAR Buffer,
+        ULONG BufferLength, PULONG LengthTransferred,
+        LPOVERLAPPED Overlapped);
+
 BOOL WinUsb_ControlTransfer(int InterfaceHandle,
         WINUSB_SETUP_PACKET SetupPacket, PUCHAR Buffer, ULONG BufferLength,
         PULONG LengthTransferred, LPOVERLAPPED Overlapped);
 
+/*
+ * Closes the handle. Use it rather than close(), it also drops the cached
+ * pipe table and the completion port binding: a handle number closed with
+ * close() and handed out again keeps the table of the old device.
+ */
+BOOL WinUsb_Free(int InterfaceHandle);
+
+/*
+ * The interface and pipe table is read once per handle and cached, the
+ * queries below then make no system call.
+ */
+BOOL WinUsb_QueryInterfaceSettings(int InterfaceHandle,
+        UCHAR AlternateInterfaceNumber,
+        PUSB_INTERFACE_DESCRIPTOR UsbAltInterfaceDescriptor);
+
+BOOL WinUsb_QueryPipe(int InterfaceHandle, UCHAR AlternateInterfaceNumber,
+        UCHAR PipeIndex, PWINUSB_PIPE_INFORMATION PipeInformation);
+
+BOOL WinUsb_QueryPipeEx(int InterfaceHandle, UCHAR AlternateSettingNumber,
+        UCHAR PipeIndex, PWINUSB_PIPE_INFORMATION_EX PipeInformationEx);
+
+/* Only DEVICE_SPEED, Buffer receives a UCHAR */
+BOOL WinUsb_QueryDeviceInformation(int InterfaceHandle, ULONG InformationType,
+        PULONG BufferLength, void * Buffer);
+
+/*
+ * Opens another interface of a composite device, each one is a device node
+ * of its own with independent I/O. Index 0 is the interface following this
+ * one in the configuration. Free the new handle with WinUsb_Free.
+ */
+BOOL WinUsb_GetAssociatedInterface(int InterfaceHandle,
+        UCHAR AssociatedInterfaceIndex, int * AssociatedInterfaceHandle);
+
+/*
+ * Selects an alternate setting of the interface. Transfers in flight on
+ * its pipes are cancelled. The broadcast stream is paused for the switch
+ * and resumed on the new bulk IN endpoint; transfers to a pipe the new
+ * setting lacks fail with ENODEV.
+ */
+BOOL WinUsb_SetCurrentAlternateSetting(int InterfaceHandle,
+        UCHAR SettingNumber);
+
+BOOL WinUsb_GetCurrentAlternateSetting(int InterfaceHandle,
+        PUCHAR SettingNumber);
+
+/*
+ * USB 3 bulk streams on the bulk pipe pair. Allocated receives the number
+ * granted by the host controller, which may be fewer than asked for.
+ * NumStreams 0 frees them; no stream transfer may be in flight then.
+ */
+BOOL WixUsb_AllocStreams(int InterfaceHandle, ULONG NumStreams,
+        PULONG Allocated);
+
+/*
+ * Bulk transfer on stream StreamID (1 .. Allocated) of PipeID. Calls from
+ * several threads are outstanding on the bus together, each returns when
+ * its own transfer completes.
+ */
+BOOL WixUsb_StreamTransfer(int InterfaceHandle, UCHAR PipeID,
+        USHORT StreamID, PUCHAR Buffer, ULONG BufferLength,
+        PULONG LengthTransferred);
+
+/*
+ * Cancels the transfers in flight on the pipe, stream transfers included.
+ * Does not wait for io_mutex.
+ */
+BOOL WinUsb_AbortPipe(int InterfaceHandle, UCHAR PipeID);
+
+/* Cancels the pipe's transfers, clears a stall and resets the data toggle */
+BOOL WinUsb_ResetPipe(int InterfaceHandle, UCHAR PipeID);
+
+/*
+ * Drops what the handle received on an IN pipe but has not read yet, the
+ * broadcast backlog or a completed non-blocking read. Transfers still in
+ * flight are not cancelled.
+ */
+BOOL WinUsb_FlushPipe(int InterfaceHandle, UCHAR PipeID);
+
+/*
+ * Hot-plug notification. An unplugged device is also reported on its open
+ * handles: poll() returns POLLHUP and pending transfers fail right away.
+ */
+typedef enum {
+    WIXUSB_HOTPLUG_ARRIVED = 0,
+    WIXUSB_HOTPLUG_LEFT = 1,
+} WIXUSB_HOTPLUG_EVENT;
+
+typedef struct {
+    WIXUSB_HOTPLUG_EVENT event;
+    char path[64]; /* device node to open */
+    USHORT idVendor;
+    USHORT idProduct;
+    char serial[128];
+} wixusb_hotplug_t;
+
+typedef struct wixusb_hotplug wixusb_hotplug;
+
+/*
+ * Devices present at open are queued as arrivals, drain them with
+ * WixUsb_HotplugNext before waiting on the descriptor.
+ */
+wixusb_hotplug * WixUsb_HotplugOpen(void);
+
+/* Becomes readable on new kernel events, for poll/epoll */
+int WixUsb_HotplugFd(wixusb_hotplug * Hotplug);
+
+/* Returns 1 and fills Event, 0 when nothing is pending, -1 on error */
+int WixUsb_HotplugNext(wixusb_hotplug * Hotplug, wixusb_hotplug_t * Event);
+
+void WixUsb_HotplugClose(wixusb_hotplug * Hotplug);
+
 #ifdef __cplusplus
 }
 #endif
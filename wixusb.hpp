@@ -0,0 +1,416 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Ildar Sadykov <irsdkv@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * C++ interface over winusb_wrapper.h, header only. Needs C++20 coroutines
+ * and std::expected from the C++23 library (-std=c++2b with GCC 12).
+ *
+ * Async transfers are coroutines suspended on fd readiness. A Reactor owns
+ * an epoll set and resumes them from run(); the awaiter lives in the
+ * coroutine frame, so an operation does not allocate. An attached handle
+ * is non-blocking: the driver starts a bulk transfer and fails with EAGAIN,
+ * then reports the handle ready when the URB completes. A write completes
+ * once the driver has taken the data, its failure fails the next write.
+ * Control transfers have no non-blocking form and run on the reactor
+ * thread, bounded by the control pipe's timeout.
+ *
+ * Everything attached to one Reactor must be used from its thread.
+ */
+
+#ifndef WIXUSB_HPP
+#define WIXUSB_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <cerrno>
+#include <expected>
+#include <memory>
+#include <span>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "winusb_wrapper.h"
+
+namespace wixusb {
+
+template <class T>
+using result = std::expected<T, std::error_code>;
+
+class Device;
+class Reactor;
+
+namespace detail {
+
+inline std::unexpected<std::error_code> error(int err) {
+    return std::unexpected(std::error_code(err, std::system_category()));
+}
+
+inline std::unexpected<std::error_code> last_error() {
+    return error(errno);
+}
+
+/* Intrusive node, embedded in each awaiter */
+struct waiter {
+    waiter *next = nullptr;
+    std::coroutine_handle<> handle;
+
+    /* Retries the transfer, false while it would still block */
+    virtual bool try_complete() = 0;
+
+protected:
+    ~waiter() = default;
+};
+
+struct wait_queue {
+    waiter *head = nullptr;
+    waiter *tail = nullptr;
+
+    void push(waiter *w) {
+        w->next = nullptr;
+        if (tail)
+            tail->next = w;
+        else
+            head = w;
+        tail = w;
+    }
+
+    /*
+     * Moves the finished waiters to ready, the others wait for the next
+     * event. Nothing is resumed here: a resumed coroutine may close the
+     * device and free this queue.
+     */
+    void collect(wait_queue &ready) {
+        waiter *w = std::exchange(head, nullptr);
+
+        tail = nullptr;
+        while (w) {
+            waiter *next = w->next;
+
+            if (w->try_complete())
+                ready.push(w);
+            else
+                push(w);
+            w = next;
+        }
+    }
+
+    void resume_all() {
+        waiter *w = std::exchange(head, nullptr);
+
+        tail = nullptr;
+        while (w) {
+            waiter *next = w->next;
+
+            w->handle.resume();
+            w = next;
+        }
+    }
+};
+
+/* Allocated once per attached Device, epoll keeps a pointer to it */
+struct channel {
+    int fd;
+    wait_queue readers;
+    wait_queue writers;
+};
+
+/* Reads at most BULK_BUFF_LENGTH bytes */
+inline result<std::size_t> read(int fd, std::span<std::byte> buffer) {
+    uint32_t len = 0;
+
+    if (buffer.size() > BULK_BUFF_LENGTH)
+        buffer = buffer.first(BULK_BUFF_LENGTH);
+    if (WixUsb_ReadBulk(fd, buffer.data(), buffer.size(), &len) != TRUE)
+        return last_error();
+    return len;
+}
+
+inline result<std::size_t> write(int fd, std::span<const std::byte> buffer) {
+    ULONG len = 0;
+
+    if (buffer.size() > BULK_BUFF_LENGTH)
+        return error(EMSGSIZE);
+    /* the C call takes a non-const buffer but does not write to it */
+    if (WixUsb_WriteBulk(fd, (PUCHAR) buffer.data(), buffer.size(), &len) != TRUE)
+        return last_error();
+    return len;
+}
+
+inline result<std::size_t> control(int fd, const WINUSB_SETUP_PACKET &setup,
+        std::span<std::byte> data) {
+    ULONG len = 0;
+
+    if (data.size() < setup.Length)
+        return error(EINVAL);
+    if (WinUsb_ControlTransfer(fd, setup, (PUCHAR) data.data(), data.size(),
+            &len, nullptr) != TRUE)
+        return last_error();
+    return len;
+}
+
+template <class Op>
+class transfer final : waiter {
+public:
+    transfer(wait_queue *queue, Op op) : queue_(queue), op_(std::move(op)) {
+    }
+
+    bool await_ready() {
+        return try_complete();
+    }
+
+    void await_suspend(std::coroutine_handle<> h) {
+        handle = h;
+        queue_->push(this);
+    }
+
+    result<std::size_t> await_resume() {
+        return std::move(res_);
+    }
+
+private:
+    bool try_complete() override {
+        res_ = op_();
+        return res_ || res_.error() != std::errc::resource_unavailable_try_again;
+    }
+
+    wait_queue *queue_;
+    Op op_;
+    result<std::size_t> res_ = error(EAGAIN);
+};
+
+} /* namespace detail */
+
+class Reactor {
+public:
+    Reactor() : epfd_(::epoll_create1(EPOLL_CLOEXEC)) {
+    }
+
+    ~Reactor() {
+        if (epfd_ >= 0)
+            ::close(epfd_);
+    }
+
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    bool valid() const {
+        return epfd_ >= 0;
+    }
+
+    /* Waits up to timeout_ms and resumes the ready transfers */
+    result<int> run_once(int timeout_ms = -1) {
+        epoll_event events[64];
+        int n = ::epoll_wait(epfd_, events, 64, timeout_ms);
+
+        if (n < 0)
+            return errno == EINTR ? 0 : result<int>(detail::last_error());
+
+        /* all channels are looked at before any coroutine runs */
+        detail::wait_queue ready;
+
+        for (int i = 0; i < n; i++) {
+            auto *ch = static_cast<detail::channel *>(events[i].data.ptr);
+            uint32_t ev = events[i].events;
+
+            /* a hangup fails the transfers of both directions */
+            if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                ch->readers.collect(ready);
+            if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                ch->writers.collect(ready);
+        }
+        ready.resume_all();
+        return n;
+    }
+
+    void run() {
+        stopped_ = false;
+        while (!stopped_ && run_once())
+            ;
+    }
+
+    void stop() {
+        stopped_ = true;
+    }
+
+private:
+    friend class Device;
+
+    int epfd_;
+    bool stopped_ = false;
+};
+
+/* Owns a device handle, closed on destruction */
+class Device {
+public:
+    Device() = default;
+
+    explicit Device(int fd) : fd_(fd) {
+    }
+
+    static result<Device> open(const char *path) {
+        int fd = ::open(path, O_RDWR | O_CLOEXEC);
+
+        if (fd < 0)
+            return detail::last_error();
+        return Device(fd);
+    }
+
+    /* First wixusb device found, as WinUsb_Connect */
+    static result<Device> connect() {
+        int fd = WinUsb_Connect();
+
+        if (fd < 0)
+            return detail::error(ENODEV);
+        return Device(fd);
+    }
+
+    Device(Device &&other) noexcept
+        : fd_(std::exchange(other.fd_, -1)), ch_(std::move(other.ch_)),
+          reactor_(std::exchange(other.reactor_, nullptr)) {
+    }
+
+    Device &operator=(Device &&other) noexcept {
+        if (this != &other) {
+            close();
+            fd_ = std::exchange(other.fd_, -1);
+            ch_ = std::move(other.ch_);
+            reactor_ = std::exchange(other.reactor_, nullptr);
+        }
+        return *this;
+    }
+
+    Device(const Device &) = delete;
+    Device &operator=(const Device &) = delete;
+
+    /* Transfers still suspended on the device must be finished first */
+    ~Device() {
+        close();
+    }
+
+    int native_handle() const {
+        return fd_;
+    }
+
+    explicit operator bool() const {
+        return fd_ >= 0;
+    }
+
+    /* Another interface of a composite device, 0 is the next one */
+    result<Device> associated(unsigned index) const {
+        int fd;
+
+        if (WinUsb_GetAssociatedInterface(fd_, index, &fd) != TRUE)
+            return detail::last_error();
+        return Device(fd);
+    }
+
+    /* Reads at most BULK_BUFF_LENGTH bytes */
+    result<std::size_t> read(std::span<std::byte> buffer) {
+        return detail::read(fd_, buffer);
+    }
+
+    result<std::size_t> write(std::span<const std::byte> buffer) {
+        return detail::write(fd_, buffer);
+    }
+
+    /* The data stage goes to or comes from data, by the direction bit */
+    result<std::size_t> control(const WINUSB_SETUP_PACKET &setup,
+            std::span<std::byte> data = {}) {
+        return detail::control(fd_, setup, data);
+    }
+
+    /*
+     * Makes the handle non-blocking and registers it with the reactor, the
+     * synchronous calls may then fail with EAGAIN.
+     */
+    result<void> attach(Reactor &reactor) {
+        epoll_event ev{};
+        int flags;
+
+        if (reactor_)
+            return detail::error(EBUSY);
+
+        flags = ::fcntl(fd_, F_GETFL);
+        if (flags < 0 || ::fcntl(fd_, F_SETFL, flags | O_NONBLOCK) < 0)
+            return detail::last_error();
+
+        ch_ = std::make_unique<detail::channel>();
+        ch_->fd = fd_;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = ch_.get();
+        if (::epoll_ctl(reactor.epfd_, EPOLL_CTL_ADD, fd_, &ev) < 0) {
+            ch_.reset();
+            return detail::last_error();
+        }
+        reactor_ = &reactor;
+        return {};
+    }
+
+    /*
+     * co_await yields result<std::size_t>, the device must be attached. The
+     * operation holds the fd and the channel, not the Device, which may be
+     * moved while it is suspended.
+     */
+    auto async_read(std::span<std::byte> buffer) {
+        auto op = [fd = fd_, buffer] { return detail::read(fd, buffer); };
+        return detail::transfer<decltype(op)>(&ch_->readers, op);
+    }
+
+    auto async_write(std::span<const std::byte> buffer) {
+        auto op = [fd = fd_, buffer] { return detail::write(fd, buffer); };
+        return detail::transfer<decltype(op)>(&ch_->writers, op);
+    }
+
+    auto async_control(const WINUSB_SETUP_PACKET &setup,
+            std::span<std::byte> data = {}) {
+        auto op = [fd = fd_, setup, data] {
+            return detail::control(fd, setup, data);
+        };
+        return detail::transfer<decltype(op)>(&ch_->writers, op);
+    }
+
+private:
+    void close() {
+        if (fd_ < 0)
+            return;
+        if (reactor_)
+            ::epoll_ctl(reactor_->epfd_, EPOLL_CTL_DEL, fd_, nullptr);
+        WinUsb_Free(fd_);
+        fd_ = -1;
+        ch_.reset();
+        reactor_ = nullptr;
+    }
+
+    int fd_ = -1;
+    std::unique_ptr<detail::channel> ch_;
+    Reactor *reactor_ = nullptr;
+};
+
+} /* namespace wixusb */
+
+#endif /* WIXUSB_HPP */
@@ -78,6 +78,49 @@ extern "C" {
 #define SETUP_PACKET_IS_INPUT(bmRequestType)  ((bmRequestType & (1 << 7) ? 1 : 0))
 
 
+// Device Information types
+#define DEVICE_SPEED            0x01
+
+// Device Speeds
+#define LowSpeed                0x01
+#define FullSpeed               0x02
+#define HighSpeed               0x03
+#define SuperSpeed              0x04 /* not in WinUSB, which reports HighSpeed */
+
+typedef enum _USBD_PIPE_TYPE {
+    UsbdPipeTypeControl,
+    UsbdPipeTypeIsochronous,
+    UsbdPipeTypeBulk,
+    UsbdPipeTypeInterrupt
+} USBD_PIPE_TYPE;
+
+typedef struct _WINUSB_PIPE_INFORMATION {
+    USBD_PIPE_TYPE PipeType;
+    UCHAR PipeId;
+    USHORT MaximumPacketSize;
+    UCHAR Interval;
+} WINUSB_PIPE_INFORMATION, *PWINUSB_PIPE_INFORMATION;
+
+typedef struct _WINUSB_PIPE_INFORMATION_EX {
+    USBD_PIPE_TYPE PipeType;
+    UCHAR PipeId;
+    USHORT MaximumPacketSize;
+    UCHAR Interval;
+    ULONG MaximumBytesPerInterval;
+} WINUSB_PIPE_INFORMATION_EX, *PWINUSB_PIPE_INFORMATION_EX;
+
+typedef struct _USB_INTERFACE_DESCRIPTOR {
+    UCHAR bLength;
+    UCHAR bDescriptorType;
+    UCHAR bInterfaceNumber;
+    UCHAR bAlternateSetting;
+    UCHAR bNumEndpoints;
+    UCHAR bInterfaceClass;
+    UCHAR bInterfaceSubClass;
+    UCHAR bInterfaceProtocol;
+    UCHAR iInterface;
+} USB_INTERFACE_DESCRIPTOR, *PUSB_INTERFACE_DESCRIPTOR;
+
 typedef struct _WINUSB_SETUP_PACKET {
     UCHAR RequestType;
     UCHAR Request;
@@ -102,30 +145,190 @@ typedef enum  {
 
 typedef enum {
     SHORT_PACKET_TERMINATE = 0x01,
+    AUTO_CLEAR_STALL = 0x02,
     PIPE_TRANSFER_TIMEOUT = 0x03,
+    /* token bucket shaping of a bulk or interrupt pipe, not in WinUSB */
+    PIPE_RATE_LIMIT = 0x40, /* bytes per second, 0 turns shaping off */
+    PIPE_BURST_SIZE = 0x41, /* bytes that may go at once above the rate */
 } PIPE_POLICIES;
 
+typedef enum {
+    AUTO_SUSPEND = 0x81,
+    SUSPEND_DELAY = 0x83,
+} POWER_POLICIES;
+
 typedef struct {
     WINUSB_SETUP_PACKET winusb_packet;
     uint8_t data[CTRL_BUFF_LENGTH];
 }wixusb_ctrl_packet_t;
 
+/* Data stage of Length bytes (up to 64 KB) at a user pointer */
+typedef struct {
+    WINUSB_SETUP_PACKET winusb_packet;
+    uint64_t data;
+}wixusb_ctrl_xfer_t;
+
 typedef struct {
     USB_DESCRIPTOR_TYPES desc_type;
     uint8_t desc_idx;
     uint8_t data[DESC_BUFF_LENGTH];
 }wixusb_get_desc_t;
 
+/* Policies are kept per open handle, pipe_id 0 is the control pipe */
 typedef struct {
     PIPE_POLICIES policy_type;
     uint32_t policy_value;
+    uint8_t pipe_id;
 }wixusb_set_pipe_policy_t;
 
+typedef struct {
+    POWER_POLICIES policy_type;
+    uint32_t policy_value;
+}wixusb_power_policy_t;
+
+/* Transfer counters of one open handle */
+typedef struct {
+    uint64_t transfers;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t errors;
+    uint64_t timeouts;
+    uint64_t dropped; /* broadcast transfers lost by a slow reader */
+    uint64_t throttled; /* transfers delayed by PIPE_RATE_LIMIT */
+    uint64_t throttled_bytes;
+    uint64_t throttle_ns; /* time spent waiting for the rate */
+}wixusb_stats_t;
+
+/* What a broadcast reader does when it falls a full ring behind */
+typedef enum {
+    WIXUSB_BCAST_DROP = 0, /* skip the oldest data */
+    WIXUSB_BCAST_BLOCK = 1, /* hold back the stream for everyone */
+} WIXUSB_BCAST_POLICIES;
+
+typedef struct {
+    uint32_t enable;
+    uint32_t slow_policy; /* WIXUSB_BCAST_POLICIES */
+}wixusb_bcast_mode_t;
+
+/*
+ * Record header of framed reads, the payload follows it. The times are
+ * taken in the URB completion handler.
+ */
+typedef struct {
+    uint64_t mono_ns; /* CLOCK_MONOTONIC */
+    uint64_t boot_ns; /* CLOCK_BOOTTIME */
+    uint32_t length; /* payload bytes in this record */
+    int32_t status; /* 0 or the negative errno of the transfer */
+    uint8_t endpoint;
+    uint8_t reserved[7];
+}wixusb_frame_hdr_t;
+
 typedef struct {
     uint16_t vid;
     uint16_t pid;
 }wixusb_vid_pid_t;
 
+#define WIXUSB_MAX_ALTSETTINGS  8
+#define WIXUSB_MAX_PIPES        16
+
+typedef struct {
+    uint8_t address;
+    uint8_t type; /* USBD_PIPE_TYPE */
+    uint16_t max_packet; /* bytes per packet, without the high-bandwidth multiplier */
+    uint8_t interval; /* bInterval */
+    uint8_t reserved[3];
+    uint32_t bytes_per_interval; /* periodic pipes, 0 for the others */
+}wixusb_pipe_info_t;
+
+typedef struct {
+    USB_INTERFACE_DESCRIPTOR desc;
+    uint8_t num_pipes;
+    uint8_t reserved[2];
+    wixusb_pipe_info_t pipes[WIXUSB_MAX_PIPES];
+}wixusb_alt_info_t;
+
+/* Interface and pipe table of a handle, captured at probe */
+typedef struct {
+    uint32_t speed; /* LowSpeed .. SuperSpeed */
+    uint32_t num_alts;
+    wixusb_alt_info_t alts[WIXUSB_MAX_ALTSETTINGS];
+}wixusb_iface_info_t;
+
+#define WIXUSB_STREAM_MAX_XFER  (64 * 1024)
+
+/* Bulk transfer tagged with a USB 3 stream ID, see IOCTL_ALLOC_STREAMS */
+typedef struct {
+    uint64_t data; /* user buffer */
+    uint32_t length; /* up to WIXUSB_STREAM_MAX_XFER */
+    uint32_t actual; /* bytes transferred, set on return */
+    uint16_t stream_id; /* 1 .. the number of streams allocated */
+    uint8_t endpoint; /* the bulk IN or OUT pipe ID */
+    uint8_t reserved[5];
+}wixusb_stream_xfer_t;
+
+/* Another interface of a composite device, see IOCTL_GET_ASSOC_IFACE */
+typedef struct {
+    uint8_t index; /* 0 is the interface following this one */
+    uint8_t interface_number; /* bInterfaceNumber, set on return */
+    uint8_t reserved[2];
+    uint32_t node; /* set on return, the device node is WIXUSB_DEV_NAME "<node>" */
+}wixusb_assoc_iface_t;
+
+/* Scheduling classes of the transfers, the lower value goes first */
+typedef enum {
+    WIXUSB_PRIO_CRITICAL = 0, /* default of control and interrupt transfers */
+    WIXUSB_PRIO_NORMAL = 1,
+    WIXUSB_PRIO_BULK = 2, /* default of bulk transfers */
+    WIXUSB_PRIO_COUNT = 3,
+    WIXUSB_PRIO_AUTO = 0xFF, /* the default by transfer type */
+} WIXUSB_PRIORITY;
+
+#define WIXUSB_LAT_BUCKETS      32
+
+typedef struct {
+    uint32_t prio;
+    uint32_t limit; /* transfers of the class admitted at once, at least 1 */
+}wixusb_prio_limit_t;
+
+typedef struct {
+    uint32_t limit;
+    uint32_t in_flight;
+    uint64_t transfers;
+    /*
+     * From the call to the completion, queueing included. Bucket i counts
+     * 2^i to 2^(i+1) - 1 microseconds, bucket 0 also takes the shorter ones.
+     */
+    uint64_t latency[WIXUSB_LAT_BUCKETS];
+}wixusb_prio_class_t;
+
+/* Device-wide, all handles of the interface together */
+typedef struct {
+    wixusb_prio_class_t classes[WIXUSB_PRIO_COUNT];
+}wixusb_prio_stats_t;
+
+/*
+ * Command area of an IORING_OP_URING_CMD SQE, fits a 64 byte SQE. The SQE's
+ * cmd_op is IOCTL_CTRL_XFER, IOCTL_SEND_CTRL, IOCTL_RECV_CTRL or
+ * IOCTL_WRITE_INT, and arg points at the structure that ioctl takes.
+ */
+typedef struct {
+    uint64_t arg;
+    uint64_t reserved;
+}wixusb_uring_cmd_t;
+
+/* Snapshot for monitoring, answered without waiting for transfers */
+typedef struct {
+    uint32_t connected;
+    uint16_t vid;
+    uint16_t pid;
+    uint32_t speed; /* enum usb_device_speed of the kernel */
+    uint32_t open_handles;
+    uint32_t in_flight; /* direct transfers on the bus, all handles */
+    uint32_t bcast_queued; /* broadcast data not read yet by this handle, in slots */
+    uint32_t bcast_pending; /* broadcast URBs on the bus */
+    uint32_t reserved;
+}wixusb_status_t;
+
 typedef struct _USB_DEVICE_DESCRIPTOR {
     UCHAR bLength;
     UCHAR bDescriptorType;
@@ -143,6 +346,62 @@ typedef struct _USB_DEVICE_DESCRIPTOR {
     UCHAR bNumConfigurations;
 } USB_DEVICE_DESCRIPTOR, *PUSB_DEVICE_DESCRIPTOR;
 
+/*
+ * Descriptors as they sit in the configuration blob, see
+ * WinUsb_ParseDescriptors(). Packed, a descriptor may start at any offset.
+ */
+#pragma pack(1)
+
+typedef struct _USB_COMMON_DESCRIPTOR {
+    UCHAR bLength;
+    UCHAR bDescriptorType;
+} USB_COMMON_DESCRIPTOR, *PUSB_COMMON_DESCRIPTOR;
+
+typedef struct _USB_CONFIGURATION_DESCRIPTOR {
+    UCHAR bLength;
+    UCHAR bDescriptorType;
+    USHORT wTotalLength;
+    UCHAR bNumInterfaces;
+    UCHAR bConfigurationValue;
+    UCHAR iConfiguration;
+    UCHAR bmAttributes;
+    UCHAR MaxPower;
+} USB_CONFIGURATION_DESCRIPTOR, *PUSB_CONFIGURATION_DESCRIPTOR;
+
+typedef struct _USB_ENDPOINT_DESCRIPTOR {
+    UCHAR bLength;
+    UCHAR bDescriptorType;
+    UCHAR bEndpointAddress;
+    UCHAR bmAttributes;
+    USHORT wMaxPacketSize;
+    UCHAR bInterval;
+} USB_ENDPOINT_DESCRIPTOR, *PUSB_ENDPOINT_DESCRIPTOR;
+
+typedef struct _USB_INTERFACE_ASSOCIATION_DESCRIPTOR {
+    UCHAR bLength;
+    UCHAR bDescriptorType;
+    UCHAR bFirstInterface;
+    UCHAR bInterfaceCount;
+    UCHAR bFunctionClass;
+    UCHAR bFunctionSubClass;
+    UCHAR bFunctionProtocol;
+    UCHAR iFunction;
+} USB_INTERFACE_ASSOCIATION_DESCRIPTOR, *PUSB_INTERFACE_ASSOCIATION_DESCRIPTOR;
+
+#pragma pack()
+
+/* Class-specific descriptor types have the class bit, like CS_INTERFACE 0x24 */
+#define USB_DESCRIPTOR_IS_CLASS(type)   (((type) & 0x60) == 0x20)
+
+/* Raw configuration descriptor with everything under it */
+typedef struct {
+    uint64_t data; /* user buffer */
+    uint32_t length; /* of the buffer */
+    uint32_t total; /* returned: wTotalLength */
+    uint8_t index; /* configuration index */
+    uint8_t reserved[7];
+}wixusb_config_desc_t;
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,478 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Ildar Sadykov <irsdkv@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Reference device for the driver: a FunctionFS daemon presenting the
+ * wixusb interface (vendor class, interrupt OUT, bulk IN, bulk OUT) so the
+ * driver can be run end to end on dummy_hcd. wixusb_gadget.sh sets up the
+ * configfs gadget with VID 0x1209 / PID 0x0001 and starts it.
+ *
+ * gcc -O2 -o wixusb_gadget wixusb_gadget.c -lpthread
+ *
+ * Usage: wixusb_gadget [-m mode] [-d delay_us] [-s size] [-v] ffs_dir
+ *   -m loopback     bulk OUT data is sent back on bulk IN (default)
+ *   -m source-sink  bulk IN sends a counting pattern, bulk OUT is drained
+ *   -m ctrl-echo    only vendor control requests are answered
+ *   -d N            delay in microseconds before each response
+ *   -s N            bulk transfer size, 4096 by default
+ *
+ * Vendor control requests are echoed in every mode: an OUT request keeps
+ * its data stage, the next IN request returns it. Interrupt OUT packets
+ * are read and counted. The endpoint numbers are given by the UDC, the
+ * driver finds its pipes by type and direction.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+/* htole16/32 are not constant expressions, the descriptors are static */
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define cpu_to_le16(x)      (x)
+#define cpu_to_le32(x)      (x)
+#else
+#define cpu_to_le16(x)      ((((x) >> 8) & 0xffu) | (((x) & 0xffu) << 8))
+#define cpu_to_le32(x)      ((((x) & 0xff000000u) >> 24) | (((x) & 0x00ff0000u) >> 8) | \
+                             (((x) & 0x0000ff00u) << 8) | (((x) & 0x000000ffu) << 24))
+#endif
+
+#define GADGET_INT_SIZE     64
+#define GADGET_CTRL_MAX     4096
+#define GADGET_MAX_SIZE     (1024 * 1024)
+
+enum {
+    MODE_LOOPBACK,
+    MODE_SOURCE_SINK,
+    MODE_CTRL_ECHO,
+};
+
+/* ep files in descriptor order */
+enum {
+    EP_INT_OUT = 1,
+    EP_BULK_IN,
+    EP_BULK_OUT,
+    EP_COUNT
+};
+
+struct ss_ep {
+    struct usb_endpoint_descriptor_no_audio ep;
+    struct usb_ss_ep_comp_descriptor comp;
+} __attribute__ ((packed));
+
+static const struct {
+    struct usb_functionfs_descs_head_v2 header;
+    __le32 fs_count;
+    __le32 hs_count;
+    __le32 ss_count;
+    struct {
+        struct usb_interface_descriptor intf;
+        struct usb_endpoint_descriptor_no_audio ep[EP_COUNT - 1];
+    } __attribute__ ((packed)) fs, hs;
+    struct {
+        struct usb_interface_descriptor intf;
+        struct ss_ep ep[EP_COUNT - 1];
+    } __attribute__ ((packed)) ss;
+} __attribute__ ((packed)) descriptors = {
+    .header = {
+        .magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+        .length = cpu_to_le32(sizeof (descriptors)),
+        .flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC |
+            FUNCTIONFS_HAS_SS_DESC),
+    },
+    .fs_count = cpu_to_le32(4),
+    .hs_count = cpu_to_le32(4),
+    .ss_count = cpu_to_le32(7),
+#define GADGET_INTF {                                                  \
+        .bLength = sizeof (struct usb_interface_descriptor),           \
+        .bDescriptorType = USB_DT_INTERFACE,                           \
+        .bNumEndpoints = EP_COUNT - 1,                                 \
+        .bInterfaceClass = USB_CLASS_VENDOR_SPEC,                      \
+        .iInterface = 1,                                               \
+    }
+#define GADGET_EP(addr, attr, size, interval) {                        \
+        .bLength = USB_DT_ENDPOINT_SIZE,                               \
+        .bDescriptorType = USB_DT_ENDPOINT,                            \
+        .bEndpointAddress = (addr),                                    \
+        .bmAttributes = (attr),                                        \
+        .wMaxPacketSize = cpu_to_le16(size),                               \
+        .bInterval = (interval),                                       \
+    }
+#define GADGET_COMP {                                                  \
+        .bLength = USB_DT_SS_EP_COMP_SIZE,                             \
+        .bDescriptorType = USB_DT_SS_ENDPOINT_COMP,                    \
+    }
+    .fs = {
+        .intf = GADGET_INTF,
+        .ep = {
+            GADGET_EP(USB_DIR_OUT | 1, USB_ENDPOINT_XFER_INT, 64, 1),
+            GADGET_EP(USB_DIR_IN | 2, USB_ENDPOINT_XFER_BULK, 64, 0),
+            GADGET_EP(USB_DIR_OUT | 3, USB_ENDPOINT_XFER_BULK, 64, 0),
+        },
+    },
+    .hs = {
+        .intf = GADGET_INTF,
+        .ep = {
+            GADGET_EP(USB_DIR_OUT | 1, USB_ENDPOINT_XFER_INT, 64, 4),
+            GADGET_EP(USB_DIR_IN | 2, USB_ENDPOINT_XFER_BULK, 512, 0),
+            GADGET_EP(USB_DIR_OUT | 3, USB_ENDPOINT_XFER_BULK, 512, 0),
+        },
+    },
+    .ss = {
+        .intf = GADGET_INTF,
+        .ep = {
+            { GADGET_EP(USB_DIR_OUT | 1, USB_ENDPOINT_XFER_INT, 64, 4),
+              { .bLength = USB_DT_SS_EP_COMP_SIZE,
+                .bDescriptorType = USB_DT_SS_ENDPOINT_COMP,
+                .wBytesPerInterval = cpu_to_le16(64) } },
+            { GADGET_EP(USB_DIR_IN | 2, USB_ENDPOINT_XFER_BULK, 1024, 0),
+              GADGET_COMP },
+            { GADGET_EP(USB_DIR_OUT | 3, USB_ENDPOINT_XFER_BULK, 1024, 0),
+              GADGET_COMP },
+        },
+    },
+};
+
+#define GADGET_STR "wixusb reference gadget"
+
+static const struct {
+    struct usb_functionfs_strings_head header;
+    struct {
+        __le16 code;
+        const char str1[sizeof (GADGET_STR)];
+    } __attribute__ ((packed)) lang0;
+} __attribute__ ((packed)) strings = {
+    .header = {
+        .magic = cpu_to_le32(FUNCTIONFS_STRINGS_MAGIC),
+        .length = cpu_to_le32(sizeof (strings)),
+        .str_count = cpu_to_le32(1),
+        .lang_count = cpu_to_le32(1),
+    },
+    .lang0 = {
+        cpu_to_le16(0x0409), /* en-us */
+        GADGET_STR,
+    },
+};
+
+static int mode = MODE_LOOPBACK;
+static unsigned int delay_us;
+static size_t xfer_size = 4096;
+static int verbose;
+
+static int ep_fd[EP_COUNT];
+
+/* Set between FUNCTIONFS_ENABLE and DISABLE, the endpoint threads wait for it */
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER;
+static int enabled;
+
+static uint8_t ctrl_buf[GADGET_CTRL_MAX];
+static size_t ctrl_len;
+
+static void wait_enabled(void) {
+    pthread_mutex_lock(&state_lock);
+    while (!enabled)
+        pthread_cond_wait(&state_cond, &state_lock);
+    pthread_mutex_unlock(&state_lock);
+}
+
+static void set_enabled(int on) {
+    pthread_mutex_lock(&state_lock);
+    enabled = on;
+    pthread_cond_broadcast(&state_cond);
+    pthread_mutex_unlock(&state_lock);
+}
+
+static void respond_delay(void) {
+    struct timespec ts;
+
+    if (!delay_us)
+        return;
+    ts.tv_sec = delay_us / 1000000;
+    ts.tv_nsec = (delay_us % 1000000) * 1000L;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/* An I/O error while the function is down means: wait for the next enable */
+static int ep_failed(const char *what) {
+    /* a host side abort or the function going down */
+    if (errno == ESHUTDOWN || errno == ECONNRESET || errno == EINTR) {
+        /* ep0 may not have read the DISABLE event yet */
+        usleep(1000);
+        wait_enabled();
+        return 0;
+    }
+    fprintf(stderr, "wixusb_gadget: %s: %s\n", what, strerror(errno));
+    return -1;
+}
+
+static void *int_out_thread(void *arg) {
+    uint8_t buf[GADGET_INT_SIZE];
+    unsigned long packets = 0;
+    ssize_t n;
+
+    (void) arg;
+    for (;;) {
+        wait_enabled();
+        n = read(ep_fd[EP_INT_OUT], buf, sizeof (buf));
+        if (n < 0) {
+            if (ep_failed("interrupt OUT"))
+                break;
+            continue;
+        }
+        packets++;
+        if (verbose)
+            fprintf(stderr, "int out: %zd bytes (%lu)\n", n, packets);
+    }
+    return NULL;
+}
+
+/* wMaxPacketSize at the speed the function was enabled with, 0 if unknown */
+static size_t ep_max_packet(int fd) {
+    struct usb_endpoint_descriptor desc;
+
+    if (ioctl(fd, FUNCTIONFS_ENDPOINT_DESC, &desc) < 0)
+        return 0;
+    return le16toh(desc.wMaxPacketSize) & 0x7ff;
+}
+
+static void *bulk_out_thread(void *arg) {
+    uint8_t *buf = arg;
+    size_t mps;
+    ssize_t n, w;
+
+    for (;;) {
+        wait_enabled();
+        n = read(ep_fd[EP_BULK_OUT], buf, xfer_size);
+        if (n < 0) {
+            if (ep_failed("bulk OUT"))
+                break;
+            continue;
+        }
+        if (verbose)
+            fprintf(stderr, "bulk out: %zd bytes\n", n);
+        if (mode != MODE_LOOPBACK)
+            continue;
+
+        respond_delay();
+        w = write(ep_fd[EP_BULK_IN], buf, n);
+        /* the host read ends on a short packet, a full last one needs a ZLP */
+        mps = ep_max_packet(ep_fd[EP_BULK_IN]);
+        if (w > 0 && mps && w % mps == 0)
+            w = write(ep_fd[EP_BULK_IN], buf, 0);
+        if (w < 0 && ep_failed("bulk IN"))
+            break;
+    }
+    return NULL;
+}
+
+static void *source_thread(void *arg) {
+    uint8_t *buf = arg;
+    uint32_t seq = 0;
+    size_t i;
+    ssize_t w;
+
+    for (;;) {
+        wait_enabled();
+        for (i = 0; i + sizeof (seq) <= xfer_size; i += sizeof (seq), seq++)
+            memcpy(buf + i, &seq, sizeof (seq));
+        respond_delay();
+        w = write(ep_fd[EP_BULK_IN], buf, xfer_size);
+        if (w < 0 && ep_failed("bulk IN"))
+            break;
+    }
+    return NULL;
+}
+
+/* Vendor requests echo, anything else is stalled */
+static void handle_setup(int ep0, const struct usb_ctrlrequest *setup) {
+    uint16_t len = le16toh(setup->wLength);
+    int in = setup->bRequestType & USB_DIR_IN;
+    ssize_t n;
+
+    if (verbose)
+        fprintf(stderr, "setup: %02x %02x %04x %04x %u\n",
+                setup->bRequestType, setup->bRequest,
+                le16toh(setup->wValue), le16toh(setup->wIndex), len);
+
+    if ((setup->bRequestType & USB_TYPE_MASK) != USB_TYPE_VENDOR ||
+            (!in && len > sizeof (ctrl_buf))) {
+        /* I/O in the wrong direction stalls the request */
+        if (in)
+            n = read(ep0, NULL, 0);
+        else
+            n = write(ep0, NULL, 0);
+        (void) n;
+        return;
+    }
+
+    respond_delay();
+    if (in) {
+        n = write(ep0, ctrl_buf, len < ctrl_len ? len : ctrl_len);
+    } else {
+        n = read(ep0, ctrl_buf, len);
+        if (n >= 0)
+            ctrl_len = n;
+    }
+    if (n < 0)
+        fprintf(stderr, "wixusb_gadget: ep0: %s\n", strerror(errno));
+}
+
+static int ep0_loop(int ep0) {
+    struct usb_functionfs_event events[4];
+    ssize_t n;
+    int i;
+
+    for (;;) {
+        n = read(ep0, events, sizeof (events));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("wixusb_gadget: ep0");
+            return -1;
+        }
+
+        for (i = 0; i < n / (ssize_t) sizeof (events[0]); i++) {
+            switch (events[i].type) {
+                case FUNCTIONFS_ENABLE:
+                    set_enabled(1);
+                    break;
+                case FUNCTIONFS_DISABLE:
+                case FUNCTIONFS_SUSPEND:
+                case FUNCTIONFS_UNBIND:
+                    set_enabled(0);
+                    break;
+                case FUNCTIONFS_RESUME:
+                    set_enabled(1);
+                    break;
+                case FUNCTIONFS_SETUP:
+                    handle_setup(ep0, &events[i].u.setup);
+                    break;
+                default:
+                    break;
+            }
+            if (verbose)
+                fprintf(stderr, "event %d\n", events[i].type);
+        }
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: wixusb_gadget [-m loopback|source-sink|ctrl-echo] "
+            "[-d delay_us] [-s size] [-v] ffs_dir\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    char path[4096];
+    pthread_t threads[3];
+    int nthreads = 0;
+    int ep0, i, opt;
+
+    while ((opt = getopt(argc, argv, "m:d:s:v")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (!strcmp(optarg, "loopback"))
+                    mode = MODE_LOOPBACK;
+                else if (!strcmp(optarg, "source-sink"))
+                    mode = MODE_SOURCE_SINK;
+                else if (!strcmp(optarg, "ctrl-echo"))
+                    mode = MODE_CTRL_ECHO;
+                else
+                    usage();
+                break;
+            case 'd':
+                delay_us = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                xfer_size = strtoul(optarg, NULL, 0);
+                if (!xfer_size || xfer_size > GADGET_MAX_SIZE)
+                    usage();
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc - 1)
+        usage();
+
+    /* a host going away must not kill the daemon */
+    signal(SIGPIPE, SIG_IGN);
+
+    snprintf(path, sizeof (path), "%s/ep0", argv[optind]);
+    ep0 = open(path, O_RDWR);
+    if (ep0 < 0) {
+        perror(path);
+        return 1;
+    }
+    if (write(ep0, &descriptors, sizeof (descriptors)) < 0 ||
+            write(ep0, &strings, sizeof (strings)) < 0) {
+        perror("wixusb_gadget: descriptors");
+        return 1;
+    }
+
+    /* the ep files exist once the descriptors are written */
+    for (i = 1; i < EP_COUNT; i++) {
+        snprintf(path, sizeof (path), "%s/ep%d", argv[optind], i);
+        ep_fd[i] = open(path, O_RDWR);
+        if (ep_fd[i] < 0) {
+            perror(path);
+            return 1;
+        }
+    }
+
+    if (pthread_create(&threads[nthreads++], NULL, int_out_thread, NULL))
+        return 1;
+    if (mode != MODE_CTRL_ECHO) {
+        uint8_t *out = malloc(xfer_size);
+
+        if (!out || pthread_create(&threads[nthreads++], NULL,
+                bulk_out_thread, out))
+            return 1;
+    }
+    if (mode == MODE_SOURCE_SINK) {
+        uint8_t *in = malloc(xfer_size);
+
+        if (!in || pthread_create(&threads[nthreads++], NULL,
+                source_thread, in))
+            return 1;
+    }
+
+    fprintf(stderr, "wixusb_gadget: ready, waiting for the UDC\n");
+    return ep0_loop(ep0) ? 1 : 0;
+}
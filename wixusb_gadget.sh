@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# Sets up the wixusb reference gadget on dummy_hcd through configfs and
+# starts wixusb_gadget on it, see wixusb_gadget.c. Run as root.
+#
+#   wixusb_gadget.sh start [wixusb_gadget options]
+#   wixusb_gadget.sh stop
+#
+# WIXUSB_UDC selects another UDC, WIXUSB_GADGET the daemon binary.
+
+set -e
+
+NAME=wixusb
+CONFIGFS=/sys/kernel/config/usb_gadget/$NAME
+FFS=/dev/ffs-$NAME
+UDC=${WIXUSB_UDC:-dummy_udc.0}
+GADGET=${WIXUSB_GADGET:-./wixusb_gadget}
+PIDFILE=/run/wixusb_gadget.pid
+
+start() {
+    modprobe libcomposite
+    modprobe dummy_hcd
+    mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+    mkdir -p $CONFIGFS
+    cd $CONFIGFS
+    echo 0x1209 > idVendor
+    echo 0x0001 > idProduct
+    echo 0x0100 > bcdDevice
+    mkdir -p strings/0x409
+    echo wixusb > strings/0x409/manufacturer
+    echo "wixusb reference gadget" > strings/0x409/product
+    echo 0001 > strings/0x409/serialnumber
+
+    mkdir -p configs/c.1/strings/0x409
+    echo wixusb > configs/c.1/strings/0x409/configuration
+    echo 100 > configs/c.1/MaxPower
+    mkdir -p functions/ffs.$NAME
+    [ -e configs/c.1/ffs.$NAME ] || ln -s functions/ffs.$NAME configs/c.1/
+    cd - > /dev/null
+
+    mkdir -p $FFS
+    mountpoint -q $FFS || mount -t functionfs $NAME $FFS
+
+    "$GADGET" "$@" $FFS &
+    echo $! > $PIDFILE
+
+    # the UDC can be bound once the daemon has written its descriptors
+    for i in $(seq 50); do
+        [ -e $FFS/ep1 ] && break
+        sleep 0.1
+    done
+    echo $UDC > $CONFIGFS/UDC
+}
+
+stop() {
+    [ -e $CONFIGFS/UDC ] && echo "" > $CONFIGFS/UDC || true
+    if [ -e $PIDFILE ]; then
+        kill "$(cat $PIDFILE)" 2> /dev/null || true
+        rm -f $PIDFILE
+    fi
+    mountpoint -q $FFS && umount $FFS
+    rmdir $FFS 2> /dev/null || true
+
+    [ -d $CONFIGFS ] || return 0
+    rm -f $CONFIGFS/configs/c.1/ffs.$NAME
+    rmdir $CONFIGFS/configs/c.1/strings/0x409 $CONFIGFS/configs/c.1
+    rmdir $CONFIGFS/functions/ffs.$NAME
+    rmdir $CONFIGFS/strings/0x409 $CONFIGFS
+}
+
+case "$1" in
+    start)
+        shift
+        start "$@"
+        ;;
+    stop)
+        stop
+        ;;
+    *)
+        echo "usage: $0 start [wixusb_gadget options] | stop" >&2
+        exit 2
+        ;;
+esac
@@ -45,6 +45,35 @@ typedef struct {
 #define IOCTL_GET_VID_PID          _IOR( WIXUSB_IOC_MAGIC, 5, wixusb_vid_pid_t )
 #define IOCTL_IS_CONNECTED         _IO( WIXUSB_IOC_MAGIC, 6)
 #define IOCTL_WRITE_INT            _IOW( WIXUSB_IOC_MAGIC, 7, wixusb_intrpt_packet )
+/* pipe commands, the argument is the pipe ID (endpoint address) */
+#define IOCTL_ABORT_PIPE           _IO( WIXUSB_IOC_MAGIC, 8)
+#define IOCTL_RESET_PIPE           _IO( WIXUSB_IOC_MAGIC, 9)
+#define IOCTL_FLUSH_PIPE           _IO( WIXUSB_IOC_MAGIC, 10)
+#define IOCTL_CTRL_XFER            _IOWR( WIXUSB_IOC_MAGIC, 11, wixusb_ctrl_xfer_t )
+#define IOCTL_SET_POWER_POL        _IOW( WIXUSB_IOC_MAGIC, 12, wixusb_power_policy_t )
+#define IOCTL_GET_POWER_POL        _IOWR( WIXUSB_IOC_MAGIC, 13, wixusb_power_policy_t )
+#define IOCTL_PREWARM              _IO( WIXUSB_IOC_MAGIC, 14)
+#define IOCTL_GET_STATS            _IOR( WIXUSB_IOC_MAGIC, 15, wixusb_stats_t )
+#define IOCTL_SET_BCAST            _IOW( WIXUSB_IOC_MAGIC, 16, wixusb_bcast_mode_t )
+/* the argument is 1 for reads framed by wixusb_frame_hdr_t, 0 for raw data */
+#define IOCTL_SET_FRAMED           _IO( WIXUSB_IOC_MAGIC, 17 )
+#define IOCTL_GET_STATUS           _IOR( WIXUSB_IOC_MAGIC, 18, wixusb_status_t )
+#define IOCTL_GET_IFACE_INFO       _IOR( WIXUSB_IOC_MAGIC, 19, wixusb_iface_info_t )
+/* the argument is the bAlternateSetting to switch to */
+#define IOCTL_SET_ALT              _IO( WIXUSB_IOC_MAGIC, 20 )
+#define IOCTL_GET_ALT              _IOR( WIXUSB_IOC_MAGIC, 21, uint8_t )
+/* the argument is the number of bulk streams wanted, 0 frees them */
+#define IOCTL_ALLOC_STREAMS        _IO( WIXUSB_IOC_MAGIC, 22 )
+#define IOCTL_STREAM_XFER          _IOWR( WIXUSB_IOC_MAGIC, 23, wixusb_stream_xfer_t )
+#define IOCTL_GET_ASSOC_IFACE      _IOWR( WIXUSB_IOC_MAGIC, 24, wixusb_assoc_iface_t )
+/* the argument is the WIXUSB_PRIORITY of this handle's transfers */
+#define IOCTL_SET_PRIORITY         _IO( WIXUSB_IOC_MAGIC, 25 )
+#define IOCTL_SET_PRIO_LIMIT       _IOW( WIXUSB_IOC_MAGIC, 26, wixusb_prio_limit_t )
+#define IOCTL_GET_PRIO_STATS       _IOR( WIXUSB_IOC_MAGIC, 27, wixusb_prio_stats_t )
+/* returns the bytes copied, the blob is cached by the USB core */
+#define IOCTL_GET_CONFIG_DESC      _IOWR( WIXUSB_IOC_MAGIC, 28, wixusb_config_desc_t )
+/* policy_type and pipe_id in, policy_value out */
+#define IOCTL_GET_PIPE_POL         _IOWR( WIXUSB_IOC_MAGIC, 29, wixusb_set_pipe_policy_t )
 
 
 #ifdef __cplusplus
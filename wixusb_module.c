@@ -35,9 +35,33 @@
 #include <linux/io.h>
 #include <linux/ioctl.h>
 #include <linux/delay.h>
+#include <linux/pm_runtime.h>
+#include <linux/poll.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/timekeeping.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/llist.h>
+#include <linux/moduleparam.h>
+#include <linux/cpumask.h>
 #include "wixusb_driver_types.h"
 #include "wixusb_ioctl.h"
 
+/*
+ * uring_cmd appeared in 5.19, the SQE replaced its cmd pointer in 6.5 and
+ * its declarations moved to their own header in 6.7, with cancellation.
+ */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0))
+#define WIXUSB_URING_CMD
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0))
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+#endif
+
 #ifndef DEBUG
 #define DEBUG
 #endif
@@ -55,6 +79,7 @@
 #define USB_SKEL_MINOR_BASE             0
 
 #define WIXUSB_BUFFSIZE              4096
+#define WIXUSB_SPLICE_BUFFSIZE       (64 * 1024) /* a default pipe, 16 pages */
 
 #define EP_INT_NUM                 (0x01)
 #define EP_INT_IN_ADDR             ((unsigned int)((USB_DIR_IN) | (EP_INT_NUM)))
@@ -73,6 +98,15 @@
 
 #define to_wixusb_dev(d)                  container_of(d, struct usb_wixusb, kref)
 
+/* 0..31 slot of an endpoint address, IN endpoints in the upper half */
+#define WIXUSB_EP_INDEX(addr)      (((addr) & USB_ENDPOINT_NUMBER_MASK) | (((addr) & USB_DIR_IN) >> 3))
+#define WIXUSB_EP_SLOTS            32
+
+#define WIXUSB_BCAST_SLOTS         64
+#define WIXUSB_BCAST_URBS          4
+
+#define WIXUSB_SHAPE_SLACK_NS      (50 * NSEC_PER_USEC)
+
 #ifdef DEBUG
 #define wixusb_log(fmt, ...)             printk(KERN_DEBUG WIXUSB_PREFIX pr_fmt(fmt), ##__VA_ARGS__)
 #else
@@ -85,257 +119,2685 @@
 
 static struct usb_device_id wixusb_table[];
 
+enum {
+    WIXUSB_PIPE_INT_OUT,
+    WIXUSB_PIPE_BULK_IN,
+    WIXUSB_PIPE_BULK_OUT,
+    WIXUSB_PIPE_COUNT
+};
+
+struct wixusb_pipe {
+    __u8 addr; /* endpoint address, used as WinUSB PipeID */
+    unsigned int pipe;
+};
+
+struct wixusb_bcast_urb {
+    struct usb_wixusb *dev;
+    struct urb *urb;
+    u64 seq; /* slot the URB receives into */
+    bool busy; /* until its completion work has run */
+    struct llist_node done_node; /* in bcast->done */
+    int status; /* of the completion, for the work */
+    unsigned int actual;
+    ktime_t mono;
+    ktime_t boot;
+};
+
+struct wixusb_bcast_slot {
+    u8 *data;
+    unsigned int len;
+    int status;
+    ktime_t mono; /* completion time */
+    ktime_t boot;
+};
+
+/* Shared bulk IN stream, see wixusb_bcast_fill() */
+struct wixusb_bcast {
+    spinlock_t lock; /* protects everything but the slot data */
+    u64 head; /* next slot to complete */
+    u64 tail; /* next slot to submit into */
+    bool halted; /* a transfer failed, wait for a reader to see it */
+    bool suspended;
+    bool switching; /* alternate setting change in progress */
+    struct list_head readers; /* struct wixusb_file in broadcast mode */
+    struct usb_anchor submitted;
+    struct llist_head done; /* completed URBs, see wixusb_bcast_work() */
+    struct work_struct done_work;
+    struct wixusb_bcast_urb urbs[WIXUSB_BCAST_URBS];
+    struct wixusb_bcast_slot slots[WIXUSB_BCAST_SLOTS];
+};
+
+/*
+ * Admission of transfers by priority class, see wixusb_sched_enter().
+ * Transfers leave io_mutex while on the bus, so a command is not held up
+ * by a bulk transfer in progress, and the class limits keep a bulk flood
+ * from crowding out the others. Reads wait on the device for as long as
+ * it has nothing to send, so IN and OUT each get the class limit: blocked
+ * readers never keep the writes they wait for from being admitted.
+ */
+#define WIXUSB_SCHED_OUT    0
+#define WIXUSB_SCHED_IN     1
+
+struct wixusb_sched {
+    spinlock_t lock;
+    wait_queue_head_t wait; /* admission and the drain on disconnect */
+    unsigned int limit[WIXUSB_PRIO_COUNT];
+    unsigned int in_flight[2][WIXUSB_PRIO_COUNT]; /* admitted, by direction */
+    unsigned int waiting[2][WIXUSB_PRIO_COUNT];
+    u64 transfers[WIXUSB_PRIO_COUNT];
+    u64 latency[WIXUSB_PRIO_COUNT][WIXUSB_LAT_BUCKETS];
+};
+
 struct usb_wixusb {
     struct usb_device *usbdev; /* the usb device for this device */
     struct usb_interface *interface; /* the interface for this device */
     struct mutex io_mutex; /* synchronize I/O with disconnect */
+    struct mutex write_mutex; /* keeps a write and its ZLP together */
     struct kref kref;
-    unsigned int timeout;
     atomic_t open_counter;
+    atomic_t in_flight; /* transfers on the bus, see wixusb_bus_begin() */
+    struct wixusb_sched sched;
     __u16 idProduct;
+    __u8 alt; /* current bAlternateSetting */
+    struct wixusb_pipe pipes[WIXUSB_PIPE_COUNT]; /* of the current setting */
+    unsigned int num_streams; /* bulk stream IDs 1..num_streams, 0 when off */
+    unsigned int stream_xfers; /* of wixusb_stream_xfer() on the bus */
+    struct mutex files_lock; /* protects files */
+    struct list_head files; /* open handles, struct wixusb_file */
+    struct wixusb_bcast *bcast; /* allocated on first use, kept until delete */
+    wixusb_iface_info_t *info; /* constant after probe */
+    struct workqueue_struct *wq; /* completion work, see completion_cpu */
+    spinlock_t park_lock; /* protects parking and parked */
+    bool parking; /* system sleep, killed transfers are parked */
+    struct list_head parked; /* struct wixusb_park, resubmitted on resume */
+    wait_queue_head_t wait; /* broadcast readers and pollers */
+    struct list_head node; /* in wixusb_devices */
 };
 
-static struct usb_driver wixusb_driver;
-
-static int
-wixusb_open(struct inode *inode, struct file *file) {
-    struct usb_wixusb *dev;
-    struct usb_interface *interface;
-    int subminor;
-    int retval = 0;
+struct wixusb_pipe_policy {
+    unsigned int timeout;
+    bool auto_clear_stall;
+    bool short_packet_terminate; /* bulk OUT writes end with a short packet */
+    u32 rate; /* bytes per second, 0 when not shaped */
+    u32 burst;
+    u64 tat; /* see wixusb_shape() */
+};
 
-    subminor = iminor(inode);
+/*
+ * wixusb_stats_t of a handle, counted from its threads, completions and
+ * the broadcast stream at once
+ */
+struct wixusb_file_stats {
+    atomic64_t transfers;
+    atomic64_t bytes_in;
+    atomic64_t bytes_out;
+    atomic64_t errors;
+    atomic64_t timeouts;
+    atomic64_t dropped;
+    atomic64_t throttled;
+    atomic64_t throttled_bytes;
+    atomic64_t throttle_ns;
+};
 
-    interface = usb_find_interface(&wixusb_driver, subminor);
-    if (!interface)
-    {
-        pr_err("%s - error, can't find device for minor %d\n",
-            __func__, subminor);
-        retval = -ENODEV;
-        goto exit;
-    }
+/* State of one open handle, the device underneath is shared */
+struct wixusb_file {
+    struct usb_wixusb *dev;
+    struct list_head node; /* in dev->files */
+    struct usb_anchor submitted[WIXUSB_PIPE_COUNT]; /* in-flight URBs, killed by abort */
+    struct usb_anchor ctrl_submitted; /* io_uring control transfers */
+    struct wixusb_pipe_policy policy[WIXUSB_EP_SLOTS]; /* by WIXUSB_EP_INDEX() */
+    spinlock_t shape_lock; /* shaping state of the policies */
+    struct wixusb_file_stats stats;
+    struct mutex bcast_mutex; /* broadcast state of this handle */
+    bool bcast;
+    int bcast_policy;
+    u64 bcast_seq; /* next slot to read */
+    unsigned int bcast_off; /* bytes already read from that slot */
+    struct list_head bcast_node; /* in bcast->readers */
+    bool framed; /* reads return wixusb_frame_hdr_t records */
+    int prio; /* WIXUSB_PRIORITY of the transfers */
+    struct mutex nb_mutex; /* the non-blocking transfers */
+    struct wixusb_nb_xfer *nb_in; /* see wixusb_nb_start() */
+    struct wixusb_nb_xfer *nb_out;
+    unsigned long nb_busy; /* BIT(WIXUSB_PIPE_*) while on the bus */
+    bool pm_hold; /* AUTO_SUSPEND off, holds an autopm reference */
+};
 
-    dev = usb_get_intfdata(interface);
-    if (!dev)
-    {
-        wixusb_log("Error: wixusb_open : usb_get_intfdata");
-        retval = -ENODEV;
-        goto exit;
-    }
+static struct usb_driver wixusb_driver;
 
-    /* increment our usage count for the device */
-    kref_get(&dev->kref);
+/* Default admission limits by WIXUSB_PRIORITY, see IOCTL_SET_PRIO_LIMIT */
+static const unsigned int wixusb_prio_limits[WIXUSB_PRIO_COUNT] = {
+    [WIXUSB_PRIO_CRITICAL] = 16,
+    [WIXUSB_PRIO_NORMAL] = 8,
+    [WIXUSB_PRIO_BULK] = 8,
+};
 
-    dev->timeout = 0;
+/*
+ * Every interface the driver binds is a device of its own, with its own
+ * node, pipes and locks. The list finds the siblings of a composite device.
+ */
+static LIST_HEAD(wixusb_devices);
+static DEFINE_MUTEX(wixusb_devices_lock);
+
+static int completion_cpu = -1;
+module_param(completion_cpu, int, 0644);
+MODULE_PARM_DESC(completion_cpu,
+    "CPU for the broadcast completion work, -1 for the CPU of the interrupt");
+
+/* Endpoint of each role, the historical fixed address wins if present */
+static const struct {
+    int type;
+    __u8 addr;
+} wixusb_roles[WIXUSB_PIPE_COUNT] = {
+    [WIXUSB_PIPE_INT_OUT] = {USB_ENDPOINT_XFER_INT, EP_INT_OUT_ADDR},
+    [WIXUSB_PIPE_BULK_IN] = {USB_ENDPOINT_XFER_BULK, EP_BULK_IN_ADDR},
+    [WIXUSB_PIPE_BULK_OUT] = {USB_ENDPOINT_XFER_BULK, EP_BULK_OUT_ADDR},
+};
 
-    /* save our object in the file's private structure */
-    file->private_data = dev;
+/* A role the setting has no endpoint for gets address 0 and fails with -ENODEV */
+static void
+wixusb_find_pipes(struct usb_wixusb *dev, struct usb_host_interface *setting) {
+    struct usb_endpoint_descriptor *desc, *found;
+    int i, j;
 
-exit:
-    wixusb_log("wixusb_open : (%d)", retval);
-    return retval;
+    for (i = 0; i < WIXUSB_PIPE_COUNT; i++)
+    {
+        found = NULL;
+        for (j = 0; j < setting->desc.bNumEndpoints; j++)
+        {
+            desc = &setting->endpoint[j].desc;
+            if (usb_endpoint_type(desc) != wixusb_roles[i].type ||
+                (desc->bEndpointAddress & USB_DIR_IN) !=
+                (wixusb_roles[i].addr & USB_DIR_IN))
+                continue;
+            if (!found || desc->bEndpointAddress == wixusb_roles[i].addr)
+                found = desc;
+        }
 
+        dev->pipes[i].addr = found ? found->bEndpointAddress : 0;
+        dev->pipes[i].pipe = 0;
+        if (!found)
+            continue;
+        if (usb_endpoint_xfer_int(found))
+            dev->pipes[i].pipe = usb_endpoint_dir_in(found) ?
+                usb_rcvintpipe(dev->usbdev, found->bEndpointAddress) :
+                usb_sndintpipe(dev->usbdev, found->bEndpointAddress);
+        else
+            dev->pipes[i].pipe = usb_endpoint_dir_in(found) ?
+                usb_rcvbulkpipe(dev->usbdev, found->bEndpointAddress) :
+                usb_sndbulkpipe(dev->usbdev, found->bEndpointAddress);
+    }
 }
 
-static ssize_t
-wixusb_read(struct file *file, char *buffer, size_t count,
-    loff_t *ppos) {
-    struct usb_wixusb *dev;
-    int retval = 0;
-    int actual_length = count;
-    char *buf = NULL;
+static int
+wixusb_pipe_by_id(struct usb_wixusb *dev, unsigned long pipe_id) {
+    int i;
 
-    /* verify that we actually have some data to read */
-    if (count == 0)
-        goto exit;
+    for (i = 0; i < WIXUSB_PIPE_COUNT; i++)
+    {
+        if (dev->pipes[i].addr && dev->pipes[i].addr == pipe_id)
+            return i;
+    }
+    return -1;
+}
 
-    dev = file->private_data;
+static inline struct wixusb_pipe_policy *
+wixusb_policy(struct wixusb_file *wf, __u8 addr) {
+    return &wf->policy[WIXUSB_EP_INDEX(addr)];
+}
 
-    /* no concurrent readers */
-    retval = mutex_lock_interruptible(&dev->io_mutex);
-    if (retval < 0)
-        return retval;
+/*
+ * Token bucket of a handle's pipe, kept as a theoretical arrival time: each
+ * transfer moves it on by its length at the rate, and a transfer that would
+ * put it more than a burst ahead of now sleeps until it no longer does.
+ * Called before the transfer is admitted, with no lock held.
+ */
+static int
+wixusb_shape(struct wixusb_file *wf, __u8 addr, size_t len) {
+    struct wixusb_pipe_policy *policy = wixusb_policy(wf, addr);
+    u64 now, tat, tau, cost, wait = 0;
+    ktime_t expire;
 
-    if (!dev->interface)
+    spin_lock(&wf->shape_lock);
+    if (!policy->rate)
     {
-        retval = -ENODEV;
-        goto error;
+        spin_unlock(&wf->shape_lock);
+        return 0;
     }
-
-    buf = kmalloc(count, GFP_KERNEL);
-    if (!buf)
+    now = ktime_get_ns();
+    tau = div_u64((u64) policy->burst * NSEC_PER_SEC, policy->rate);
+    cost = div_u64((u64) len * NSEC_PER_SEC, policy->rate);
+    tat = max(policy->tat, now);
+    if (tat > now + tau)
+        wait = tat - now - tau;
+    policy->tat = tat + cost;
+    if (wait)
     {
-        retval = -ENOMEM;
-        goto error;
+        atomic64_inc(&wf->stats.throttled);
+        atomic64_add(len, &wf->stats.throttled_bytes);
+        atomic64_add(wait, &wf->stats.throttle_ns);
     }
+    spin_unlock(&wf->shape_lock);
 
-    retval = usb_bulk_msg(dev->usbdev,
-        PIPE_BULK_IN(dev->usbdev), buf, count,
-        &actual_length, dev->timeout);
+    if (!wait)
+        return 0;
 
-    if (retval)
+    expire = ns_to_ktime(wait);
+    set_current_state(TASK_INTERRUPTIBLE);
+    if (schedule_hrtimeout_range(&expire, WIXUSB_SHAPE_SLACK_NS,
+        HRTIMER_MODE_REL))
     {
-        goto error_free;
+        /* interrupted, the transfer does not happen */
+        spin_lock(&wf->shape_lock);
+        policy->tat -= min(policy->tat, cost);
+        spin_unlock(&wf->shape_lock);
+        return -ERESTARTSYS;
     }
+    return 0;
+}
+
+/*
+ * Gives back the part of a charge the transfer did not move, a read is
+ * charged its full size before it knows how much the device sends.
+ */
+static void
+wixusb_shape_refund(struct wixusb_file *wf, __u8 addr, size_t charged,
+    size_t moved) {
+    struct wixusb_pipe_policy *policy = wixusb_policy(wf, addr);
+    u64 cost;
+
+    if (moved >= charged)
+        return;
 
-    if (copy_to_user(buffer, buf, actual_length))
+    spin_lock(&wf->shape_lock);
+    if (policy->rate)
     {
-        retval = -EFAULT;
-        goto error_free;
+        cost = div_u64((u64) (charged - moved) * NSEC_PER_SEC, policy->rate);
+        policy->tat -= min(policy->tat, cost);
     }
+    spin_unlock(&wf->shape_lock);
+}
 
-    mutex_unlock(&dev->io_mutex);
-    kfree(buf);
+/*
+ * A transfer killed by a system sleep before it moved any data is parked
+ * instead of completed, and submitted again on resume.
+ */
+struct wixusb_park {
+    struct list_head node; /* in dev->parked */
+    struct usb_wixusb *dev;
+    struct urb *urb;
+    struct usb_anchor *home; /* anchored there again, NULL when not parked */
+};
 
-exit:
-    wixusb_log("wixusb_read : success (%d), received %d bytes", retval, actual_length);
-    return actual_length;
+struct wixusb_xfer_done {
+    struct completion done;
+    ktime_t mono;
+    ktime_t boot;
+    struct wixusb_park park;
+};
 
-error_free:
-    kfree(buf);
-error:
-    mutex_unlock(&dev->io_mutex);
-    wixusb_log("wixusb_read : fail (%d)", retval);
-    return retval;
+static void
+wixusb_park_init(struct wixusb_park *park, struct usb_wixusb *dev,
+    struct urb *urb, struct usb_anchor *home) {
+    INIT_LIST_HEAD(&park->node);
+    park->dev = dev;
+    park->urb = urb;
+    park->home = home;
 }
 
-static ssize_t
-wixusb_write(struct file *file, const char *user_buffer,
-    size_t count, loff_t *ppos) {
-    int retval = 0;
-    struct usb_wixusb *dev;
-    char *buf = NULL;
-    int actual_length;
-    ssize_t writed_size = 0;
-
-    /* verify that we actually have some data to write */
-    if (count == 0)
-        goto exit;
+/* From the completion handler, true when the URB was parked */
+static bool
+wixusb_park(struct wixusb_park *park) {
+    struct usb_wixusb *dev = park->dev;
+    struct urb *urb = park->urb;
+    unsigned long flags;
+    bool parked = false;
 
-    dev = file->private_data;
+    if (urb->status != -ENOENT || urb->actual_length || !park->home)
+        return false;
 
-    /* this lock makes sure we don't submit URBs to gone devices */
-    mutex_lock(&dev->io_mutex);
-    if (!dev->interface) /* disconnect() was called */
+    spin_lock_irqsave(&dev->park_lock, flags);
+    if (dev->parking)
     {
-        retval = -ENODEV;
-        goto error;
+        list_add_tail(&park->node, &dev->parked);
+        parked = true;
     }
+    spin_unlock_irqrestore(&dev->park_lock, flags);
+    return parked;
+}
 
-    if (count > WIXUSB_BUFFSIZE)
+/*
+ * Takes a parked URB back, true when it was. The owner calls it before and
+ * after usb_kill_urb(): once to keep resume from submitting it again, once
+ * for a kill that parked it meanwhile.
+ */
+static bool
+wixusb_unpark(struct wixusb_park *park) {
+    struct usb_wixusb *dev = park->dev;
+    unsigned long flags;
+    bool parked = false;
+
+    spin_lock_irqsave(&dev->park_lock, flags);
+    if (!list_empty(&park->node))
     {
-        retval = -ENOMEM;
-        goto error;
+        list_del_init(&park->node);
+        parked = true;
     }
+    spin_unlock_irqrestore(&dev->park_lock, flags);
+    return parked;
+}
 
-    buf = kmalloc(count, GFP_KERNEL);
-    if (!buf)
-    {
-        retval = -ENOMEM;
-        goto error;
-    }
+/* Completes a URB taken off the parked list, it is not parked again */
+static void
+wixusb_park_complete(struct wixusb_park *park, int status) {
+    park->home = NULL;
+    park->urb->status = status;
+    park->urb->complete(park->urb);
+}
 
-    if (copy_from_user(buf, user_buffer, count))
+/*
+ * Fails the transfers parked on home, all of them for NULL. With stop the
+ * device parks no more, see disconnect.
+ */
+static void
+wixusb_unpark_all(struct usb_wixusb *dev, struct usb_anchor *home,
+    int status, bool stop) {
+    struct wixusb_park *park, *tmp;
+    LIST_HEAD(failed);
+
+    spin_lock_irq(&dev->park_lock);
+    if (stop)
+        dev->parking = false;
+    list_for_each_entry_safe(park, tmp, &dev->parked, node)
     {
-        retval = -EFAULT;
-        goto error_free;
+        if (!home || park->home == home)
+            list_move_tail(&park->node, &failed);
     }
+    spin_unlock_irq(&dev->park_lock);
 
-    retval = usb_bulk_msg(dev->usbdev,
-        PIPE_BULK_OUT(dev->usbdev), buf, count,
-        &actual_length, dev->timeout);
-
-
-    if (retval)
+    list_for_each_entry_safe(park, tmp, &failed, node)
     {
-        goto error_free;
+        list_del_init(&park->node);
+        wixusb_park_complete(park, status);
     }
+}
 
-    writed_size = actual_length;
-
-    if (!(count % EP_SIZE))
+/*
+ * Resume: the parked URBs go back on the bus. They are submitted under
+ * park_lock, so their owner either takes them back first or finds them
+ * submitted and kills them.
+ */
+static void
+wixusb_resubmit_parked(struct usb_wixusb *dev) {
+    struct wixusb_park *park, *tmp;
+    LIST_HEAD(failed);
+    int retval;
+
+    spin_lock_irq(&dev->park_lock);
+    dev->parking = false;
+    list_for_each_entry_safe(park, tmp, &dev->parked, node)
     {
-        retval = usb_bulk_msg(dev->usbdev,
-            PIPE_BULK_OUT(dev->usbdev), buf, 0,
-            &actual_length, dev->timeout);
-
+        list_del_init(&park->node);
+        usb_anchor_urb(park->urb, park->home);
+        retval = usb_submit_urb(park->urb, GFP_ATOMIC);
         if (retval)
         {
-            goto error_free;
+            usb_unanchor_urb(park->urb);
+            park->urb->status = retval;
+            list_add_tail(&park->node, &failed);
         }
     }
+    spin_unlock_irq(&dev->park_lock);
 
-    mutex_unlock(&dev->io_mutex);
-    kfree(buf);
-    wixusb_log("wixusb_write : success (%zd)", writed_size);
-    return writed_size;
+    list_for_each_entry_safe(park, tmp, &failed, node)
+    {
+        list_del_init(&park->node);
+        wixusb_park_complete(park, park->urb->status);
+    }
+}
 
-error_free:
-    kfree(buf);
-error:
-    mutex_unlock(&dev->io_mutex);
-exit:
-    wixusb_log("wixusb_write : nothing to read (%d)", retval);
+static int
+wixusb_prio(struct wixusb_file *wf, int dflt) {
+    int prio = READ_ONCE(wf->prio);
+
+    return prio == WIXUSB_PRIO_AUTO ? dflt : prio;
+}
+
+/* Called with sched->lock held */
+static bool
+wixusb_sched_may_run(struct wixusb_sched *s, int dir, int prio) {
+    int c;
+
+    if (s->in_flight[dir][prio] >= s->limit[prio])
+        return false;
+    /* a waiter of a higher class that can go takes the turn first */
+    for (c = 0; c < prio; c++)
+    {
+        if (s->waiting[dir][c] && s->in_flight[dir][c] < s->limit[c])
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Admits a transfer of the class, before it takes io_mutex. Dir is
+ * WIXUSB_SCHED_IN for the transfers waiting on the device for data, the
+ * control transfers go with the writes. Start receives the time of the
+ * call, queueing counts towards the latency.
+ */
+static int
+wixusb_sched_enter(struct usb_wixusb *dev, int dir, int prio, ktime_t *start) {
+    struct wixusb_sched *s = &dev->sched;
+    int retval;
+
+    *start = ktime_get();
+    spin_lock_irq(&s->lock);
+    s->waiting[dir][prio]++;
+    retval = wait_event_interruptible_lock_irq(s->wait,
+        wixusb_sched_may_run(s, dir, prio), s->lock);
+    s->waiting[dir][prio]--;
+    if (!retval)
+        s->in_flight[dir][prio]++;
+    spin_unlock_irq(&s->lock);
+
+    /* lower classes may have held back for this waiter */
+    if (retval)
+        wake_up_all(&s->wait);
     return retval;
 }
 
 static void
-wixusb_delete(struct kref *kref) {
-    struct usb_wixusb *dev = to_wixusb_dev(kref);
-
-    usb_put_dev(dev->usbdev);
+wixusb_sched_exit(struct usb_wixusb *dev, int dir, int prio, ktime_t start) {
+    struct wixusb_sched *s = &dev->sched;
+    s64 us = ktime_us_delta(ktime_get(), start);
+    int bucket = us < 2 ? 0 : min_t(int, ilog2(us), WIXUSB_LAT_BUCKETS - 1);
+
+    spin_lock_irq(&s->lock);
+    s->in_flight[dir][prio]--;
+    s->transfers[prio]++;
+    s->latency[prio][bucket]++;
+    spin_unlock_irq(&s->lock);
+    wake_up_all(&s->wait);
+}
 
-    kfree(dev);
+/*
+ * Called with io_mutex held once the transfer is submitted, the lock is
+ * left for the wait on the bus. Whatever was checked under it may have
+ * changed when wixusb_bus_end() returns.
+ */
+static void
+wixusb_bus_begin(struct usb_wixusb *dev) {
+    atomic_inc(&dev->in_flight);
+    mutex_unlock(&dev->io_mutex);
 }
 
-static int
-wixusb_release(struct inode *inode, struct file *file) {
-    int retval = 0;
-    struct usb_wixusb *dev;
+static void
+wixusb_bus_end(struct usb_wixusb *dev) {
+    if (atomic_dec_and_test(&dev->in_flight))
+        wake_up_all(&dev->sched.wait);
+    mutex_lock(&dev->io_mutex);
+}
 
-    dev = file->private_data;
-    if (dev == NULL)
-        return -ENODEV;
+#define WIXUSB_PIPES_ALL    (BIT(WIXUSB_PIPE_COUNT) - 1)
 
-    kref_put(&dev->kref, wixusb_delete);
+/*
+ * Called with io_mutex held, so nothing new starts on the pipes. Kills the
+ * transfers of every handle on the pipes of the mask, stream transfers
+ * included, and returns once their completions have run. Waiting for
+ * them instead could take forever, a read may wait on the device with no
+ * timeout. Transfers on the other pipes carry on.
+ */
+static void
+wixusb_quiesce(struct usb_wixusb *dev, unsigned int pipes) {
+    struct wixusb_file *wf;
+    int i;
 
-    wixusb_log("wixusb_release : (%d)", retval);
-    return retval;
+    mutex_lock(&dev->files_lock);
+    list_for_each_entry(wf, &dev->files, node)
+    {
+        for (i = 0; i < WIXUSB_PIPE_COUNT; i++)
+            if (pipes & BIT(i))
+                usb_kill_anchored_urbs(&wf->submitted[i]);
+    }
+    mutex_unlock(&dev->files_lock);
 }
 
-static int
-wixusb_flush(struct file *file, fl_owner_t id) {
-    return 0;
+static void
+wixusb_xfer_complete(struct urb *urb) {
+    struct wixusb_xfer_done *xd = urb->context;
+
+    if (wixusb_park(&xd->park))
+        return;
+    xd->mono = ktime_get();
+    xd->boot = ktime_get_boottime();
+    complete(&xd->done);
 }
 
-long
-wixusb_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
-    long retval = 0;
-    struct usb_wixusb *dev;
-    char * buff = NULL;
+/*
+ * Synchronous transfer on a bulk or interrupt pipe. Unlike usb_bulk_msg()
+ * the URB is anchored on the handle's pipe, so an abort from another thread
+ * can kill it instead of waiting for the timeout to expire. Called with
+ * io_mutex held, which is left while the URB is on the bus.
+ */
+static int
+wixusb_xfer(struct wixusb_file *wf, int idx, void *data,
+    int len, unsigned int flags, int *actual_length, wixusb_frame_hdr_t *hdr) {
+    struct usb_wixusb *dev = wf->dev;
+    struct wixusb_pipe *pipe = &dev->pipes[idx];
+    struct wixusb_pipe_policy *policy = wixusb_policy(wf, pipe->addr);
+    struct urb *urb;
+    struct wixusb_xfer_done xd;
+    unsigned long expire;
+    bool in = usb_pipein(pipe->pipe);
+    int retval;
+
+    *actual_length = 0;
+
+    /* io_mutex may have been left for an earlier transfer of the caller */
+    if (!dev->interface)
+        return -ENODEV;
+    /* the current alternate setting has no such endpoint */
+    if (!pipe->addr)
+        return -ENODEV;
 
-    dev = file->private_data;
+    urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (!urb)
+        return -ENOMEM;
 
-    mutex_lock(&dev->io_mutex);
+    init_completion(&xd.done);
+    if (usb_pipeint(pipe->pipe))
+    {
+        struct usb_host_endpoint *ep = usb_pipe_endpoint(dev->usbdev, pipe->pipe);
 
-    if (!dev->interface)
+        if (!ep)
+        {
+            retval = -EINVAL;
+            goto exit;
+        }
+        usb_fill_int_urb(urb, dev->usbdev, pipe->pipe, data, len,
+            wixusb_xfer_complete, &xd, ep->desc.bInterval);
+    }
+    else
     {
-        retval = -ENODEV;
-        goto error_no_dev;
+        usb_fill_bulk_urb(urb, dev->usbdev, pipe->pipe, data, len,
+            wixusb_xfer_complete, &xd);
     }
+    urb->transfer_flags |= flags;
+    wixusb_park_init(&xd.park, dev, urb, &wf->submitted[idx]);
 
-    if ((_IOC_TYPE(cmd) != WIXUSB_IOC_MAGIC))
+    usb_anchor_urb(urb, &wf->submitted[idx]);
+    retval = usb_submit_urb(urb, GFP_KERNEL);
+    if (retval)
     {
-        wixusb_log("wixusb_ioctl : wrong MAGIC (%u)", _IOC_NR(cmd));
-        mutex_unlock(&dev->io_mutex);
-        return -ENOTTY;
+        usb_unanchor_urb(urb);
+        goto exit;
     }
-    wixusb_log("wixusb_ioctl : enter with %u", _IOC_NR(cmd));
-    switch (cmd)
+    wixusb_bus_begin(dev);
+
+    expire = policy->timeout ? msecs_to_jiffies(policy->timeout) : MAX_SCHEDULE_TIMEOUT;
+    if (!wait_for_completion_timeout(&xd.done, expire))
     {
-        case IOCTL_SEND_CTRL:
-        {
-            wixusb_ctrl_packet_t * ctrl_packet;
+        bool parked = wixusb_unpark(&xd.park);
+
+        usb_kill_urb(urb);
+        if (wixusb_unpark(&xd.park) || parked)
+            wixusb_park_complete(&xd.park, -ENOENT);
+        retval = (urb->status == -ENOENT ? -ETIMEDOUT : urb->status);
+    }
+    else
+    {
+        retval = urb->status;
+    }
+    *actual_length = urb->actual_length;
+
+    if (hdr)
+    {
+        /* a killed URB is stamped by its completion too */
+        hdr->mono_ns = ktime_to_ns(xd.mono);
+        hdr->boot_ns = ktime_to_ns(xd.boot);
+        hdr->length = urb->actual_length;
+        hdr->status = retval;
+        hdr->endpoint = pipe->addr;
+    }
+
+    if (retval == -EPIPE && policy->auto_clear_stall)
+        usb_clear_halt(dev->usbdev, pipe->pipe);
+    wixusb_bus_end(dev);
+
+exit:
+    usb_free_urb(urb);
+    atomic64_inc(&wf->stats.transfers);
+    if (in)
+        atomic64_add(*actual_length, &wf->stats.bytes_in);
+    else
+        atomic64_add(*actual_length, &wf->stats.bytes_out);
+    if (retval == -ETIMEDOUT)
+        atomic64_inc(&wf->stats.timeouts);
+    else if (retval)
+        atomic64_inc(&wf->stats.errors);
+    return retval;
+}
+
+/*
+ * Broadcast mode: one set of bulk IN URBs receives straight into a ring of
+ * slots and every handle in the mode reads the ring with its own cursor.
+ * A slot is reused once a URB is submitted into it again, slow readers
+ * either lose the oldest slots (DROP) or hold back the stream (BLOCK).
+ */
+static u64
+wixusb_bcast_limit(struct wixusb_bcast *bc) {
+    struct wixusb_file *wf;
+    u64 limit = U64_MAX;
+
+    list_for_each_entry(wf, &bc->readers, bcast_node)
+    {
+        if (wf->bcast_policy == WIXUSB_BCAST_BLOCK)
+            limit = min(limit, wf->bcast_seq + WIXUSB_BCAST_SLOTS);
+    }
+    return limit;
+}
+
+/* Called with bc->lock held, submits idle URBs into the next free slots */
+static void
+wixusb_bcast_fill(struct wixusb_bcast *bc) {
+    u64 limit = wixusb_bcast_limit(bc);
+    int i;
+
+    if (bc->halted || bc->suspended || bc->switching ||
+        list_empty(&bc->readers))
+        return;
+
+    for (i = 0; i < WIXUSB_BCAST_URBS; i++)
+    {
+        struct wixusb_bcast_urb *u = &bc->urbs[i];
+
+        if (u->busy)
+            continue;
+        if (bc->tail >= limit)
+            break;
+
+        u->seq = bc->tail;
+        u->urb->transfer_buffer = bc->slots[u->seq % WIXUSB_BCAST_SLOTS].data;
+        usb_anchor_urb(u->urb, &bc->submitted);
+        if (usb_submit_urb(u->urb, GFP_ATOMIC))
+        {
+            usb_unanchor_urb(u->urb);
+            break;
+        }
+        u->busy = true;
+        bc->tail++;
+    }
+}
+
+/* The CPU of the completion work, an offline CPU falls back to the local one */
+static int
+wixusb_completion_cpu(void) {
+    int cpu = READ_ONCE(completion_cpu);
+
+    if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu))
+        return WORK_CPU_UNBOUND;
+    return cpu;
+}
+
+/*
+ * Publishes the completed slots in completion order, refills the URBs and
+ * wakes the readers once per batch, off the interrupt's CPU if
+ * completion_cpu says so.
+ */
+static void
+wixusb_bcast_work(struct work_struct *work) {
+    struct wixusb_bcast *bc = container_of(work, struct wixusb_bcast, done_work);
+    struct llist_node *done = llist_reverse_order(llist_del_all(&bc->done));
+    struct wixusb_bcast_urb *u, *next;
+    struct wixusb_bcast_slot *slot;
+    struct usb_wixusb *dev = NULL;
+
+    if (!done)
+        return;
+
+    spin_lock_irq(&bc->lock);
+    llist_for_each_entry_safe(u, next, done, done_node)
+    {
+        dev = u->dev;
+        u->busy = false;
+        slot = &bc->slots[u->seq % WIXUSB_BCAST_SLOTS];
+        slot->len = u->actual;
+        slot->status = u->status;
+        slot->mono = u->mono;
+        slot->boot = u->boot;
+        bc->head = u->seq + 1;
+        /* a reader consuming the error restarts the stream */
+        if (u->status)
+            bc->halted = true;
+    }
+    wixusb_bcast_fill(bc);
+    spin_unlock_irq(&bc->lock);
+
+    wake_up_interruptible(&dev->wait);
+}
+
+static void
+wixusb_bcast_complete(struct urb *urb) {
+    struct wixusb_bcast_urb *u = urb->context;
+    struct usb_wixusb *dev = u->dev;
+    struct wixusb_bcast *bc = dev->bcast;
+    unsigned long flags;
+
+    switch (urb->status)
+    {
+        case -ENOENT:
+        case -ECONNRESET:
+        case -ESHUTDOWN:
+        {
+            /* killed, done here so the URB is idle once the kill returns */
+            spin_lock_irqsave(&bc->lock, flags);
+            u->busy = false;
+            /* the slot is received again on the next fill */
+            bc->tail = min(bc->tail, u->seq);
+            spin_unlock_irqrestore(&bc->lock, flags);
+            wake_up_interruptible(&dev->wait);
+            break;
+        }
+        default:
+        {
+            u->status = urb->status;
+            u->actual = urb->actual_length;
+            u->mono = ktime_get();
+            u->boot = ktime_get_boottime();
+            /* a work already queued or running picks this one up too */
+            if (llist_add(&u->done_node, &bc->done))
+                queue_work_on(wixusb_completion_cpu(), dev->wq, &bc->done_work);
+            break;
+        }
+    }
+}
+
+static void
+wixusb_bcast_free(struct wixusb_bcast *bc) {
+    int i;
+
+    for (i = 0; i < WIXUSB_BCAST_URBS; i++)
+        usb_free_urb(bc->urbs[i].urb);
+    for (i = 0; i < WIXUSB_BCAST_SLOTS; i++)
+        kfree(bc->slots[i].data);
+    kfree(bc);
+}
+
+static struct wixusb_bcast *
+wixusb_bcast_alloc(struct usb_wixusb *dev) {
+    struct wixusb_bcast *bc;
+    int i;
+
+    bc = kzalloc(sizeof (*bc), GFP_KERNEL);
+    if (!bc)
+        return NULL;
+
+    spin_lock_init(&bc->lock);
+    INIT_LIST_HEAD(&bc->readers);
+    init_usb_anchor(&bc->submitted);
+    init_llist_head(&bc->done);
+    INIT_WORK(&bc->done_work, wixusb_bcast_work);
+
+    for (i = 0; i < WIXUSB_BCAST_SLOTS; i++)
+    {
+        bc->slots[i].data = kmalloc(WIXUSB_BUFFSIZE, GFP_KERNEL);
+        if (!bc->slots[i].data)
+            goto error;
+    }
+
+    for (i = 0; i < WIXUSB_BCAST_URBS; i++)
+    {
+        bc->urbs[i].dev = dev;
+        bc->urbs[i].urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!bc->urbs[i].urb)
+            goto error;
+        usb_fill_bulk_urb(bc->urbs[i].urb, dev->usbdev,
+            dev->pipes[WIXUSB_PIPE_BULK_IN].pipe, NULL, WIXUSB_BUFFSIZE,
+            wixusb_bcast_complete, &bc->urbs[i]);
+    }
+    bc->switching = !dev->pipes[WIXUSB_PIPE_BULK_IN].addr;
+    return bc;
+
+error:
+    wixusb_bcast_free(bc);
+    return NULL;
+}
+
+/* Whether another handle has a transfer on the bulk IN pipe */
+static bool
+wixusb_bulk_in_busy(struct wixusb_file *wf) {
+    struct usb_wixusb *dev = wf->dev;
+    struct wixusb_file *other;
+    bool busy = false;
+
+    mutex_lock(&dev->files_lock);
+    list_for_each_entry(other, &dev->files, node)
+    {
+        if (other != wf &&
+            !usb_anchor_empty(&other->submitted[WIXUSB_PIPE_BULK_IN]))
+        {
+            busy = true;
+            break;
+        }
+    }
+    mutex_unlock(&dev->files_lock);
+    return busy;
+}
+
+/* Called with wf->bcast_mutex and io_mutex held */
+static int
+wixusb_bcast_join(struct wixusb_file *wf, int policy) {
+    struct usb_wixusb *dev = wf->dev;
+    struct wixusb_bcast *bc = dev->bcast;
+    int retval;
+
+    if (!bc)
+    {
+        bc = wixusb_bcast_alloc(dev);
+        if (!bc)
+            return -ENOMEM;
+
+        /* suspend looks at the stream under files_lock */
+        mutex_lock(&dev->files_lock);
+        dev->bcast = bc;
+        mutex_unlock(&dev->files_lock);
+    }
+
+    if (!wf->bcast && list_empty(&bc->readers))
+    {
+        /* direct reads of other handles on the bulk IN pipe are theirs */
+        if (wixusb_bulk_in_busy(wf))
+            return -EBUSY;
+        usb_kill_anchored_urbs(&wf->submitted[WIXUSB_PIPE_BULK_IN]);
+
+        /* the stream keeps the device awake while it runs */
+        retval = usb_autopm_get_interface(dev->interface);
+        if (retval)
+            return retval;
+        bc->halted = false;
+    }
+
+    spin_lock_irq(&bc->lock);
+    wf->bcast_policy = policy;
+    if (!wf->bcast)
+    {
+        /* new readers start with live data */
+        wf->bcast_seq = bc->head;
+        wf->bcast_off = 0;
+        list_add_tail(&wf->bcast_node, &bc->readers);
+        wf->bcast = true;
+    }
+    wixusb_bcast_fill(bc);
+    spin_unlock_irq(&bc->lock);
+    return 0;
+}
+
+/* Called with wf->bcast_mutex and io_mutex held */
+static void
+wixusb_bcast_leave(struct wixusb_file *wf) {
+    struct usb_wixusb *dev = wf->dev;
+    struct wixusb_bcast *bc = dev->bcast;
+    bool last;
+
+    if (!wf->bcast)
+        return;
+
+    spin_lock_irq(&bc->lock);
+    list_del(&wf->bcast_node);
+    WRITE_ONCE(wf->bcast, false);
+    last = list_empty(&bc->readers);
+    /* a blocking reader leaving may free slots for the others */
+    if (!last)
+        wixusb_bcast_fill(bc);
+    spin_unlock_irq(&bc->lock);
+    /* a read of this handle waiting in the ring goes direct */
+    wake_up_interruptible_all(&dev->wait);
+
+    if (!last)
+        return;
+
+    /* the ring stays allocated, poll() may still be looking at it */
+    usb_kill_anchored_urbs(&bc->submitted);
+    if (dev->interface)
+        usb_autopm_put_interface(dev->interface);
+}
+
+/*
+ * Handled before io_mutex, bcast_mutex has to be taken first. A reader of
+ * this handle waiting in the ring does not hold it.
+ */
+static long
+wixusb_bcast_ioctl(struct wixusb_file *wf, unsigned long arg) {
+    struct usb_wixusb *dev = wf->dev;
+    wixusb_bcast_mode_t mode;
+    long retval;
+
+    if (copy_from_user(&mode, (void __user *) arg, sizeof (mode)))
+        return -EFAULT;
+    if (mode.slow_policy != WIXUSB_BCAST_DROP &&
+        mode.slow_policy != WIXUSB_BCAST_BLOCK)
+        return -EINVAL;
+
+    retval = mutex_lock_interruptible(&wf->bcast_mutex);
+    if (retval)
+        return retval;
+    mutex_lock(&dev->io_mutex);
+
+    if (!dev->interface)
+        retval = -ENODEV;
+    else if (mode.enable)
+        retval = wixusb_bcast_join(wf, mode.slow_policy);
+    else
+        wixusb_bcast_leave(wf);
+
+    mutex_unlock(&dev->io_mutex);
+    mutex_unlock(&wf->bcast_mutex);
+    return retval;
+}
+
+/* Called with bc->lock held, moves a DROP reader past overwritten slots */
+static void
+wixusb_bcast_catch_up(struct wixusb_bcast *bc, struct wixusb_file *wf) {
+    u64 oldest;
+
+    if (bc->tail <= wf->bcast_seq + WIXUSB_BCAST_SLOTS)
+        return;
+
+    /* leave room for the URBs that are about to be resubmitted */
+    oldest = bc->tail + WIXUSB_BCAST_URBS - WIXUSB_BCAST_SLOTS;
+    atomic64_add(oldest - wf->bcast_seq, &wf->stats.dropped);
+    wf->bcast_seq = oldest;
+    wf->bcast_off = 0;
+}
+
+static bool
+wixusb_bcast_pending(struct usb_wixusb *dev, struct wixusb_file *wf) {
+    struct wixusb_bcast *bc = dev->bcast;
+    bool pending;
+
+    spin_lock_irq(&bc->lock);
+    pending = wf->bcast_seq != bc->head;
+    spin_unlock_irq(&bc->lock);
+    return pending || !READ_ONCE(dev->interface);
+}
+
+/*
+ * Framed variant of the copy loop in wixusb_bcast_read(): one record per
+ * slot, a slot larger than the room left is split across records.
+ */
+static ssize_t
+wixusb_bcast_copy_framed(struct wixusb_bcast *bc, struct iov_iter *to,
+    u8 endpoint, u64 *seq, unsigned int *off, u64 head, int *status) {
+    struct wixusb_bcast_slot *slot;
+    wixusb_frame_hdr_t hdr = {0};
+    size_t copied = 0, left;
+    unsigned int n;
+
+    while (*seq != head && iov_iter_count(to) > sizeof (hdr))
+    {
+        left = iov_iter_count(to);
+        slot = &bc->slots[*seq % WIXUSB_BCAST_SLOTS];
+        n = min_t(size_t, slot->len - *off, iov_iter_count(to) - sizeof (hdr));
+
+        hdr.mono_ns = ktime_to_ns(slot->mono);
+        hdr.boot_ns = ktime_to_ns(slot->boot);
+        hdr.length = n;
+        hdr.status = slot->status;
+        hdr.endpoint = endpoint;
+        if (copy_to_iter(&hdr, sizeof (hdr), to) != sizeof (hdr) ||
+            copy_to_iter(slot->data + *off, n, to) != n)
+        {
+            /* a torn record is not delivered, the ones before it are */
+            iov_iter_revert(to, left - iov_iter_count(to));
+            return copied ? copied : -EFAULT;
+        }
+        copied += sizeof (hdr) + n;
+
+        /* the error travels in the record, the stream restarts */
+        if (slot->status)
+            *status = slot->status;
+        *off += n;
+        if (*off == slot->len)
+        {
+            (*seq)++;
+            *off = 0;
+        }
+    }
+    return copied;
+}
+
+/*
+ * Called with wf->bcast_mutex held, which is left while it waits for data.
+ * A blocking read gets -EAGAIN when the handle left broadcast mode then.
+ */
+static ssize_t
+wixusb_bcast_read(struct wixusb_file *wf, struct iov_iter *to, bool nonblock) {
+    struct usb_wixusb *dev = wf->dev;
+    struct wixusb_bcast *bc = dev->bcast;
+    struct wixusb_bcast_slot *slot;
+    u64 seq, head;
+    unsigned int off, n;
+    size_t copied, done;
+    size_t count = iov_iter_count(to);
+    ssize_t retval;
+    int status;
+
+    if (wf->framed && count <= sizeof (wixusb_frame_hdr_t))
+        return -EINVAL;
+
+again:
+    status = 0;
+    copied = 0;
+    retval = 0;
+
+    spin_lock_irq(&bc->lock);
+    while (wf->bcast_seq == bc->head)
+    {
+        spin_unlock_irq(&bc->lock);
+        if (!READ_ONCE(dev->interface))
+            return -ENODEV;
+        if (nonblock)
+            return -EAGAIN;
+        mutex_unlock(&wf->bcast_mutex);
+        retval = wait_event_interruptible(dev->wait,
+            wixusb_bcast_pending(dev, wf) || !READ_ONCE(wf->bcast));
+        mutex_lock(&wf->bcast_mutex);
+        if (retval)
+            return retval;
+        if (!wf->bcast)
+            return -EAGAIN;
+        /* framing may have been turned on meanwhile */
+        if (wf->framed && count <= sizeof (wixusb_frame_hdr_t))
+            return -EINVAL;
+        spin_lock_irq(&bc->lock);
+    }
+    if (wf->bcast_policy == WIXUSB_BCAST_DROP)
+        wixusb_bcast_catch_up(bc, wf);
+    seq = wf->bcast_seq;
+    off = wf->bcast_off;
+    head = bc->head;
+    spin_unlock_irq(&bc->lock);
+
+    if (wf->framed)
+    {
+        retval = wixusb_bcast_copy_framed(bc, to,
+            dev->pipes[WIXUSB_PIPE_BULK_IN].addr, &seq, &off, head, &status);
+        if (retval > 0)
+        {
+            copied = retval;
+            retval = status;
+        }
+    }
+
+    while (!wf->framed && seq != head && copied < count)
+    {
+        slot = &bc->slots[seq % WIXUSB_BCAST_SLOTS];
+        if (slot->status)
+        {
+            /* report a failed transfer on its own, then move past it */
+            if (!copied)
+            {
+                retval = slot->status;
+                seq++;
+                off = 0;
+            }
+            break;
+        }
+
+        n = min_t(size_t, slot->len - off, count - copied);
+        done = copy_to_iter(slot->data + off, n, to);
+        copied += done;
+        off += done;
+        if (done != n)
+        {
+            retval = -EFAULT;
+            break;
+        }
+        if (off == slot->len)
+        {
+            seq++;
+            off = 0;
+        }
+    }
+
+    spin_lock_irq(&bc->lock);
+    if (wf->bcast_policy == WIXUSB_BCAST_DROP &&
+        bc->tail > wf->bcast_seq + WIXUSB_BCAST_SLOTS)
+    {
+        /* the producer lapped us while copying, the data may be torn */
+        wixusb_bcast_catch_up(bc, wf);
+        spin_unlock_irq(&bc->lock);
+        iov_iter_revert(to, count - iov_iter_count(to));
+        goto again;
+    }
+    wf->bcast_seq = seq;
+    wf->bcast_off = off;
+    atomic64_add(copied, &wf->stats.bytes_in);
+    if (retval < 0 && retval != -EFAULT)
+        bc->halted = false;
+    wixusb_bcast_fill(bc);
+    spin_unlock_irq(&bc->lock);
+
+    return copied ? copied : retval;
+}
+
+/*
+ * Control transfer with the data stage in a caller supplied buffer. Only
+ * wLength bytes cross the user boundary, up to the full 64 KB of EP0.
+ */
+static long
+wixusb_ctrl_xfer(struct wixusb_file *wf, unsigned long arg) {
+    struct usb_wixusb *dev = wf->dev;
+    unsigned int timeout = wixusb_policy(wf, 0)->timeout;
+    wixusb_ctrl_xfer_t xfer;
+    void __user *udata;
+    u8 *data = NULL;
+    __u16 len;
+    long retval;
+
+    if (copy_from_user(&xfer, (void __user *) arg, sizeof (xfer)))
+        return -EFAULT;
+
+    udata = (void __user *) (uintptr_t) xfer.data;
+    len = xfer.winusb_packet.Length;
+    if (len)
+    {
+        data = kmalloc(len, GFP_KERNEL | __GFP_NOWARN);
+        if (!data)
+            return -ENOMEM;
+    }
+
+    if (SETUP_PACKET_IS_INPUT(xfer.winusb_packet.RequestType))
+    {
+        wixusb_bus_begin(dev);
+        retval = usb_control_msg(dev->usbdev, usb_rcvctrlpipe(dev->usbdev, 0),
+            xfer.winusb_packet.Request, xfer.winusb_packet.RequestType,
+            xfer.winusb_packet.Value, xfer.winusb_packet.Index,
+            data, len, timeout);
+        wixusb_bus_end(dev);
+        if (retval > 0 && copy_to_user(udata, data, retval))
+            retval = -EFAULT;
+    }
+    else
+    {
+        if (len && copy_from_user(data, udata, len))
+        {
+            retval = -EFAULT;
+            goto exit;
+        }
+        wixusb_bus_begin(dev);
+        retval = usb_control_msg(dev->usbdev, usb_sndctrlpipe(dev->usbdev, 0),
+            xfer.winusb_packet.Request, xfer.winusb_packet.RequestType,
+            xfer.winusb_packet.Value, xfer.winusb_packet.Index,
+            data, len, timeout);
+        wixusb_bus_end(dev);
+    }
+
+exit:
+    kfree(data);
+    atomic64_inc(&wf->stats.transfers);
+    if (retval < 0)
+        atomic64_inc(&wf->stats.errors);
+    else if (SETUP_PACKET_IS_INPUT(xfer.winusb_packet.RequestType))
+        atomic64_add(retval, &wf->stats.bytes_in);
+    else
+        atomic64_add(retval, &wf->stats.bytes_out);
+    return retval;
+}
+
+/*
+ * WinUsb_GetAssociatedInterface(): index 0 is the interface following this
+ * one in the active configuration. It has to be bound to this driver too.
+ * The configuration cannot change while dev is on the list, as that
+ * unbinds every interface first.
+ */
+static long
+wixusb_assoc_iface(struct wixusb_file *wf, unsigned long arg) {
+    struct usb_wixusb *dev = wf->dev, *sibling;
+    struct usb_host_config *config;
+    struct usb_interface *intf = NULL;
+    wixusb_assoc_iface_t assoc;
+    long retval = -ENOENT;
+    int i;
+
+    if (copy_from_user(&assoc, (void __user *) arg, sizeof (assoc)))
+        return -EFAULT;
+
+    mutex_lock(&wixusb_devices_lock);
+    if (list_empty(&dev->node))
+    {
+        retval = -ENODEV;
+        goto exit;
+    }
+
+    config = dev->usbdev->actconfig;
+    for (i = 0; i < config->desc.bNumInterfaces; i++)
+    {
+        if (config->interface[i] != dev->interface)
+            continue;
+        i += 1 + assoc.index;
+        if (i < config->desc.bNumInterfaces)
+            intf = config->interface[i];
+        break;
+    }
+    if (!intf)
+        goto exit;
+
+    retval = -ENXIO;
+    list_for_each_entry(sibling, &wixusb_devices, node)
+    {
+        if (sibling->interface != intf)
+            continue;
+        assoc.interface_number = intf->cur_altsetting->desc.bInterfaceNumber;
+        assoc.node = intf->minor - USB_SKEL_MINOR_BASE;
+        retval = 0;
+        break;
+    }
+
+exit:
+    mutex_unlock(&wixusb_devices_lock);
+    if (!retval && copy_to_user((void __user *) arg, &assoc, sizeof (assoc)))
+        retval = -EFAULT;
+    return retval;
+}
+
+static bool
+wixusb_is_status_ioctl(unsigned int cmd) {
+    return cmd == IOCTL_IS_CONNECTED || cmd == IOCTL_GET_VID_PID ||
+        cmd == IOCTL_GET_STATUS || cmd == IOCTL_GET_ALT;
+}
+
+/*
+ * Status queries are polled by monitors at a high rate: they take no lock
+ * and do not log. The values may be slightly stale, never inconsistent with
+ * the device still being around, as dev lives as long as the handle.
+ */
+static long
+wixusb_status_ioctl(struct wixusb_file *wf, unsigned int cmd,
+    unsigned long arg) {
+    struct usb_wixusb *dev = wf->dev;
+    struct wixusb_bcast *bc = READ_ONCE(dev->bcast);
+    bool connected = READ_ONCE(dev->interface) != NULL;
+    wixusb_status_t status = {0};
+
+    switch (cmd)
+    {
+        case IOCTL_IS_CONNECTED:
+            return connected ? 0 : -ENODEV;
+        case IOCTL_GET_ALT:
+            return put_user(READ_ONCE(dev->alt), (__u8 __user *) arg);
+        case IOCTL_GET_VID_PID:
+        {
+            wixusb_vid_pid_t vidpid = {
+                .pid = dev->idProduct,
+                .vid = VENDOR_ID
+            };
+
+            if (!connected)
+                return -ENODEV;
+            if (copy_to_user(((void *) arg), &vidpid, sizeof (vidpid)))
+                return -EFAULT;
+            return 0;
+        }
+        default:
+            break;
+    }
+
+    status.connected = connected;
+    status.vid = VENDOR_ID;
+    status.pid = dev->idProduct;
+    status.speed = dev->usbdev->speed;
+    status.open_handles = atomic_read(&dev->open_counter);
+    status.in_flight = atomic_read(&dev->in_flight);
+    if (bc && READ_ONCE(wf->bcast))
+    {
+        u64 head = READ_ONCE(bc->head);
+
+        status.bcast_queued = min_t(u64, head - READ_ONCE(wf->bcast_seq),
+            WIXUSB_BCAST_SLOTS);
+        status.bcast_pending = READ_ONCE(bc->tail) - head;
+    }
+
+    if (copy_to_user((void *) arg, &status, sizeof (status)))
+        return -EFAULT;
+    return 0;
+}
+
+/*
+ * Called with io_mutex held once no stream transfer is left, eps are the
+ * bulk IN and OUT endpoints.
+ */
+static int
+wixusb_free_streams(struct usb_wixusb *dev, struct usb_host_endpoint **eps) {
+    int retval = 0;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0))
+    retval = usb_free_streams(dev->interface, eps, 2, GFP_KERNEL);
+#else
+    usb_free_streams(dev->interface, eps, 2, GFP_KERNEL);
+#endif
+    if (!retval)
+        dev->num_streams = 0;
+    return retval;
+}
+
+/*
+ * USB 3 bulk streams: the two bulk pipes get num_streams independent
+ * queues, so many tagged transfers can be outstanding at once as in UAS.
+ * Called with io_mutex held; stream transfers must have finished before
+ * the streams are freed or reallocated.
+ */
+static long
+wixusb_alloc_streams(struct usb_wixusb *dev, unsigned long num) {
+    struct usb_host_endpoint *eps[2];
+    int retval;
+
+    if (!dev->pipes[WIXUSB_PIPE_BULK_IN].addr ||
+        !dev->pipes[WIXUSB_PIPE_BULK_OUT].addr)
+        return -ENODEV;
+    eps[0] = usb_pipe_endpoint(dev->usbdev, dev->pipes[WIXUSB_PIPE_BULK_IN].pipe);
+    eps[1] = usb_pipe_endpoint(dev->usbdev, dev->pipes[WIXUSB_PIPE_BULK_OUT].pipe);
+    if (!eps[0] || !eps[1])
+        return -ENODEV;
+
+    if (dev->num_streams)
+    {
+        if (dev->stream_xfers)
+            return -EBUSY;
+        retval = wixusb_free_streams(dev, eps);
+        if (retval)
+            return retval;
+    }
+    if (!num)
+        return 0;
+
+    /* the host controller may grant fewer, stream 0 is reserved */
+    retval = usb_alloc_streams(dev->interface, eps, 2,
+        min_t(unsigned long, num, 65533), GFP_KERNEL);
+    if (retval < 0)
+        return retval;
+    dev->num_streams = retval;
+    return retval;
+}
+
+/*
+ * Only the submission holds io_mutex, so concurrent callers each wait for
+ * their own URB and complete independently of the other streams. They are
+ * admitted like the other bulk transfers, up to the class limit.
+ */
+static long
+wixusb_stream_xfer(struct wixusb_file *wf, unsigned long arg) {
+    struct usb_wixusb *dev = wf->dev;
+    wixusb_stream_xfer_t xfer;
+    struct wixusb_xfer_done xd;
+    struct urb *urb = NULL;
+    void __user *udata;
+    unsigned int timeout;
+    unsigned long expire;
+    ktime_t start;
+    u8 *data;
+    bool in;
+    int idx, dir, prio;
+    long retval;
+
+    if (copy_from_user(&xfer, (void __user *) arg, sizeof (xfer)))
+        return -EFAULT;
+    if (!xfer.length || xfer.length > WIXUSB_STREAM_MAX_XFER)
+        return -EINVAL;
+
+    udata = (void __user *) (uintptr_t) xfer.data;
+    in = xfer.endpoint & USB_DIR_IN;
+    dir = in ? WIXUSB_SCHED_IN : WIXUSB_SCHED_OUT;
+    data = kmalloc(xfer.length, GFP_KERNEL | __GFP_NOWARN);
+    if (!data)
+        return -ENOMEM;
+    if (!in && copy_from_user(data, udata, xfer.length))
+    {
+        retval = -EFAULT;
+        goto exit;
+    }
+
+    urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (!urb)
+    {
+        retval = -ENOMEM;
+        goto exit;
+    }
+    init_completion(&xd.done);
+
+    retval = wixusb_shape(wf, xfer.endpoint, xfer.length);
+    if (retval)
+        goto exit;
+
+    prio = wixusb_prio(wf, WIXUSB_PRIO_BULK);
+    retval = wixusb_sched_enter(dev, dir, prio, &start);
+    if (retval)
+        goto exit;
+
+    mutex_lock(&dev->io_mutex);
+    if (!dev->interface)
+    {
+        retval = -ENODEV;
+        goto error_unlock;
+    }
+    idx = wixusb_pipe_by_id(dev, xfer.endpoint);
+    if ((idx != WIXUSB_PIPE_BULK_IN && idx != WIXUSB_PIPE_BULK_OUT) ||
+        !xfer.stream_id || xfer.stream_id > dev->num_streams)
+    {
+        retval = -EINVAL;
+        goto error_unlock;
+    }
+    retval = usb_autopm_get_interface(dev->interface);
+    if (retval)
+        goto error_unlock;
+
+    usb_fill_bulk_urb(urb, dev->usbdev, dev->pipes[idx].pipe, data,
+        xfer.length, wixusb_xfer_complete, &xd);
+    urb->stream_id = xfer.stream_id;
+    /* on the handle's pipe, where abort finds it */
+    wixusb_park_init(&xd.park, dev, urb, &wf->submitted[idx]);
+    usb_anchor_urb(urb, &wf->submitted[idx]);
+    retval = usb_submit_urb(urb, GFP_KERNEL);
+    if (retval)
+    {
+        usb_unanchor_urb(urb);
+        usb_autopm_put_interface(dev->interface);
+        goto error_unlock;
+    }
+    timeout = wixusb_policy(wf, xfer.endpoint)->timeout;
+    dev->stream_xfers++;
+    wixusb_bus_begin(dev);
+
+    expire = timeout ? msecs_to_jiffies(timeout) : MAX_SCHEDULE_TIMEOUT;
+    if (!wait_for_completion_timeout(&xd.done, expire))
+    {
+        bool parked = wixusb_unpark(&xd.park);
+
+        usb_kill_urb(urb);
+        if (wixusb_unpark(&xd.park) || parked)
+            wixusb_park_complete(&xd.park, -ENOENT);
+        retval = (urb->status == -ENOENT ? -ETIMEDOUT : urb->status);
+    }
+    else
+    {
+        retval = urb->status;
+    }
+    xfer.actual = urb->actual_length;
+
+    wixusb_shape_refund(wf, xfer.endpoint, xfer.length, xfer.actual);
+    if (in && xfer.actual && copy_to_user(udata, data, xfer.actual))
+        retval = -EFAULT;
+    if (put_user(xfer.actual, &((wixusb_stream_xfer_t __user *) arg)->actual))
+        retval = -EFAULT;
+
+    /* the interface is gone after a disconnect, and its PM count with it */
+    wixusb_bus_end(dev);
+    dev->stream_xfers--;
+    if (dev->interface)
+        usb_autopm_put_interface(dev->interface);
+    atomic64_inc(&wf->stats.transfers);
+    if (in)
+        atomic64_add(xfer.actual, &wf->stats.bytes_in);
+    else
+        atomic64_add(xfer.actual, &wf->stats.bytes_out);
+    if (retval == -ETIMEDOUT)
+        atomic64_inc(&wf->stats.timeouts);
+    else if (retval)
+        atomic64_inc(&wf->stats.errors);
+
+error_unlock:
+    mutex_unlock(&dev->io_mutex);
+    wixusb_sched_exit(dev, dir, prio, start);
+exit:
+    usb_free_urb(urb);
+    kfree(data);
+    return retval;
+}
+
+/*
+ * Called with io_mutex held, so no direct transfer can start; those on
+ * the bus are waited for. The broadcast stream is parked and re-armed on
+ * the new bulk IN endpoint.
+ */
+static long
+wixusb_set_alt(struct usb_wixusb *dev, unsigned long alt) {
+    struct usb_interface *interface = dev->interface;
+    struct usb_host_interface *setting;
+    struct wixusb_bcast *bc = dev->bcast;
+    long retval;
+    int i;
+
+    setting = usb_altnum_to_altsetting(interface, alt);
+    if (!setting)
+        return -EINVAL;
+
+    if (bc)
+    {
+        spin_lock_irq(&bc->lock);
+        bc->switching = true;
+        spin_unlock_irq(&bc->lock);
+        usb_kill_anchored_urbs(&bc->submitted);
+    }
+
+    /*
+     * The endpoints are disabled by the switch, their streams go with them.
+     * The killed stream transfers still wait for io_mutex to count out.
+     */
+    wixusb_quiesce(dev, WIXUSB_PIPES_ALL);
+    retval = 0;
+    if (dev->num_streams)
+    {
+        struct usb_host_endpoint *eps[2] = {
+            usb_pipe_endpoint(dev->usbdev, dev->pipes[WIXUSB_PIPE_BULK_IN].pipe),
+            usb_pipe_endpoint(dev->usbdev, dev->pipes[WIXUSB_PIPE_BULK_OUT].pipe),
+        };
+
+        retval = wixusb_free_streams(dev, eps);
+        if (retval)
+            wixusb_log("wixusb_set_alt : streams not freed (%ld)", retval);
+    }
+
+    if (!retval)
+        retval = usb_set_interface(dev->usbdev,
+            setting->desc.bInterfaceNumber, alt);
+    if (!retval)
+    {
+        wixusb_find_pipes(dev, interface->cur_altsetting);
+        WRITE_ONCE(dev->alt, alt);
+    }
+
+    if (bc)
+    {
+        spin_lock_irq(&bc->lock);
+        for (i = 0; i < WIXUSB_BCAST_URBS; i++)
+            bc->urbs[i].urb->pipe = dev->pipes[WIXUSB_PIPE_BULK_IN].pipe;
+        /* stays parked on a setting without a bulk IN endpoint */
+        bc->switching = !dev->pipes[WIXUSB_PIPE_BULK_IN].addr;
+        wixusb_bcast_fill(bc);
+        spin_unlock_irq(&bc->lock);
+    }
+    return retval;
+}
+
+/*
+ * The configuration descriptors read at enumeration, kept by the USB core
+ * as long as we hold the usb_device. No control transfer, no lock.
+ */
+static long
+wixusb_config_desc(struct usb_wixusb *dev, unsigned long arg) {
+    wixusb_config_desc_t __user *uarg = (void __user *) arg;
+    struct usb_device *usbdev = dev->usbdev;
+    wixusb_config_desc_t cfg;
+    u32 total, n;
+
+    if (copy_from_user(&cfg, uarg, sizeof (cfg)))
+        return -EFAULT;
+    if (cfg.index >= usbdev->descriptor.bNumConfigurations ||
+        !usbdev->rawdescriptors[cfg.index])
+        return -EINVAL;
+
+    /* the allocated length, a device may have sent less than it claimed */
+    total = le16_to_cpu(usbdev->config[cfg.index].desc.wTotalLength);
+    n = min(total, cfg.length);
+    if (copy_to_user((void __user *) (uintptr_t) cfg.data,
+        usbdev->rawdescriptors[cfg.index], n) ||
+        put_user(total, &uarg->total))
+        return -EFAULT;
+    return n;
+}
+
+/* Commands that talk to the device and therefore have to resume it */
+static bool
+wixusb_ioctl_needs_bus(unsigned int cmd) {
+    switch (cmd)
+    {
+        case IOCTL_SEND_CTRL:
+        case IOCTL_RECV_CTRL:
+        case IOCTL_CTRL_XFER:
+        case IOCTL_GET_DESC:
+        case IOCTL_WRITE_INT:
+        case IOCTL_RESET_PIPE:
+        case IOCTL_SET_ALT:
+        case IOCTL_ALLOC_STREAMS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Class of the transfer commands, -1 for the others */
+static int
+wixusb_ioctl_prio(struct wixusb_file *wf, unsigned int cmd) {
+    switch (cmd)
+    {
+        case IOCTL_SEND_CTRL:
+        case IOCTL_RECV_CTRL:
+        case IOCTL_CTRL_XFER:
+        case IOCTL_GET_DESC:
+        case IOCTL_WRITE_INT:
+            return wixusb_prio(wf, WIXUSB_PRIO_CRITICAL);
+        default:
+            return -1;
+    }
+}
+
+static long
+wixusb_prio_ioctl(struct wixusb_file *wf, unsigned int cmd, unsigned long arg) {
+    struct wixusb_sched *s = &wf->dev->sched;
+    wixusb_prio_stats_t *stats;
+    wixusb_prio_limit_t limit;
+    long retval = 0;
+    int i;
+
+    switch (cmd)
+    {
+        case IOCTL_SET_PRIORITY:
+        {
+            if (arg >= WIXUSB_PRIO_COUNT && arg != WIXUSB_PRIO_AUTO)
+                return -EINVAL;
+            WRITE_ONCE(wf->prio, arg);
+            break;
+        }
+        case IOCTL_SET_PRIO_LIMIT:
+        {
+            if (copy_from_user(&limit, (void __user *) arg, sizeof (limit)))
+                return -EFAULT;
+            if (limit.prio >= WIXUSB_PRIO_COUNT || !limit.limit)
+                return -EINVAL;
+
+            spin_lock_irq(&s->lock);
+            s->limit[limit.prio] = limit.limit;
+            spin_unlock_irq(&s->lock);
+            wake_up_all(&s->wait);
+            break;
+        }
+        case IOCTL_GET_PRIO_STATS:
+        {
+            stats = kmalloc(sizeof (*stats), GFP_KERNEL);
+            if (!stats)
+                return -ENOMEM;
+
+            spin_lock_irq(&s->lock);
+            for (i = 0; i < WIXUSB_PRIO_COUNT; i++)
+            {
+                stats->classes[i].limit = s->limit[i];
+                stats->classes[i].in_flight =
+                    s->in_flight[WIXUSB_SCHED_OUT][i] +
+                    s->in_flight[WIXUSB_SCHED_IN][i];
+                stats->classes[i].transfers = s->transfers[i];
+                memcpy(stats->classes[i].latency, s->latency[i],
+                    sizeof (s->latency[i]));
+            }
+            spin_unlock_irq(&s->lock);
+
+            if (copy_to_user((void __user *) arg, stats, sizeof (*stats)))
+                retval = -EFAULT;
+            kfree(stats);
+            break;
+        }
+    }
+    return retval;
+}
+
+/*
+ * AUTO_SUSPEND is per handle: turning it off resumes the device and holds
+ * an autopm reference until it is turned back on or the handle is closed.
+ * Autosuspend itself is enabled at probe.
+ */
+static long
+wixusb_set_power_policy(struct wixusb_file *wf, wixusb_power_policy_t *policy) {
+    struct usb_wixusb *dev = wf->dev;
+    int retval;
+
+    switch (policy->policy_type)
+    {
+        case AUTO_SUSPEND:
+            if (!policy->policy_value && !wf->pm_hold)
+            {
+                /* wakes a device that is already suspended */
+                retval = usb_autopm_get_interface(dev->interface);
+                if (retval)
+                    return retval;
+                wf->pm_hold = true;
+            }
+            else if (policy->policy_value && wf->pm_hold)
+            {
+                usb_autopm_put_interface(dev->interface);
+                wf->pm_hold = false;
+            }
+            return 0;
+        case SUSPEND_DELAY:
+            pm_runtime_set_autosuspend_delay(&dev->usbdev->dev,
+                policy->policy_value);
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+static long
+wixusb_get_power_policy(struct wixusb_file *wf, wixusb_power_policy_t *policy) {
+    switch (policy->policy_type)
+    {
+        case AUTO_SUSPEND:
+            policy->policy_value = !wf->pm_hold;
+            return 0;
+        case SUSPEND_DELAY:
+#ifdef CONFIG_PM
+            policy->policy_value = wf->dev->usbdev->dev.power.autosuspend_delay;
+#else
+            policy->policy_value = 0;
+#endif
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+static int
+wixusb_open(struct inode *inode, struct file *file) {
+    struct usb_wixusb *dev;
+    struct wixusb_file *wf;
+    struct usb_interface *interface;
+    int subminor;
+    int retval = 0;
+    int i;
+
+    subminor = iminor(inode);
+
+    interface = usb_find_interface(&wixusb_driver, subminor);
+    if (!interface)
+    {
+        pr_err("%s - error, can't find device for minor %d\n",
+            __func__, subminor);
+        retval = -ENODEV;
+        goto exit;
+    }
+
+    dev = usb_get_intfdata(interface);
+    if (!dev)
+    {
+        wixusb_log("Error: wixusb_open : usb_get_intfdata");
+        retval = -ENODEV;
+        goto exit;
+    }
+
+    wf = kzalloc(sizeof (*wf), GFP_KERNEL);
+    if (!wf)
+    {
+        retval = -ENOMEM;
+        goto exit;
+    }
+
+    /* increment our usage count for the device */
+    kref_get(&dev->kref);
+
+    wf->dev = dev;
+    for (i = 0; i < WIXUSB_PIPE_COUNT; i++)
+        init_usb_anchor(&wf->submitted[i]);
+    /* writes have always been terminated, unlike on Windows */
+    for (i = 0; i < WIXUSB_EP_SLOTS; i++)
+        wf->policy[i].short_packet_terminate = true;
+    init_usb_anchor(&wf->ctrl_submitted);
+    mutex_init(&wf->bcast_mutex);
+    mutex_init(&wf->nb_mutex);
+    spin_lock_init(&wf->shape_lock);
+    wf->prio = WIXUSB_PRIO_AUTO;
+
+    mutex_lock(&dev->files_lock);
+    list_add_tail(&wf->node, &dev->files);
+    mutex_unlock(&dev->files_lock);
+    atomic_inc(&dev->open_counter);
+
+    /* save our handle in the file's private structure */
+    file->private_data = wf;
+
+exit:
+    wixusb_log("wixusb_open : (%d)", retval);
+    return retval;
+
+}
+
+/*
+ * Direct transfer of a non-blocking handle. read() and write() start it and
+ * return, the URB completes on its own and wakes the pollers. The next
+ * read() takes the data, the next write() the status of the last one. It is
+ * anchored like the synchronous transfers, so abort cancels it, and is
+ * unlinked once the pipe's timeout expires.
+ */
+struct wixusb_nb_xfer {
+    struct wixusb_file *wf;
+    struct urb *urb;
+    u8 *data;
+    struct delayed_work timeout;
+    bool timed_out;
+    struct wixusb_park park;
+    bool done; /* the fields below are set */
+    int status;
+    unsigned int off; /* bytes of the data already read */
+    wixusb_frame_hdr_t hdr;
+};
+
+static void
+wixusb_nb_complete(struct urb *urb) {
+    struct wixusb_nb_xfer *x = urb->context;
+    struct wixusb_file *wf = x->wf;
+    struct usb_wixusb *dev = wf->dev;
+    bool in = usb_pipein(urb->pipe);
+
+    if (wixusb_park(&x->park))
+        return;
+    cancel_delayed_work(&x->timeout);
+    x->status = urb->status;
+    if (x->status == -ECONNRESET && READ_ONCE(x->timed_out))
+        x->status = -ETIMEDOUT;
+    x->hdr.mono_ns = ktime_get_ns();
+    x->hdr.boot_ns = ktime_get_boottime_ns();
+    x->hdr.length = urb->actual_length;
+    x->hdr.status = x->status;
+    x->hdr.endpoint = usb_pipeendpoint(urb->pipe) | (in ? USB_DIR_IN : 0);
+    smp_store_release(&x->done, true);
+    clear_bit(in ? WIXUSB_PIPE_BULK_IN : WIXUSB_PIPE_BULK_OUT, &wf->nb_busy);
+
+    if (atomic_dec_and_test(&dev->in_flight))
+        wake_up_all(&dev->sched.wait);
+    wake_up_interruptible(&dev->wait);
+}
+
+static void
+wixusb_nb_timeout(struct work_struct *work) {
+    struct wixusb_nb_xfer *x = container_of(to_delayed_work(work),
+        struct wixusb_nb_xfer, timeout);
+
+    WRITE_ONCE(x->timed_out, true);
+    if (wixusb_unpark(&x->park))
+        wixusb_park_complete(&x->park, -ECONNRESET);
+    else
+        usb_unlink_urb(x->urb);
+}
+
+/* Called with nb_mutex held, cancels the transfer if it is still running */
+static void
+wixusb_nb_free(struct wixusb_nb_xfer *x) {
+    struct wixusb_file *wf = x->wf;
+    struct usb_wixusb *dev = wf->dev;
+    struct urb *urb = x->urb;
+    bool parked;
+
+    parked = wixusb_unpark(&x->park);
+    usb_kill_urb(urb);
+    cancel_delayed_work_sync(&x->timeout);
+    /* after the timeout work, which may complete a parked URB itself */
+    if (wixusb_unpark(&x->park) || parked)
+        wixusb_park_complete(&x->park, -ENOENT);
+    wixusb_shape_refund(wf, x->hdr.endpoint, urb->transfer_buffer_length,
+        urb->actual_length);
+
+    /* the PM count went with the interface if it was unplugged meanwhile */
+    mutex_lock(&dev->io_mutex);
+    if (dev->interface)
+        usb_autopm_put_interface(dev->interface);
+    atomic64_inc(&wf->stats.transfers);
+    if (usb_pipein(urb->pipe))
+        atomic64_add(urb->actual_length, &wf->stats.bytes_in);
+    else
+        atomic64_add(urb->actual_length, &wf->stats.bytes_out);
+    if (x->status == -ETIMEDOUT)
+        atomic64_inc(&wf->stats.timeouts);
+    else if (x->status)
+        atomic64_inc(&wf->stats.errors);
+    mutex_unlock(&dev->io_mutex);
+
+    usb_free_urb(urb);
+    kfree(x->data);
+    kfree(x);
+}
+
+/*
+ * Submits len bytes on the bulk pipe idx, taken from from for a write, and
+ * keeps the transfer in slot. Called with nb_mutex held.
+ */
+static int
+wixusb_nb_start(struct wixusb_file *wf, int idx, struct iov_iter *from,
+    size_t len, unsigned int flags, struct wixusb_nb_xfer **slot) {
+    struct usb_wixusb *dev = wf->dev;
+    struct wixusb_pipe *pipe = &dev->pipes[idx];
+    struct wixusb_nb_xfer *x;
+    unsigned int timeout;
+    int retval;
+
+    x = kzalloc(sizeof (*x), GFP_KERNEL);
+    if (!x)
+        return -ENOMEM;
+    x->wf = wf;
+    INIT_DELAYED_WORK(&x->timeout, wixusb_nb_timeout);
+    x->urb = usb_alloc_urb(0, GFP_KERNEL);
+    x->data = kmalloc(len, GFP_KERNEL | __GFP_NOWARN);
+    if (!x->urb || !x->data)
+    {
+        retval = -ENOMEM;
+        goto error;
+    }
+    if (from && copy_from_iter(x->data, len, from) != len)
+    {
+        retval = -EFAULT;
+        goto error;
+    }
+
+    retval = mutex_lock_interruptible(&dev->io_mutex);
+    if (retval)
+        goto error;
+    if (!dev->interface || !pipe->addr)
+    {
+        retval = -ENODEV;
+        goto error_unlock;
+    }
+    /* the broadcast stream owns the bulk IN pipe */
+    if (idx == WIXUSB_PIPE_BULK_IN && dev->bcast &&
+        !list_empty(&dev->bcast->readers))
+    {
+        retval = -EBUSY;
+        goto error_unlock;
+    }
+    retval = usb_autopm_get_interface(dev->interface);
+    if (retval)
+        goto error_unlock;
+
+    usb_fill_bulk_urb(x->urb, dev->usbdev, pipe->pipe, x->data, len,
+        wixusb_nb_complete, x);
+    x->urb->transfer_flags |= flags;
+    wixusb_park_init(&x->park, dev, x->urb, &wf->submitted[idx]);
+
+    /* armed first, the completion may come before the submit returns */
+    timeout = wixusb_policy(wf, pipe->addr)->timeout;
+    if (timeout)
+        queue_delayed_work(dev->wq, &x->timeout, msecs_to_jiffies(timeout));
+
+    usb_anchor_urb(x->urb, &wf->submitted[idx]);
+    set_bit(idx, &wf->nb_busy);
+    atomic_inc(&dev->in_flight);
+    retval = usb_submit_urb(x->urb, GFP_KERNEL);
+    if (retval)
+    {
+        usb_unanchor_urb(x->urb);
+        clear_bit(idx, &wf->nb_busy);
+        if (atomic_dec_and_test(&dev->in_flight))
+            wake_up_all(&dev->sched.wait);
+        cancel_delayed_work_sync(&x->timeout);
+        usb_autopm_put_interface(dev->interface);
+        goto error_unlock;
+    }
+    mutex_unlock(&dev->io_mutex);
+
+    *slot = x;
+    return 0;
+
+error_unlock:
+    mutex_unlock(&dev->io_mutex);
+error:
+    usb_free_urb(x->urb);
+    kfree(x->data);
+    kfree(x);
+    return retval;
+}
+
+/*
+ * read() of a non-blocking handle outside broadcast mode. The first call
+ * starts a transfer of its size and fails with EAGAIN, once it completed
+ * the data is read like a blocking read's. What does not fit is left for
+ * the next reads, but a framed record has to fit whole.
+ */
+static ssize_t
+wixusb_nb_read(struct wixusb_file *wf, struct iov_iter *to) {
+    struct usb_wixusb *dev = wf->dev;
+    size_t count = iov_iter_count(to);
+    size_t hdr_len = READ_ONCE(wf->framed) ? sizeof (wixusb_frame_hdr_t) : 0;
+    struct wixusb_nb_xfer *x;
+    size_t avail, copied;
+    ssize_t retval;
+    __u8 addr;
+
+    if (count <= hdr_len)
+        return -EINVAL;
+
+    retval = mutex_lock_interruptible(&wf->nb_mutex);
+    if (retval)
+        return retval;
+
+    x = wf->nb_in;
+    if (!x)
+    {
+        addr = dev->pipes[WIXUSB_PIPE_BULK_IN].addr;
+        retval = wixusb_shape(wf, addr, count - hdr_len);
+        if (retval)
+            goto exit;
+        retval = wixusb_nb_start(wf, WIXUSB_PIPE_BULK_IN, NULL,
+            count - hdr_len, 0, &wf->nb_in);
+        if (retval)
+            wixusb_shape_refund(wf, addr, count - hdr_len, 0);
+        else
+            retval = -EAGAIN;
+        goto exit;
+    }
+    if (!smp_load_acquire(&x->done))
+    {
+        retval = -EAGAIN;
+        goto exit;
+    }
+    if (x->status)
+    {
+        retval = x->status;
+        goto consumed;
+    }
+
+    avail = x->urb->actual_length - x->off;
+    if (hdr_len)
+    {
+        if (count < hdr_len + avail)
+        {
+            retval = -EMSGSIZE;
+            goto exit;
+        }
+        if (copy_to_iter(&x->hdr, hdr_len, to) != hdr_len)
+        {
+            retval = -EFAULT;
+            goto exit;
+        }
+    }
+    copied = copy_to_iter(x->data + x->off, min(avail, count - hdr_len), to);
+    if (avail && !copied)
+    {
+        retval = -EFAULT;
+        goto exit;
+    }
+    x->off += copied;
+    retval = hdr_len + copied;
+    if (x->off < x->urb->actual_length)
+        goto exit;
+
+consumed:
+    wf->nb_in = NULL;
+    wixusb_nb_free(x);
+exit:
+    mutex_unlock(&wf->nb_mutex);
+    return retval;
+}
+
+/*
+ * write() of a non-blocking handle: at most WIXUSB_BUFFSIZE bytes are
+ * taken and sent while the call returns. EAGAIN until the last write is
+ * off the bus, and a failure of the last write fails the next one.
+ */
+static ssize_t
+wixusb_nb_write(struct wixusb_file *wf, struct iov_iter *from) {
+    struct usb_wixusb *dev = wf->dev;
+    size_t count = min_t(size_t, iov_iter_count(from), WIXUSB_BUFFSIZE);
+    __u8 addr = dev->pipes[WIXUSB_PIPE_BULK_OUT].addr;
+    struct wixusb_nb_xfer *x;
+    unsigned int flags = 0;
+    ssize_t retval;
+
+    retval = mutex_lock_interruptible(&wf->nb_mutex);
+    if (retval)
+        return retval;
+
+    x = wf->nb_out;
+    if (x)
+    {
+        if (!smp_load_acquire(&x->done))
+        {
+            retval = -EAGAIN;
+            goto exit;
+        }
+        retval = x->status;
+        wf->nb_out = NULL;
+        wixusb_nb_free(x);
+        if (retval)
+            goto exit;
+    }
+
+    /* a write cut short is not the end of the message */
+    if (count == iov_iter_count(from) &&
+        wixusb_policy(wf, addr)->short_packet_terminate)
+        flags = URB_ZERO_PACKET;
+
+    retval = wixusb_shape(wf, addr, count);
+    if (retval)
+        goto exit;
+    retval = wixusb_nb_start(wf, WIXUSB_PIPE_BULK_OUT, from, count, flags,
+        &wf->nb_out);
+    if (retval)
+        wixusb_shape_refund(wf, addr, count, 0);
+    else
+        retval = count;
+exit:
+    mutex_unlock(&wf->nb_mutex);
+    return retval;
+}
+
+/*
+ * Pipe commands that must not wait for io_mutex held by a stuck transfer.
+ * They only touch the transfers of the calling handle.
+ */
+static long
+wixusb_pipe_ioctl(struct wixusb_file *wf, unsigned int cmd, unsigned long arg) {
+    int idx;
+
+    /* only io_uring control transfers can be aborted on the control pipe */
+    if (cmd == IOCTL_ABORT_PIPE && arg == 0)
+    {
+        usb_kill_anchored_urbs(&wf->ctrl_submitted);
+        return 0;
+    }
+
+    idx = wixusb_pipe_by_id(wf->dev, arg);
+    if (idx < 0)
+        return -EINVAL;
+
+    switch (cmd)
+    {
+        case IOCTL_ABORT_PIPE:
+            usb_kill_anchored_urbs(&wf->submitted[idx]);
+            wixusb_unpark_all(wf->dev, &wf->submitted[idx], -ENOENT, false);
+            return 0;
+        case IOCTL_FLUSH_PIPE:
+            if (!usb_pipein(wf->dev->pipes[idx].pipe))
+                return -EINVAL;
+            if (mutex_lock_interruptible(&wf->bcast_mutex))
+                return -ERESTARTSYS;
+            if (wf->bcast && idx == WIXUSB_PIPE_BULK_IN)
+            {
+                struct wixusb_bcast *bc = wf->dev->bcast;
+
+                /* drop what this handle has not read from the ring yet */
+                spin_lock_irq(&bc->lock);
+                wf->bcast_seq = bc->head;
+                wf->bcast_off = 0;
+                wixusb_bcast_fill(bc);
+                spin_unlock_irq(&bc->lock);
+            }
+            mutex_unlock(&wf->bcast_mutex);
+            /*
+             * Direct reads go straight to the caller's buffer, only a
+             * completed non-blocking read holds data. Transfers still on
+             * the bus are left alone, WinUsb_AbortPipe() cancels them.
+             */
+            mutex_lock(&wf->nb_mutex);
+            if (idx == WIXUSB_PIPE_BULK_IN && wf->nb_in &&
+                smp_load_acquire(&wf->nb_in->done))
+            {
+                wixusb_nb_free(wf->nb_in);
+                wf->nb_in = NULL;
+            }
+            mutex_unlock(&wf->nb_mutex);
+            return 0;
+        default:
+            return -ENOTTY;
+    }
+}
+
+/*
+ * read() and readv(), and splice() or sendfile() from the device with the
+ * pipe's pages as the destination. Each call is one bulk IN transfer.
+ */
+static ssize_t
+wixusb_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct file *file = iocb->ki_filp;
+    struct wixusb_file *wf;
+    struct usb_wixusb *dev;
+    size_t count = iov_iter_count(to);
+    int retval = 0;
+    int actual_length = count;
+    char *buf = NULL;
+    wixusb_frame_hdr_t hdr = {0};
+    size_t hdr_len, moved = 0;
+    bool nonblock;
+    ktime_t start;
+    __u8 addr;
+    int prio;
+
+    /* verify that we actually have some data to read */
+    if (count == 0)
+        goto exit;
+
+    wf = file->private_data;
+    dev = wf->dev;
+    nonblock = (file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+
+again:
+    retval = mutex_lock_interruptible(&wf->bcast_mutex);
+    if (retval < 0)
+        return retval;
+    if (wf->bcast)
+    {
+        retval = wixusb_bcast_read(wf, to, nonblock);
+        mutex_unlock(&wf->bcast_mutex);
+        /* the handle left broadcast mode while the read waited */
+        if (retval == -EAGAIN && !nonblock)
+            goto again;
+        return retval;
+    }
+    mutex_unlock(&wf->bcast_mutex);
+
+    if (nonblock)
+        return wixusb_nb_read(wf, to);
+
+    addr = dev->pipes[WIXUSB_PIPE_BULK_IN].addr;
+    retval = wixusb_shape(wf, addr, count);
+    if (retval < 0)
+        return retval;
+
+    prio = wixusb_prio(wf, WIXUSB_PRIO_BULK);
+    retval = wixusb_sched_enter(dev, WIXUSB_SCHED_IN, prio, &start);
+    if (retval < 0)
+    {
+        wixusb_shape_refund(wf, addr, count, 0);
+        return retval;
+    }
+
+    retval = mutex_lock_interruptible(&dev->io_mutex);
+    if (retval < 0)
+    {
+        wixusb_sched_exit(dev, WIXUSB_SCHED_IN, prio, start);
+        wixusb_shape_refund(wf, addr, count, 0);
+        return retval;
+    }
+
+    if (!dev->interface)
+    {
+        retval = -ENODEV;
+        goto error;
+    }
+
+    /* the broadcast stream owns the bulk IN pipe */
+    if (dev->bcast && !list_empty(&dev->bcast->readers))
+    {
+        retval = -EBUSY;
+        goto error;
+    }
+
+    /* the header is written in front of the payload */
+    hdr_len = READ_ONCE(wf->framed) ? sizeof (hdr) : 0;
+    if (count <= hdr_len)
+    {
+        retval = -EINVAL;
+        goto error;
+    }
+
+    buf = kmalloc(count - hdr_len, GFP_KERNEL);
+    if (!buf)
+    {
+        retval = -ENOMEM;
+        goto error;
+    }
+
+    retval = usb_autopm_get_interface(dev->interface);
+    if (retval)
+        goto error_free;
+
+    retval = wixusb_xfer(wf, WIXUSB_PIPE_BULK_IN, buf, count - hdr_len, 0,
+        &actual_length, hdr_len ? &hdr : NULL);
+    moved = actual_length;
+    /* a disconnect during the transfer took the PM count with it */
+    if (dev->interface)
+        usb_autopm_put_interface(dev->interface);
+
+    if (retval)
+    {
+        goto error_free;
+    }
+
+    if (copy_to_iter(&hdr, hdr_len, to) != hdr_len ||
+        copy_to_iter(buf, actual_length, to) != actual_length)
+    {
+        retval = -EFAULT;
+        goto error_free;
+    }
+    actual_length += hdr_len;
+
+    mutex_unlock(&dev->io_mutex);
+    wixusb_sched_exit(dev, WIXUSB_SCHED_IN, prio, start);
+    wixusb_shape_refund(wf, addr, count, moved);
+    kfree(buf);
+
+exit:
+    wixusb_log("wixusb_read : success (%d), received %d bytes", retval, actual_length);
+    return actual_length;
+
+error_free:
+    kfree(buf);
+error:
+    mutex_unlock(&dev->io_mutex);
+    wixusb_sched_exit(dev, WIXUSB_SCHED_IN, prio, start);
+    wixusb_shape_refund(wf, addr, count, moved);
+    wixusb_log("wixusb_read : fail (%d)", retval);
+    return retval;
+}
+
+/*
+ * write() and writev() are one bulk OUT transfer of at most WIXUSB_BUFFSIZE
+ * bytes. splice() and sendfile() hand over the pipe's pages, which are sent
+ * in WIXUSB_SPLICE_BUFFSIZE transfers and count as one write for the ZLP,
+ * sent under the SHORT_PACKET_TERMINATE policy.
+ */
+static ssize_t
+wixusb_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    int retval = 0;
+    struct wixusb_file *wf;
+    struct usb_wixusb *dev;
+    size_t count = iov_iter_count(from);
+    char *buf = NULL;
+    int actual_length;
+    size_t chunk, bufsize;
+    unsigned int flags;
+    ssize_t writed_size = 0;
+    ktime_t start;
+    __u8 addr;
+    int prio;
+
+    /* verify that we actually have some data to write */
+    if (count == 0)
+        goto exit;
+
+    wf = iocb->ki_filp->private_data;
+    dev = wf->dev;
+
+    if ((iocb->ki_filp->f_flags & O_NONBLOCK) ||
+        (iocb->ki_flags & IOCB_NOWAIT))
+        return wixusb_nb_write(wf, from);
+
+    addr = dev->pipes[WIXUSB_PIPE_BULK_OUT].addr;
+    retval = wixusb_shape(wf, addr, count);
+    if (retval < 0)
+        goto exit;
+
+    prio = wixusb_prio(wf, WIXUSB_PRIO_BULK);
+    retval = wixusb_sched_enter(dev, WIXUSB_SCHED_OUT, prio, &start);
+    if (retval < 0)
+    {
+        wixusb_shape_refund(wf, addr, count, 0);
+        goto exit;
+    }
+
+    /* io_mutex is left during the transfer, no other write may come between */
+    mutex_lock(&dev->write_mutex);
+    /* this lock makes sure we don't submit URBs to gone devices */
+    mutex_lock(&dev->io_mutex);
+    if (!dev->interface) /* disconnect() was called */
+    {
+        retval = -ENODEV;
+        goto error;
+    }
+
+    if (count > WIXUSB_BUFFSIZE && !iov_iter_is_bvec(from))
+    {
+        retval = -ENOMEM;
+        goto error;
+    }
+
+    /* the pages of a splice() go out in one URB, not one per page */
+    bufsize = WIXUSB_BUFFSIZE;
+    if (iov_iter_is_bvec(from))
+    {
+        bufsize = min_t(size_t, count, WIXUSB_SPLICE_BUFFSIZE);
+        buf = kmalloc(bufsize, GFP_KERNEL | __GFP_NOWARN);
+        if (!buf)
+            bufsize = WIXUSB_BUFFSIZE;
+    }
+    if (!buf)
+        buf = kmalloc(min_t(size_t, count, bufsize), GFP_KERNEL);
+    if (!buf)
+    {
+        retval = -ENOMEM;
+        goto error;
+    }
+
+    retval = usb_autopm_get_interface(dev->interface);
+    if (retval)
+        goto error_free;
+
+    while (writed_size < count)
+    {
+        chunk = min_t(size_t, count - writed_size, bufsize);
+        if (copy_from_iter(buf, chunk, from) != chunk)
+        {
+            retval = -EFAULT;
+            goto error_pm;
+        }
+
+        /* the HCD adds the ZLP after the last chunk if it ends on a packet */
+        flags = 0;
+        if (writed_size + chunk == count && wixusb_policy(wf,
+            dev->pipes[WIXUSB_PIPE_BULK_OUT].addr)->short_packet_terminate)
+            flags = URB_ZERO_PACKET;
+
+        retval = wixusb_xfer(wf, WIXUSB_PIPE_BULK_OUT, buf, chunk, flags,
+            &actual_length, NULL);
+        writed_size += actual_length;
+        if (retval)
+        {
+            /* what the device took of the pipe's data is consumed */
+            if (writed_size)
+                break;
+            goto error_pm;
+        }
+        if (actual_length < chunk)
+            break;
+    }
+    retval = 0;
+
+    if (dev->interface)
+        usb_autopm_put_interface(dev->interface);
+
+    mutex_unlock(&dev->io_mutex);
+    mutex_unlock(&dev->write_mutex);
+    wixusb_sched_exit(dev, WIXUSB_SCHED_OUT, prio, start);
+    wixusb_shape_refund(wf, addr, count, writed_size);
+    kfree(buf);
+    wixusb_log("wixusb_write : success (%zd)", writed_size);
+    return writed_size;
+
+error_pm:
+    if (dev->interface)
+        usb_autopm_put_interface(dev->interface);
+error_free:
+    kfree(buf);
+error:
+    mutex_unlock(&dev->io_mutex);
+    mutex_unlock(&dev->write_mutex);
+    wixusb_sched_exit(dev, WIXUSB_SCHED_OUT, prio, start);
+    wixusb_shape_refund(wf, addr, count, writed_size);
+exit:
+    wixusb_log("wixusb_write : nothing to read (%d)", retval);
+    return retval;
+}
+
+static void
+wixusb_delete(struct kref *kref) {
+    struct usb_wixusb *dev = to_wixusb_dev(kref);
+
+    usb_put_dev(dev->usbdev);
+
+    /* runs what completed before the disconnect, the ring is still there */
+    if (dev->wq)
+        destroy_workqueue(dev->wq);
+    if (dev->bcast)
+        wixusb_bcast_free(dev->bcast);
+    kfree(dev->info);
+    kfree(dev);
+}
+
+static int
+wixusb_release(struct inode *inode, struct file *file) {
+    int retval = 0;
+    struct wixusb_file *wf;
+    struct usb_wixusb *dev;
+
+    wf = file->private_data;
+    if (wf == NULL)
+        return -ENODEV;
+    dev = wf->dev;
+
+    mutex_lock(&wf->bcast_mutex);
+    if (wf->bcast)
+    {
+        mutex_lock(&dev->io_mutex);
+        wixusb_bcast_leave(wf);
+        mutex_unlock(&dev->io_mutex);
+    }
+    mutex_unlock(&wf->bcast_mutex);
+
+    mutex_lock(&wf->nb_mutex);
+    if (wf->nb_in)
+        wixusb_nb_free(wf->nb_in);
+    if (wf->nb_out)
+        wixusb_nb_free(wf->nb_out);
+    mutex_unlock(&wf->nb_mutex);
+
+    mutex_lock(&dev->io_mutex);
+    if (wf->pm_hold && dev->interface)
+        usb_autopm_put_interface(dev->interface);
+    mutex_unlock(&dev->io_mutex);
+
+    mutex_lock(&dev->files_lock);
+    list_del(&wf->node);
+    mutex_unlock(&dev->files_lock);
+    atomic_dec(&dev->open_counter);
+    kfree(wf);
+
+    kref_put(&dev->kref, wixusb_delete);
+
+    wixusb_log("wixusb_release : (%d)", retval);
+    return retval;
+}
+
+/* close() waits for a non-blocking write still on the bus, see release */
+static int
+wixusb_flush(struct file *file, fl_owner_t id) {
+    struct wixusb_file *wf = file->private_data;
+
+    return wait_event_interruptible(wf->dev->wait,
+        !test_bit(WIXUSB_PIPE_BULK_OUT, &wf->nb_busy));
+}
+
+long
+wixusb_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    long retval = 0;
+    struct wixusb_file *wf;
+    struct usb_wixusb *dev;
+    char * buff = NULL;
+    bool pm_held;
+    ktime_t start;
+    int prio;
+    __u8 int_addr = 0;
+    size_t int_charged = 0, int_moved = 0; /* IOCTL_WRITE_INT shaping */
+
+    wf = file->private_data;
+    dev = wf->dev;
+
+    if ((_IOC_TYPE(cmd) != WIXUSB_IOC_MAGIC))
+    {
+        wixusb_log("wixusb_ioctl : wrong MAGIC (%u)", _IOC_NR(cmd));
+        return -ENOTTY;
+    }
+
+    if (cmd == IOCTL_ABORT_PIPE || cmd == IOCTL_FLUSH_PIPE)
+    {
+        retval = wixusb_pipe_ioctl(wf, cmd, arg);
+        wixusb_log("wixusb_ioctl : pipe %lu ioctl %u (%ld)", arg, _IOC_NR(cmd), retval);
+        return retval;
+    }
+
+    if (wixusb_is_status_ioctl(cmd))
+        return wixusb_status_ioctl(wf, cmd, arg);
+
+    /* the table does not change after probe */
+    if (cmd == IOCTL_GET_IFACE_INFO)
+    {
+        if (copy_to_user((void *) arg, dev->info, sizeof (*dev->info)))
+            return -EFAULT;
+        return 0;
+    }
+
+    if (cmd == IOCTL_GET_CONFIG_DESC)
+        return wixusb_config_desc(dev, arg);
+
+    if (cmd == IOCTL_SET_FRAMED)
+    {
+        /*
+         * A broadcast read of this handle copies under bcast_mutex, but
+         * does not hold it while it waits for data.
+         */
+        if (mutex_lock_interruptible(&wf->bcast_mutex))
+            return -ERESTARTSYS;
+        WRITE_ONCE(wf->framed, arg != 0);
+        mutex_unlock(&wf->bcast_mutex);
+        wixusb_log("wixusb_ioctl : framed read %s", arg ? "on" : "off");
+        return 0;
+    }
+
+    if (cmd == IOCTL_SET_BCAST)
+    {
+        retval = wixusb_bcast_ioctl(wf, arg);
+        wixusb_log("wixusb_ioctl : broadcast (%ld)", retval);
+        return retval;
+    }
+
+    if (cmd == IOCTL_STREAM_XFER)
+        return wixusb_stream_xfer(wf, arg);
+
+    if (cmd == IOCTL_GET_ASSOC_IFACE)
+        return wixusb_assoc_iface(wf, arg);
+
+    if (cmd == IOCTL_SET_PRIORITY || cmd == IOCTL_SET_PRIO_LIMIT ||
+        cmd == IOCTL_GET_PRIO_STATS)
+        return wixusb_prio_ioctl(wf, cmd, arg);
+
+    if (cmd == IOCTL_WRITE_INT)
+    {
+        char len;
+
+        if (get_user(len, &((wixusb_intrpt_packet __user *) arg)->length))
+            return -EFAULT;
+        int_addr = dev->pipes[WIXUSB_PIPE_INT_OUT].addr;
+        retval = wixusb_shape(wf, int_addr, (unsigned char) len);
+        if (retval)
+            return retval;
+        int_charged = (unsigned char) len;
+    }
+
+    prio = wixusb_ioctl_prio(wf, cmd);
+    if (prio >= 0)
+    {
+        retval = wixusb_sched_enter(dev, WIXUSB_SCHED_OUT, prio, &start);
+        if (retval)
+        {
+            wixusb_shape_refund(wf, int_addr, int_charged, 0);
+            return retval;
+        }
+    }
+
+    mutex_lock(&dev->io_mutex);
+
+    if (!dev->interface)
+    {
+        retval = -ENODEV;
+        goto error_no_dev;
+    }
+
+    pm_held = wixusb_ioctl_needs_bus(cmd);
+    if (pm_held)
+    {
+        retval = usb_autopm_get_interface(dev->interface);
+        if (retval)
+            goto error_no_dev;
+    }
+    wixusb_log("wixusb_ioctl : enter with %u", _IOC_NR(cmd));
+    switch (cmd)
+    {
+        case IOCTL_SEND_CTRL:
+        {
+            wixusb_ctrl_packet_t * ctrl_packet;
 
             buff = kmalloc(sizeof (wixusb_ctrl_packet_t), GFP_KERNEL);
             if (!buff)
@@ -351,10 +2813,13 @@ wixusb_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
             }
 
             ctrl_packet = (wixusb_ctrl_packet_t *) buff;
+            wixusb_bus_begin(dev);
             retval = usb_control_msg(dev->usbdev, usb_sndctrlpipe(dev->usbdev, 0),
                 ctrl_packet->winusb_packet.Request, ctrl_packet->winusb_packet.RequestType,
                 ctrl_packet->winusb_packet.Value, ctrl_packet->winusb_packet.Index,
-                ctrl_packet->data, ctrl_packet->winusb_packet.Length, dev->timeout);
+                ctrl_packet->data, ctrl_packet->winusb_packet.Length,
+                wixusb_policy(wf, 0)->timeout);
+            wixusb_bus_end(dev);
             break;
         }
         case IOCTL_RECV_CTRL:
@@ -375,10 +2840,13 @@ wixusb_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
             }
 
             ctrl_packet = (wixusb_ctrl_packet_t *) buff;
+            wixusb_bus_begin(dev);
             retval = usb_control_msg(dev->usbdev, usb_sndctrlpipe(dev->usbdev, 0),
                 ctrl_packet->winusb_packet.Request, ctrl_packet->winusb_packet.RequestType,
                 ctrl_packet->winusb_packet.Value, ctrl_packet->winusb_packet.Index,
-                ctrl_packet->data, ctrl_packet->winusb_packet.Length, dev->timeout);
+                ctrl_packet->data, ctrl_packet->winusb_packet.Length,
+                wixusb_policy(wf, 0)->timeout);
+            wixusb_bus_end(dev);
             if (retval < 0)
                 break;
 
@@ -389,6 +2857,11 @@ wixusb_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
             }
             break;
         }
+        case IOCTL_CTRL_XFER:
+        {
+            retval = wixusb_ctrl_xfer(wf, arg);
+            break;
+        }
         case IOCTL_GET_DESC:
         {
             wixusb_get_desc_t * desc;
@@ -407,7 +2880,9 @@ wixusb_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
             }
 
             desc = (wixusb_get_desc_t *) buff;
+            wixusb_bus_begin(dev);
             retval = usb_get_descriptor(dev->usbdev, desc->desc_type, desc->desc_idx, desc->data, DESC_BUFF_LENGTH);
+            wixusb_bus_end(dev);
             if (retval < 0)
                 break;
             if (copy_to_user(((wixusb_get_desc_t *) arg)->data, desc->data, retval))
@@ -435,61 +2910,231 @@ wixusb_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
             }
 
             policy = (wixusb_set_pipe_policy_t*) buff;
+            if (policy->pipe_id && wixusb_pipe_by_id(dev, policy->pipe_id) < 0)
+            {
+                retval = -EINVAL;
+                break;
+            }
             switch (policy->policy_type)
             {
                 case SHORT_PACKET_TERMINATE:
+                    wixusb_policy(wf, policy->pipe_id)->short_packet_terminate = !!policy->policy_value;
+                    retval = 0;
+                    break;
+                case AUTO_CLEAR_STALL:
+                    wixusb_policy(wf, policy->pipe_id)->auto_clear_stall = !!policy->policy_value;
                     retval = 0;
                     break;
                 case PIPE_TRANSFER_TIMEOUT:
-                    dev->timeout = policy->policy_value;
+                    wixusb_policy(wf, policy->pipe_id)->timeout = policy->policy_value;
                     retval = 0;
                     break;
+                case PIPE_RATE_LIMIT:
+                case PIPE_BURST_SIZE:
+                {
+                    struct wixusb_pipe_policy *pp = wixusb_policy(wf, policy->pipe_id);
+
+                    /* control transfers are not shaped */
+                    if (!policy->pipe_id)
+                    {
+                        retval = -EINVAL;
+                        break;
+                    }
+                    spin_lock(&wf->shape_lock);
+                    if (policy->policy_type == PIPE_RATE_LIMIT)
+                        pp->rate = policy->policy_value;
+                    else
+                        pp->burst = policy->policy_value;
+                    /* start again with a full bucket */
+                    pp->tat = 0;
+                    spin_unlock(&wf->shape_lock);
+                    retval = 0;
+                    break;
+                }
+                default:
+                    retval = -EINVAL;
+                    break;
+            }
+            break;
+        }
+        case IOCTL_GET_PIPE_POL:
+        {
+            wixusb_set_pipe_policy_t * policy;
+            struct wixusb_pipe_policy * pp;
+
+            buff = kmalloc(sizeof (wixusb_set_pipe_policy_t), GFP_KERNEL);
+            if (!buff)
+            {
+                retval = -ENOMEM;
+                break;
+            }
+
+            if (copy_from_user(buff, (void*) arg, sizeof (wixusb_set_pipe_policy_t)))
+            {
+                retval = -EFAULT;
+                break;
+            }
+
+            policy = (wixusb_set_pipe_policy_t*) buff;
+            if (policy->pipe_id && wixusb_pipe_by_id(dev, policy->pipe_id) < 0)
+            {
+                retval = -EINVAL;
+                break;
+            }
+            pp = wixusb_policy(wf, policy->pipe_id);
+            retval = 0;
+            switch (policy->policy_type)
+            {
+                case SHORT_PACKET_TERMINATE:
+                    policy->policy_value = pp->short_packet_terminate;
+                    break;
+                case AUTO_CLEAR_STALL:
+                    policy->policy_value = pp->auto_clear_stall;
+                    break;
+                case PIPE_TRANSFER_TIMEOUT:
+                    policy->policy_value = pp->timeout;
+                    break;
+                case PIPE_RATE_LIMIT:
+                    spin_lock(&wf->shape_lock);
+                    policy->policy_value = pp->rate;
+                    spin_unlock(&wf->shape_lock);
+                    break;
+                case PIPE_BURST_SIZE:
+                    spin_lock(&wf->shape_lock);
+                    policy->policy_value = pp->burst;
+                    spin_unlock(&wf->shape_lock);
+                    break;
                 default:
                     retval = -EINVAL;
                     break;
             }
+            if (!retval && copy_to_user((void*) arg, policy, sizeof (wixusb_set_pipe_policy_t)))
+                retval = -EFAULT;
+            break;
+        }
+        case IOCTL_WRITE_INT:
+        {
+            int actual_length;
+            wixusb_intrpt_packet * intrpt_packet;
+
+            buff = kmalloc(sizeof (wixusb_intrpt_packet), GFP_KERNEL);
+            if (!buff)
+            {
+                retval = -ENOMEM;
+                break;
+            }
+
+            if (copy_from_user(buff, (void*) arg, sizeof (wixusb_intrpt_packet)))
+            {
+                retval = -EFAULT;
+                break;
+            }
+            intrpt_packet = (wixusb_intrpt_packet*) buff;
+            retval = wixusb_xfer(wf, WIXUSB_PIPE_INT_OUT,
+                intrpt_packet->data, intrpt_packet->length, 0,
+                &actual_length, NULL);
+            int_moved = actual_length;
             break;
         }
-        case IOCTL_GET_VID_PID:
+        case IOCTL_RESET_PIPE:
         {
-            wixusb_vid_pid_t vidpid = {
-                .pid = dev->idProduct,
-                .vid = VENDOR_ID
-            };
+            int idx = wixusb_pipe_by_id(dev, arg);
+            struct wixusb_bcast *bc = dev->bcast;
 
-            if (copy_to_user(((void *) arg), &vidpid, sizeof (vidpid)))
+            if (idx < 0)
             {
-                retval = -EFAULT;
+                retval = -EINVAL;
                 break;
             }
+            if (idx != WIXUSB_PIPE_BULK_IN)
+                bc = NULL;
+
+            /* the broadcast stream is parked as for an alternate setting */
+            if (bc)
+            {
+                spin_lock_irq(&bc->lock);
+                bc->switching = true;
+                spin_unlock_irq(&bc->lock);
+                usb_kill_anchored_urbs(&bc->submitted);
+            }
+
+            /* clears the halt feature and resets the data toggle */
+            wixusb_quiesce(dev, BIT(idx));
+            retval = usb_clear_halt(dev->usbdev, dev->pipes[idx].pipe);
+
+            if (bc)
+            {
+                spin_lock_irq(&bc->lock);
+                bc->switching = false;
+                wixusb_bcast_fill(bc);
+                spin_unlock_irq(&bc->lock);
+            }
             break;
         }
-        case IOCTL_IS_CONNECTED:
+        case IOCTL_SET_ALT:
         {
-            retval = 0;
+            retval = wixusb_set_alt(dev, arg);
             break;
         }
-        case IOCTL_WRITE_INT:
+        case IOCTL_ALLOC_STREAMS:
         {
-            int actual_length;
-            wixusb_intrpt_packet * intrpt_packet;
+            retval = wixusb_alloc_streams(dev, arg);
+            break;
+        }
+        case IOCTL_GET_STATS:
+        {
+            wixusb_stats_t stats = {
+                .transfers = atomic64_read(&wf->stats.transfers),
+                .bytes_in = atomic64_read(&wf->stats.bytes_in),
+                .bytes_out = atomic64_read(&wf->stats.bytes_out),
+                .errors = atomic64_read(&wf->stats.errors),
+                .timeouts = atomic64_read(&wf->stats.timeouts),
+                .dropped = atomic64_read(&wf->stats.dropped),
+                .throttled = atomic64_read(&wf->stats.throttled),
+                .throttled_bytes = atomic64_read(&wf->stats.throttled_bytes),
+                .throttle_ns = atomic64_read(&wf->stats.throttle_ns),
+            };
 
-            buff = kmalloc(sizeof (wixusb_intrpt_packet), GFP_KERNEL);
-            if (!buff)
+            if (copy_to_user((void*) arg, &stats, sizeof (stats)))
+                retval = -EFAULT;
+            break;
+        }
+        case IOCTL_SET_POWER_POL:
+        case IOCTL_GET_POWER_POL:
+        {
+            wixusb_power_policy_t policy;
+
+            if (copy_from_user(&policy, (void*) arg, sizeof (policy)))
             {
-                retval = -ENOMEM;
+                retval = -EFAULT;
                 break;
             }
 
-            if (copy_from_user(buff, (void*) arg, sizeof (wixusb_intrpt_packet)))
+            if (cmd == IOCTL_SET_POWER_POL)
             {
-                retval = -EFAULT;
+                retval = wixusb_set_power_policy(wf, &policy);
                 break;
             }
-            intrpt_packet = (wixusb_intrpt_packet*) buff;
-            retval = usb_interrupt_msg(dev->usbdev,
-                PIPE_INT_OUT(dev->usbdev), intrpt_packet->data, intrpt_packet->length,
-                &actual_length, dev->timeout);
+
+            retval = wixusb_get_power_policy(wf, &policy);
+            if (retval < 0)
+                break;
+            if (copy_to_user((void*) arg, &policy, sizeof (policy)))
+                retval = -EFAULT;
+            break;
+        }
+        case IOCTL_PREWARM:
+        {
+            /*
+             * Resume ahead of a burst. Dropping the reference right away
+             * restarts the idle timer, so the link stays up for the
+             * suspend delay.
+             */
+            retval = usb_autopm_get_interface(dev->interface);
+            if (retval)
+                break;
+            usb_mark_last_busy(dev->usbdev);
+            usb_autopm_put_interface(dev->interface);
             break;
         }
         default:
@@ -497,7 +3142,13 @@ wixusb_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
             break;
     }
 
+    /* transfers leave io_mutex, a disconnect may have come in between */
+    if (pm_held && dev->interface)
+        usb_autopm_put_interface(dev->interface);
     mutex_unlock(&dev->io_mutex);
+    if (prio >= 0)
+        wixusb_sched_exit(dev, WIXUSB_SCHED_OUT, prio, start);
+    wixusb_shape_refund(wf, int_addr, int_charged, int_moved);
 
     if (buff != NULL)
         kfree(buff);
@@ -507,20 +3158,414 @@ wixusb_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
     return retval;
 error_no_dev:
     mutex_unlock(&dev->io_mutex);
+    if (prio >= 0)
+        wixusb_sched_exit(dev, WIXUSB_SCHED_OUT, prio, start);
+    wixusb_shape_refund(wf, int_addr, int_charged, 0);
     wixusb_log("wixusb_ioctl : no dev ioctl %d", _IOC_NR(cmd));
     return retval;
 }
 
+#ifdef WIXUSB_URING_CMD
+
+/*
+ * io_uring passthrough of the control and interrupt commands: the ioctl
+ * number is the cmd_op and the ioctl's argument pointer is in the SQE, see
+ * wixusb_uring_cmd_t. The URB is submitted at issue and completes as a CQE
+ * with what the ioctl would have returned; no thread waits for it. These
+ * transfers bypass the priority classes. They are unlinked when the pipe's
+ * timeout expires, cancelled with WinUsb_AbortPipe() or with the request
+ * from 6.7, and failed on disconnect.
+ */
+struct wixusb_uring_xfer {
+    struct wixusb_file *wf;
+    struct io_uring_cmd *ioucmd;
+    struct urb *urb;
+    struct usb_ctrlrequest setup;
+    bool ctrl;
+    u8 *data;
+    void __user *udata; /* where the IN data stage goes */
+    struct delayed_work timeout;
+    bool timed_out;
+    bool cancelled;
+    struct wixusb_park park;
+};
+
+static const wixusb_uring_cmd_t *
+wixusb_uring_cmd_area(struct io_uring_cmd *ioucmd) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0))
+    return io_uring_sqe_cmd(ioucmd->sqe);
+#else
+    return ioucmd->cmd;
+#endif
+}
+
+static void
+wixusb_uring_timeout(struct work_struct *work) {
+    struct wixusb_uring_xfer *x = container_of(to_delayed_work(work),
+        struct wixusb_uring_xfer, timeout);
+
+    WRITE_ONCE(x->timed_out, true);
+    if (wixusb_unpark(&x->park))
+        wixusb_park_complete(&x->park, -ECONNRESET);
+    else
+        usb_unlink_urb(x->urb);
+}
+
+static void
+wixusb_uring_free(struct wixusb_uring_xfer *x) {
+    cancel_delayed_work_sync(&x->timeout);
+    usb_free_urb(x->urb);
+    kfree(x->data);
+    kfree(x);
+}
+
+static void
+wixusb_uring_cmd_done(struct io_uring_cmd *ioucmd, long retval,
+    unsigned int issue_flags) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0))
+    io_uring_cmd_done(ioucmd, retval, 0, issue_flags);
+#else
+    io_uring_cmd_done(ioucmd, retval, 0);
+#endif
+}
+
+/* Task context of the submitter, the data stage can be copied out */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0))
+static void
+wixusb_uring_done(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+#else
+static void
+wixusb_uring_done(struct io_uring_cmd *ioucmd) {
+    unsigned int issue_flags = 0;
+#endif
+    struct wixusb_uring_xfer *x = *(struct wixusb_uring_xfer **) ioucmd->pdu;
+    struct wixusb_file *wf = x->wf;
+    struct usb_wixusb *dev = wf->dev;
+    struct urb *urb = x->urb;
+    long retval = urb->status;
+
+    if (retval == -ECONNRESET && READ_ONCE(x->timed_out))
+        retval = -ETIMEDOUT;
+    else if (retval == -ECONNRESET && READ_ONCE(x->cancelled))
+        retval = -ECANCELED;
+    else if (!retval)
+        retval = x->ctrl ? urb->actual_length : 0;
+    if (retval > 0 && x->udata && copy_to_user(x->udata, x->data, retval))
+        retval = -EFAULT;
+
+    /* the PM count went with the interface if it was unplugged meanwhile */
+    mutex_lock(&dev->io_mutex);
+    if (dev->interface)
+        usb_autopm_put_interface(dev->interface);
+    atomic64_inc(&wf->stats.transfers);
+    if (retval == -ETIMEDOUT)
+        atomic64_inc(&wf->stats.timeouts);
+    else if (retval < 0)
+        atomic64_inc(&wf->stats.errors);
+    else if (x->udata)
+        atomic64_add(urb->actual_length, &wf->stats.bytes_in);
+    else
+        atomic64_add(urb->actual_length, &wf->stats.bytes_out);
+    mutex_unlock(&dev->io_mutex);
+
+    /* done first, a cancel may look at x until the request is gone */
+    wixusb_uring_cmd_done(ioucmd, retval, issue_flags);
+    wixusb_uring_free(x);
+}
+
+static void
+wixusb_uring_complete(struct urb *urb) {
+    struct wixusb_uring_xfer *x = urb->context;
+    struct usb_wixusb *dev = x->wf->dev;
+
+    if (wixusb_park(&x->park))
+        return;
+    cancel_delayed_work(&x->timeout);
+    /* off the bus now, a disconnect need not wait for the task work */
+    if (atomic_dec_and_test(&dev->in_flight))
+        wake_up_all(&dev->sched.wait);
+    io_uring_cmd_complete_in_task(x->ioucmd, wixusb_uring_done);
+}
+
+/* Reads the ioctl argument into x, as the ioctl itself would */
+static int
+wixusb_uring_prep(struct wixusb_uring_xfer *x, u32 cmd_op, void __user *uarg,
+    unsigned int *len) {
+    WINUSB_SETUP_PACKET setup;
+    wixusb_ctrl_xfer_t xfer;
+    void __user *udata;
+    char length;
+
+    switch (cmd_op)
+    {
+        case IOCTL_CTRL_XFER:
+        {
+            if (copy_from_user(&xfer, uarg, sizeof (xfer)))
+                return -EFAULT;
+            setup = xfer.winusb_packet;
+            udata = (void __user *) (uintptr_t) xfer.data;
+            break;
+        }
+        case IOCTL_SEND_CTRL:
+        case IOCTL_RECV_CTRL:
+        {
+            if (copy_from_user(&setup, uarg, sizeof (setup)))
+                return -EFAULT;
+            if (setup.Length > CTRL_BUFF_LENGTH)
+                return -EINVAL;
+            udata = ((wixusb_ctrl_packet_t __user *) uarg)->data;
+            break;
+        }
+        case IOCTL_WRITE_INT:
+        {
+            if (get_user(length, &((wixusb_intrpt_packet __user *) uarg)->length))
+                return -EFAULT;
+            *len = (unsigned char) length;
+            if (*len > EP_SIZE)
+                return -EINVAL;
+            x->data = kmalloc(EP_SIZE, GFP_KERNEL);
+            if (!x->data)
+                return -ENOMEM;
+            if (copy_from_user(x->data,
+                ((wixusb_intrpt_packet __user *) uarg)->data, *len))
+                return -EFAULT;
+            return 0;
+        }
+        default:
+            return -ENOTTY;
+    }
+
+    x->ctrl = true;
+    x->setup.bRequestType = setup.RequestType;
+    x->setup.bRequest = setup.Request;
+    x->setup.wValue = cpu_to_le16(setup.Value);
+    x->setup.wIndex = cpu_to_le16(setup.Index);
+    x->setup.wLength = cpu_to_le16(setup.Length);
+    *len = setup.Length;
+
+    x->data = kmalloc(max_t(unsigned int, *len, 1), GFP_KERNEL | __GFP_NOWARN);
+    if (!x->data)
+        return -ENOMEM;
+    if (SETUP_PACKET_IS_INPUT(setup.RequestType))
+        x->udata = udata;
+    else if (*len && copy_from_user(x->data, udata, *len))
+        return -EFAULT;
+    return 0;
+}
+
+static int
+wixusb_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    struct wixusb_file *wf = ioucmd->file->private_data;
+    struct usb_wixusb *dev = wf->dev;
+    const wixusb_uring_cmd_t *cmd = wixusb_uring_cmd_area(ioucmd);
+    void __user *uarg = (void __user *) (uintptr_t) READ_ONCE(cmd->arg);
+    bool nonblock = issue_flags & IO_URING_F_NONBLOCK;
+    struct wixusb_uring_xfer *x;
+    struct usb_host_endpoint *ep;
+    struct wixusb_pipe *pipe;
+    unsigned int len = 0, timeout;
+    int retval;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0))
+    /* the ring is going away or the request was cancelled */
+    if (issue_flags & IO_URING_F_CANCEL)
+    {
+        x = *(struct wixusb_uring_xfer **) ioucmd->pdu;
+        WRITE_ONCE(x->cancelled, true);
+        if (wixusb_unpark(&x->park))
+            wixusb_park_complete(&x->park, -ECONNRESET);
+        else
+            usb_unlink_urb(x->urb);
+        return 0;
+    }
+#endif
+
+    x = kzalloc(sizeof (*x), GFP_KERNEL);
+    if (!x)
+        return -ENOMEM;
+    x->wf = wf;
+    x->ioucmd = ioucmd;
+    INIT_DELAYED_WORK(&x->timeout, wixusb_uring_timeout);
+
+    retval = wixusb_uring_prep(x, ioucmd->cmd_op, uarg, &len);
+    if (retval)
+        goto error;
+
+    x->urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (!x->urb)
+    {
+        retval = -ENOMEM;
+        goto error;
+    }
+
+    /* anything that sleeps is left to the io_uring worker */
+    if (!x->ctrl)
+    {
+        pipe = &dev->pipes[WIXUSB_PIPE_INT_OUT];
+        if (nonblock && wixusb_policy(wf, pipe->addr)->rate)
+        {
+            retval = -EAGAIN;
+            goto error;
+        }
+        retval = wixusb_shape(wf, pipe->addr, len);
+        if (retval)
+            goto error;
+    }
+
+    if (nonblock)
+    {
+        if (!mutex_trylock(&dev->io_mutex))
+        {
+            retval = -EAGAIN;
+            goto error;
+        }
+    }
+    else
+    {
+        mutex_lock(&dev->io_mutex);
+    }
+
+    if (!dev->interface)
+    {
+        retval = -ENODEV;
+        goto error_unlock;
+    }
+
+    if (nonblock)
+    {
+        usb_autopm_get_interface_no_resume(dev->interface);
+        if (!pm_runtime_active(&dev->interface->dev))
+        {
+            usb_autopm_put_interface_no_suspend(dev->interface);
+            retval = -EAGAIN;
+            goto error_unlock;
+        }
+    }
+    else
+    {
+        retval = usb_autopm_get_interface(dev->interface);
+        if (retval)
+            goto error_unlock;
+    }
+
+    if (x->ctrl)
+    {
+        usb_fill_control_urb(x->urb, dev->usbdev,
+            x->udata ? usb_rcvctrlpipe(dev->usbdev, 0) :
+            usb_sndctrlpipe(dev->usbdev, 0),
+            (unsigned char *) &x->setup, x->data, len,
+            wixusb_uring_complete, x);
+        /*
+         * Never parked: the setup stage may have reached the device, a
+         * resubmission would run the request twice.
+         */
+        wixusb_park_init(&x->park, dev, x->urb, NULL);
+        usb_anchor_urb(x->urb, &wf->ctrl_submitted);
+    }
+    else
+    {
+        pipe = &dev->pipes[WIXUSB_PIPE_INT_OUT];
+        ep = pipe->addr ? usb_pipe_endpoint(dev->usbdev, pipe->pipe) : NULL;
+        if (!ep)
+        {
+            retval = -ENODEV;
+            goto error_pm;
+        }
+        usb_fill_int_urb(x->urb, dev->usbdev, pipe->pipe, x->data, len,
+            wixusb_uring_complete, x, ep->desc.bInterval);
+        wixusb_park_init(&x->park, dev, x->urb,
+            &wf->submitted[WIXUSB_PIPE_INT_OUT]);
+        usb_anchor_urb(x->urb, &wf->submitted[WIXUSB_PIPE_INT_OUT]);
+    }
+
+    /* armed first, the completion may come before the submit returns */
+    timeout = wixusb_policy(wf, x->ctrl ? 0 : pipe->addr)->timeout;
+    if (timeout)
+        queue_delayed_work(dev->wq, &x->timeout, msecs_to_jiffies(timeout));
+
+    *(struct wixusb_uring_xfer **) ioucmd->pdu = x;
+    atomic_inc(&dev->in_flight);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0))
+    /* before the submit, the completion may come first */
+    io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+#endif
+    retval = usb_submit_urb(x->urb, GFP_KERNEL);
+    if (retval)
+    {
+        usb_unanchor_urb(x->urb);
+        if (atomic_dec_and_test(&dev->in_flight))
+            wake_up_all(&dev->sched.wait);
+        usb_autopm_put_interface(dev->interface);
+        mutex_unlock(&dev->io_mutex);
+        /* only done takes a cancelable request off the ring's list */
+        wixusb_uring_cmd_done(ioucmd, retval, issue_flags);
+        wixusb_uring_free(x);
+        return -EIOCBQUEUED;
+    }
+    mutex_unlock(&dev->io_mutex);
+    return -EIOCBQUEUED;
+
+error_pm:
+    usb_autopm_put_interface(dev->interface);
+error_unlock:
+    mutex_unlock(&dev->io_mutex);
+error:
+    wixusb_uring_free(x);
+    return retval;
+}
+
+#endif /* WIXUSB_URING_CMD */
+
+/*
+ * Outside broadcast mode a direction is ready unless the handle's
+ * non-blocking transfer is still on the bus, a read with none started
+ * starts one. A disconnect is reported as a hangup.
+ */
+static __poll_t
+wixusb_poll(struct file *file, poll_table *wait) {
+    struct wixusb_file *wf = file->private_data;
+    struct usb_wixusb *dev = wf->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(file, &dev->wait, wait);
+
+    if (!READ_ONCE(dev->interface))
+        return EPOLLHUP | EPOLLERR;
+
+    if (READ_ONCE(wf->bcast))
+    {
+        if (wixusb_bcast_pending(dev, wf))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        return mask;
+    }
+
+    if (!test_bit(WIXUSB_PIPE_BULK_IN, &wf->nb_busy))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (test_bit(WIXUSB_PIPE_BULK_OUT, &wf->nb_busy))
+        mask &= ~(EPOLLOUT | EPOLLWRNORM);
+    return mask;
+}
+
 static const struct file_operations wixusb_fops = {
     .owner = THIS_MODULE,
-    .read = wixusb_read,
-    .write = wixusb_write,
+    .read_iter = wixusb_read_iter,
+    .write_iter = wixusb_write_iter,
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0))
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
+    .poll = wixusb_poll,
     .open = wixusb_open,
     .release = wixusb_release,
     .flush = wixusb_flush,
     .llseek = noop_llseek,
     .unlocked_ioctl = wixusb_ioctl,
     .compat_ioctl = wixusb_ioctl,
+#ifdef WIXUSB_URING_CMD
+    .uring_cmd = wixusb_uring_cmd,
+#endif
 };
 
 static struct usb_class_driver wixusb_class_driver = {
@@ -529,10 +3574,71 @@ static struct usb_class_driver wixusb_class_driver = {
     .minor_base = USB_SKEL_MINOR_BASE,
 };
 
+static u32
+wixusb_speed(enum usb_device_speed speed) {
+    switch (speed)
+    {
+        case USB_SPEED_LOW:
+            return LowSpeed;
+        case USB_SPEED_FULL:
+            return FullSpeed;
+        case USB_SPEED_HIGH:
+            return HighSpeed;
+        case USB_SPEED_UNKNOWN:
+            return 0;
+        default:
+            return SuperSpeed;
+    }
+}
+
+/* Table of all alternate settings for IOCTL_GET_IFACE_INFO */
+static wixusb_iface_info_t *
+wixusb_build_info(struct usb_device *usbdev, struct usb_interface *interface) {
+    wixusb_iface_info_t *info;
+    unsigned int i, j;
+
+    info = kzalloc(sizeof (*info), GFP_KERNEL);
+    if (!info)
+        return NULL;
+
+    info->speed = wixusb_speed(usbdev->speed);
+    info->num_alts = min_t(unsigned int, interface->num_altsetting,
+        WIXUSB_MAX_ALTSETTINGS);
+    for (i = 0; i < info->num_alts; i++)
+    {
+        struct usb_host_interface *alt = &interface->altsetting[i];
+        wixusb_alt_info_t *ai = &info->alts[i];
+
+        memcpy(&ai->desc, &alt->desc, sizeof (ai->desc));
+        ai->num_pipes = min_t(unsigned int, alt->desc.bNumEndpoints,
+            WIXUSB_MAX_PIPES);
+        for (j = 0; j < ai->num_pipes; j++)
+        {
+            struct usb_host_endpoint *ep = &alt->endpoint[j];
+            wixusb_pipe_info_t *pi = &ai->pipes[j];
+
+            pi->address = ep->desc.bEndpointAddress;
+            pi->type = usb_endpoint_type(&ep->desc);
+            pi->max_packet = usb_endpoint_maxp(&ep->desc);
+            pi->interval = ep->desc.bInterval;
+            if (usb_endpoint_xfer_int(&ep->desc) ||
+                usb_endpoint_xfer_isoc(&ep->desc))
+            {
+                if (usbdev->speed >= USB_SPEED_SUPER)
+                    pi->bytes_per_interval =
+                        le16_to_cpu(ep->ss_ep_comp.wBytesPerInterval);
+                else
+                    pi->bytes_per_interval = pi->max_packet *
+                        usb_endpoint_maxp_mult(&ep->desc);
+            }
+        }
+    }
+    return info;
+}
+
 static int
 wixusb_probe(struct usb_interface *interface, const struct usb_device_id *id) {
     struct usb_wixusb *dev;
-    struct usb_host_interface *iface_desc;
     int retval = -ENOMEM;
 
     /* allocate memory for our device state and initialize it */
@@ -542,12 +3648,31 @@ wixusb_probe(struct usb_interface *interface, const struct usb_device_id *id) {
 
     kref_init(&dev->kref);
     mutex_init(&dev->io_mutex);
+    mutex_init(&dev->write_mutex);
+    spin_lock_init(&dev->sched.lock);
+    init_waitqueue_head(&dev->sched.wait);
+    memcpy(dev->sched.limit, wixusb_prio_limits, sizeof (dev->sched.limit));
+    mutex_init(&dev->files_lock);
+    INIT_LIST_HEAD(&dev->files);
+    INIT_LIST_HEAD(&dev->node);
+    init_waitqueue_head(&dev->wait);
+    spin_lock_init(&dev->park_lock);
+    INIT_LIST_HEAD(&dev->parked);
     dev->usbdev = usb_get_dev(interface_to_usbdev(interface));
     dev->interface = interface;
 
-    /* set up the endpoint information */
-    /* use interrupt-in and interrupt-out endpoints */
-    iface_desc = interface->cur_altsetting;
+    dev->alt = interface->cur_altsetting->desc.bAlternateSetting;
+    wixusb_find_pipes(dev, interface->cur_altsetting);
+
+    dev->info = wixusb_build_info(dev->usbdev, interface);
+    if (!dev->info)
+        goto error;
+
+    /* per CPU rather than unbound, the work stays where it was queued */
+    dev->wq = alloc_workqueue("wixusb-%s", WQ_HIGHPRI, 0,
+        dev_name(&interface->dev));
+    if (!dev->wq)
+        goto error;
 
     /* save our data pointer in this interface device */
     usb_set_intfdata(interface, dev);
@@ -563,11 +3688,21 @@ wixusb_probe(struct usb_interface *interface, const struct usb_device_id *id) {
         goto error;
     }
     atomic_set(&dev->open_counter, 0);
+    atomic_set(&dev->in_flight, 0);
     dev->idProduct = id->idProduct;
+
+    mutex_lock(&wixusb_devices_lock);
+    list_add_tail(&dev->node, &wixusb_devices);
+    mutex_unlock(&wixusb_devices_lock);
+
+    /* idle links suspend unless a handle turns AUTO_SUSPEND off */
+    usb_enable_autosuspend(dev->usbdev);
+
     /* let the user know what node this device is now attached to */
     dev_info(&interface->dev,
-        "WixUSB (%04X:%04X) device now attached to " WIXUSB_DEV_NAME "%d",
-        id->idVendor, id->idProduct, interface->minor);
+        "WixUSB (%04X:%04X) interface %d now attached to " WIXUSB_DEV_NAME "%d",
+        id->idVendor, id->idProduct,
+        interface->cur_altsetting->desc.bInterfaceNumber, interface->minor);
     return 0;
 
 error:
@@ -581,28 +3716,172 @@ error:
 static void
 wixusb_disconnect(struct usb_interface *interface) {
     struct usb_wixusb *dev;
+    struct wixusb_file *wf;
     int minor = interface->minor;
+    int i;
 
     dev = usb_get_intfdata(interface);
     usb_set_intfdata(interface, NULL);
 
+    mutex_lock(&wixusb_devices_lock);
+    list_del_init(&dev->node);
+    mutex_unlock(&wixusb_devices_lock);
+
     /* give back our minor */
     usb_deregister_dev(interface, &wixusb_class_driver);
 
+    /* fail transfers still waiting on the bus and reject new ones */
+    wixusb_unpark_all(dev, NULL, -ESHUTDOWN, true);
+    mutex_lock(&dev->files_lock);
+    list_for_each_entry(wf, &dev->files, node)
+    {
+        for (i = 0; i < WIXUSB_PIPE_COUNT; i++)
+            usb_poison_anchored_urbs(&wf->submitted[i]);
+        usb_poison_anchored_urbs(&wf->ctrl_submitted);
+    }
+    mutex_unlock(&dev->files_lock);
+
     /* prevent more I/O from starting */
     mutex_lock(&dev->io_mutex);
     dev->interface = NULL;
+    if (dev->bcast)
+        usb_poison_anchored_urbs(&dev->bcast->submitted);
+    /* the core frees the streams when it unbinds the interface */
+    dev->num_streams = 0;
     mutex_unlock(&dev->io_mutex);
 
+    /* no transfer starts without an interface, wait for those on the bus */
+    wait_event(dev->sched.wait, !atomic_read(&dev->in_flight));
+
+    /* broadcast readers and pollers see the hangup right away */
+    wake_up_interruptible_all(&dev->wait);
+
     kref_put(&dev->kref, wixusb_delete);
     wixusb_log("WIXUSB #%d now disconnected", minor);
 }
 
+/* Whether a URB on the anchor has moved data, such a URB is not parked */
+static bool
+wixusb_anchor_moved(struct usb_anchor *anchor) {
+    struct urb *urb;
+    unsigned long flags;
+    bool moved = false;
+
+    spin_lock_irqsave(&anchor->lock, flags);
+    list_for_each_entry(urb, &anchor->urb_list, anchor_list)
+    {
+        if (urb->actual_length)
+        {
+            moved = true;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&anchor->lock, flags);
+    return moved;
+}
+
+static int
+wixusb_suspend(struct usb_interface *interface, pm_message_t message) {
+    struct usb_wixusb *dev = usb_get_intfdata(interface);
+    struct wixusb_file *wf;
+    int retval = 0;
+    int i;
+
+    if (!dev)
+        return 0;
+
+    /* what the kills below take off the bus is resubmitted on resume */
+    if (!PMSG_IS_AUTO(message))
+    {
+        spin_lock_irq(&dev->park_lock);
+        dev->parking = true;
+        spin_unlock_irq(&dev->park_lock);
+    }
+
+    mutex_lock(&dev->files_lock);
+    list_for_each_entry(wf, &dev->files, node)
+    {
+        /* control transfers fail, they are not parked */
+        if (!PMSG_IS_AUTO(message))
+            usb_kill_anchored_urbs(&wf->ctrl_submitted);
+        for (i = 0; i < WIXUSB_PIPE_COUNT; i++)
+        {
+            if (usb_anchor_empty(&wf->submitted[i]))
+                continue;
+
+            /* transfers hold a PM reference, so this is a system sleep */
+            if (PMSG_IS_AUTO(message))
+            {
+                retval = -EBUSY;
+                goto exit;
+            }
+
+            /* one that moved data cannot be parked, give it time to finish */
+            if (wixusb_anchor_moved(&wf->submitted[i]))
+                usb_wait_anchor_empty_timeout(&wf->submitted[i], 1000);
+            usb_kill_anchored_urbs(&wf->submitted[i]);
+        }
+    }
+
+    /* the broadcast stream is parked and picks up again on resume */
+    if (dev->bcast)
+    {
+        spin_lock_irq(&dev->bcast->lock);
+        dev->bcast->suspended = true;
+        spin_unlock_irq(&dev->bcast->lock);
+        usb_kill_anchored_urbs(&dev->bcast->submitted);
+    }
+exit:
+    mutex_unlock(&dev->files_lock);
+    if (retval)
+        return retval;
+
+    wixusb_log("wixusb_suspend : %s", PMSG_IS_AUTO(message) ? "auto" : "system");
+    return 0;
+}
+
+/*
+ * Transfers queued behind io_mutex during suspend resume the device
+ * themselves, the parked ones and the broadcast stream are restarted.
+ */
+static int
+wixusb_resume(struct usb_interface *interface) {
+    struct usb_wixusb *dev = usb_get_intfdata(interface);
+
+    if (!dev)
+        return 0;
+
+    wixusb_resubmit_parked(dev);
+
+    mutex_lock(&dev->files_lock);
+    if (dev->bcast)
+    {
+        spin_lock_irq(&dev->bcast->lock);
+        dev->bcast->suspended = false;
+        wixusb_bcast_fill(dev->bcast);
+        spin_unlock_irq(&dev->bcast->lock);
+    }
+    mutex_unlock(&dev->files_lock);
+
+    wixusb_log("wixusb_resume");
+    return 0;
+}
+
+static int
+wixusb_reset_resume(struct usb_interface *interface) {
+    /* the reset cleared the halt features and data toggles */
+    return wixusb_resume(interface);
+}
+
 static struct usb_driver wixusb_driver = {
     .name = WIXUSB_DRV_NAME,
     .probe = wixusb_probe,
     .disconnect = wixusb_disconnect,
+    .suspend = wixusb_suspend,
+    .resume = wixusb_resume,
+    .reset_resume = wixusb_reset_resume,
     .id_table = wixusb_table,
+    .supports_autosuspend = 1,
 };
 
 #ifdef DEBUG
@@ -643,6 +3922,7 @@ MODULE_DESCRIPTION("WixUSB USB Driver");
 MODULE_ALIAS("WixUSB driver");
 MODULE_VERSION("0.9999");
 
+/* matches every interface of a composite device, each is probed on its own */
 static struct usb_device_id wixusb_table[] = {
     { USB_DEVICE(VENDOR_ID, 0x0001) },
     {}
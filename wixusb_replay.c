@@ -0,0 +1,397 @@
+/*
+ * The MIT License
+ *
+ * Copyright 2017 Ildar Sadykov <irsdkv@gmail.com>.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Replays the OUT bulk, OUT interrupt and vendor or class control transfers
+ * of one device from a usbmon capture (pcap, link type 189 or 220) against
+ * a wixusb node, then compares throughput and latency with the capture.
+ * Standard requests are left out, SET_ADDRESS or SET_CONFIGURATION from the
+ * enumeration would reconfigure the device under the driver.
+ *
+ * gcc -O2 -o wixusb_replay wixusb_replay.c winusb_wrapper.c winusb_iocp.c \
+ *     winusb_capture.c winusb_stats.c -lpthread
+ *
+ * Usage: wixusb_replay [-n node] [-b bus] [-d device] [-c] [-s speed]
+ *        capture.pcap
+ *   -c      also replay the vendor and class control requests with an IN
+ *           data stage, only OUT ones by default
+ *   -s 1    original timing (default)
+ *   -s 0    as fast as possible
+ *   -s N    N times the original speed, 0.5 is half speed
+ */
+
+#include "winusb_wrapper.h"
+#include "wixusb_ioctl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define PCAP_MAGIC_US       0xa1b2c3d4
+#define PCAP_MAGIC_NS       0xa1b23c4d
+#define LINKTYPE_USB_LINUX  189
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+
+#define USB_XFER_INT        1
+#define USB_XFER_CONTROL    2
+#define USB_XFER_BULK       3
+
+#define USB_REQ_TYPE_MASK   0x60 /* of bmRequestType */
+#define USB_REQ_TYPE_STANDARD 0x00
+
+/* pcap_usb_header, the mmapped variant adds 16 bytes after it */
+typedef struct {
+    uint64_t id;
+    uint8_t type;
+    uint8_t xfer_type;
+    uint8_t epnum;
+    uint8_t devnum;
+    uint16_t busnum;
+    char flag_setup;
+    char flag_data;
+    int64_t ts_sec;
+    int32_t ts_usec;
+    int32_t status;
+    uint32_t length;
+    uint32_t len_cap;
+    uint8_t setup[8];
+} usbmon_packet_t;
+
+typedef struct {
+    uint64_t id;
+    uint64_t submit_ns; /* capture time */
+    uint64_t orig_latency_ns;
+    BOOL completed; /* in the capture */
+    uint64_t replay_latency_ns;
+    uint8_t xfer_type;
+    uint8_t epnum;
+    WINUSB_SETUP_PACKET setup;
+    uint32_t length;
+    uint8_t *data;
+    int status; /* of the replay */
+} replay_xfer_t;
+
+static replay_xfer_t *xfers;
+static size_t nxfers;
+static size_t xfers_size;
+static BOOL replay_ctrl_in; /* -c */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline) {
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000ULL,
+        .tv_nsec = deadline % 1000000000ULL,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Submission of a transfer we replay */
+static int add_submit(const usbmon_packet_t *pkt, uint64_t ts,
+        const uint8_t *data) {
+    replay_xfer_t *x;
+
+    if (nxfers == xfers_size) {
+        size_t n = xfers_size ? 2 * xfers_size : 1024;
+        replay_xfer_t *tmp = realloc(xfers, n * sizeof (*tmp));
+
+        if (tmp == NULL)
+            return -1;
+        xfers = tmp;
+        xfers_size = n;
+    }
+
+    x = &xfers[nxfers];
+    memset(x, 0, sizeof (*x));
+    x->id = pkt->id;
+    x->submit_ns = ts;
+    x->xfer_type = pkt->xfer_type;
+    x->epnum = pkt->epnum;
+    x->length = pkt->length;
+    if (pkt->xfer_type == USB_XFER_CONTROL)
+        memcpy(&x->setup, pkt->setup, sizeof (x->setup));
+
+    /* control IN needs room for the data stage, the rest sends what was captured */
+    x->data = calloc(1, x->length ? x->length : 1);
+    if (x->data == NULL)
+        return -1;
+    if (!(pkt->epnum & 0x80))
+        memcpy(x->data, data, pkt->len_cap < x->length ? pkt->len_cap : x->length);
+
+    nxfers++;
+    return 0;
+}
+
+static void add_complete(const usbmon_packet_t *pkt, uint64_t ts) {
+    size_t i;
+
+    /* completions come shortly after their submission, search backwards */
+    for (i = nxfers; i-- > 0;) {
+        if (xfers[i].id == pkt->id && !xfers[i].completed) {
+            xfers[i].orig_latency_ns = ts > xfers[i].submit_ns ?
+                    ts - xfers[i].submit_ns : 0;
+            xfers[i].completed = TRUE;
+            return;
+        }
+    }
+}
+
+static BOOL wanted(const usbmon_packet_t *pkt, int bus, int dev) {
+    if ((bus >= 0 && pkt->busnum != bus) || (dev >= 0 && pkt->devnum != dev))
+        return FALSE;
+    /* a completion is kept only if its submission was */
+    if (pkt->xfer_type == USB_XFER_CONTROL && pkt->type != 'S')
+        return TRUE;
+    if (pkt->xfer_type == USB_XFER_CONTROL) {
+        if (pkt->flag_setup != 0 ||
+                (pkt->setup[0] & USB_REQ_TYPE_MASK) == USB_REQ_TYPE_STANDARD)
+            return FALSE;
+        return replay_ctrl_in || !(pkt->setup[0] & 0x80);
+    }
+    if (pkt->xfer_type == USB_XFER_BULK || pkt->xfer_type == USB_XFER_INT)
+        return !(pkt->epnum & 0x80);
+    return FALSE;
+}
+
+static int load_capture(const char *path, int bus, int dev) {
+    uint32_t ghdr[6], rhdr[4];
+    uint8_t *rec = NULL;
+    size_t hdr_len;
+    BOOL nsec;
+    FILE *f;
+    int retval = -1;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    if (fread(ghdr, sizeof (ghdr), 1, f) != 1 ||
+            (ghdr[0] != PCAP_MAGIC_US && ghdr[0] != PCAP_MAGIC_NS)) {
+        fprintf(stderr, "%s: not a pcap file of this byte order\n", path);
+        goto exit;
+    }
+    nsec = ghdr[0] == PCAP_MAGIC_NS;
+
+    if (ghdr[5] == LINKTYPE_USB_LINUX) {
+        hdr_len = 48;
+    } else if (ghdr[5] == LINKTYPE_USB_LINUX_MMAPPED) {
+        hdr_len = 64;
+    } else {
+        fprintf(stderr, "%s: link type %u is not usbmon\n", path, ghdr[5]);
+        goto exit;
+    }
+
+    rec = malloc(ghdr[4] ? ghdr[4] : 65535);
+    if (rec == NULL)
+        goto exit;
+
+    while (fread(rhdr, sizeof (rhdr), 1, f) == 1) {
+        usbmon_packet_t pkt;
+        uint64_t ts;
+
+        if (rhdr[2] > (ghdr[4] ? ghdr[4] : 65535) ||
+                fread(rec, rhdr[2], 1, f) != 1)
+            break;
+        if (rhdr[2] < hdr_len)
+            continue;
+
+        memcpy(&pkt, rec, sizeof (pkt));
+        ts = (uint64_t) rhdr[0] * 1000000000ULL +
+                (uint64_t) rhdr[1] * (nsec ? 1 : 1000);
+        if (!wanted(&pkt, bus, dev))
+            continue;
+
+        if (pkt.type == 'S') {
+            if (pkt.len_cap > rhdr[2] - hdr_len)
+                pkt.len_cap = rhdr[2] - hdr_len;
+            if (add_submit(&pkt, ts, rec + hdr_len) < 0)
+                goto exit;
+        } else if (pkt.type == 'C') {
+            add_complete(&pkt, ts);
+        }
+    }
+    retval = 0;
+
+exit:
+    free(rec);
+    fclose(f);
+    return retval;
+}
+
+static int replay_one(int fd, replay_xfer_t *x) {
+    ULONG len = 0;
+
+    switch (x->xfer_type) {
+        case USB_XFER_CONTROL:
+            return WinUsb_ControlTransfer(fd, x->setup, x->data, x->length,
+                    &len, NULL) == TRUE ? 0 : -errno;
+        case USB_XFER_INT:
+        {
+            wixusb_intrpt_packet pkt;
+
+            if (x->length > EP_SIZE)
+                return -EMSGSIZE;
+            pkt.length = x->length;
+            memcpy(pkt.data, x->data, x->length);
+            return ioctl(fd, IOCTL_WRITE_INT, &pkt) < 0 ? -errno : 0;
+        }
+        default:
+            return WixUsb_WriteBulk(fd, x->data, x->length, &len) == TRUE ?
+                    0 : -errno;
+    }
+}
+
+static void report_latency(const char *name, uint64_t *lat, size_t n) {
+    if (n == 0) {
+        printf("%-10s no samples\n", name);
+        return;
+    }
+    qsort(lat, n, sizeof (*lat), cmp_u64);
+    printf("%-10s p50 %8.1f us  p99 %8.1f us  max %8.1f us\n", name,
+            lat[n / 2] / 1e3, lat[(n * 99) / 100] / 1e3, lat[n - 1] / 1e3);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: wixusb_replay [-n node] [-b bus] [-d device] "
+            "[-c] [-s speed] capture.pcap\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *node = NULL;
+    double speed = 1.0;
+    int bus = -1, dev = -1;
+    uint64_t start, orig_span, replay_span, bytes = 0, orig_bytes = 0;
+    uint64_t *orig_lat, *replay_lat;
+    size_t i, norig = 0, nreplay = 0, failed = 0;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "n:b:d:cs:")) != -1) {
+        switch (opt) {
+            case 'n':
+                node = optarg;
+                break;
+            case 'b':
+                bus = atoi(optarg);
+                break;
+            case 'd':
+                dev = atoi(optarg);
+                break;
+            case 'c':
+                replay_ctrl_in = TRUE;
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc - 1 || speed < 0)
+        usage();
+
+    if (load_capture(argv[optind], bus, dev) < 0)
+        return 1;
+    if (nxfers == 0) {
+        fprintf(stderr, "no OUT or control transfers to replay\n");
+        return 1;
+    }
+
+    fd = node ? open(node, O_RDWR) : WinUsb_Connect();
+    if (fd < 0) {
+        perror(node ? node : "wixusb device");
+        return 1;
+    }
+
+    printf("replaying %zu transfers", nxfers);
+    if (speed > 0)
+        printf(" at %.2fx\n", speed);
+    else
+        printf(" as fast as possible\n");
+
+    start = now_ns();
+    for (i = 0; i < nxfers; i++) {
+        replay_xfer_t *x = &xfers[i];
+        uint64_t t;
+
+        if (speed > 0)
+            sleep_until(start +
+                    (uint64_t) ((x->submit_ns - xfers[0].submit_ns) / speed));
+
+        t = now_ns();
+        x->status = replay_one(fd, x);
+        x->replay_latency_ns = now_ns() - t;
+        if (x->status)
+            failed++;
+        else
+            bytes += x->length;
+    }
+    replay_span = now_ns() - start;
+    close(fd);
+
+    orig_span = xfers[nxfers - 1].submit_ns + xfers[nxfers - 1].orig_latency_ns -
+            xfers[0].submit_ns;
+
+    orig_lat = calloc(nxfers, sizeof (*orig_lat));
+    replay_lat = calloc(nxfers, sizeof (*replay_lat));
+    if (orig_lat == NULL || replay_lat == NULL)
+        return 1;
+    for (i = 0; i < nxfers; i++) {
+        orig_bytes += xfers[i].length;
+        if (xfers[i].completed)
+            orig_lat[norig++] = xfers[i].orig_latency_ns;
+        if (!xfers[i].status)
+            replay_lat[nreplay++] = xfers[i].replay_latency_ns;
+    }
+
+    printf("transfers  %zu ok, %zu failed\n", nxfers - failed, failed);
+    printf("duration   capture %.3f s  replay %.3f s\n", orig_span / 1e9,
+            replay_span / 1e9);
+    printf("throughput capture %.3f MB/s  replay %.3f MB/s\n",
+            orig_span ? orig_bytes / (orig_span / 1e9) / 1e6 : 0.0,
+            replay_span ? bytes / (replay_span / 1e9) / 1e6 : 0.0);
+    report_latency("capture", orig_lat, norig);
+    report_latency("replay", replay_lat, nreplay);
+
+    return failed ? 1 : 0;
+}